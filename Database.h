@@ -1,56 +1,77 @@
-#pragma once
-
-#include "Logger.h"
-#include <string>
-#include <vector>
-#include "lib/sqlite3.h"
-
-class Database {
-public:
-    struct Contact {
-        int id;
-        std::string pubkey;
-        std::wstring name;
-        std::string host;
-    };
-    Database(Logger& logger)
-        : log(logger)
-    {}
-    ~Database();
-    bool OpenOrCreate(const std::wstring& path);
-    void GetKeys(std::string* pub, std::string* priv);
-    std::vector<Contact> GetContacts();
-    void AddContact(const std::string& pubkey, const std::wstring& name);
-    void UpdateContactName(std::string pubkey, const std::wstring& name);
-private:
-    class Stmt {
-    public:
-        Stmt(sqlite3_stmt* stmt)
-            : stmt(stmt)
-        {}
-        Stmt(const Stmt&) = delete;
-        Stmt(Stmt&& other)
-            : stmt(other.stmt)
-        {
-            other.stmt = nullptr;
-        }
-        ~Stmt() {
-            sqlite3_finalize(stmt);
-        }
-        sqlite3_stmt* get() {
-            return stmt;
-        }
-    private:
-        sqlite3_stmt* stmt = nullptr;
-    };
-
-    sqlite3* db = nullptr;
-    Logger& log;
-
-    Stmt createStatement(const char* sql);
-    void queryExec(const char* sql);
-    int queryInt(const char* sql);
-
-    void initSchema();
-    void upgradeDb(int oldver);
-};
+#pragma once
+
+#include "Logger.h"
+#include <string>
+#include <vector>
+#include "lib/sqlite3.h"
+
+class Database {
+public:
+    struct Contact {
+        int id;
+        std::string pubkey;
+        std::wstring name;
+        std::string host;
+    };
+    // A received file whose transfer was interrupted, kept to be resumed if the same file is
+    // sent again
+    struct PartialFile {
+        // What identifies it: the sender, and the name, size and identity it sent
+        std::string pubkey;
+        std::string name;
+        uint64_t size = 0;
+        std::string identity;
+        // Its .part file, and how much of its start has been written
+        std::wstring path;
+        uint64_t length = 0;
+    };
+    Database(Logger& logger)
+        : log(logger)
+    {}
+    ~Database();
+    bool OpenOrCreate(const std::wstring& path);
+    void GetKeys(std::string* pub, std::string* priv);
+    std::vector<Contact> GetContacts();
+    void AddContact(const std::string& pubkey, const std::wstring& name);
+    void UpdateContactName(std::string pubkey, const std::wstring& name);
+    // Integer stored in the settings table, defaultValue if there is none
+    int64_t GetIntSetting(const std::string& key, int64_t defaultValue);
+    void SetIntSetting(const std::string& key, int64_t value);
+    // Used by the receive thread, sqlite serializes it with the other queries.
+    // Fills in path and length for the key in file, returns false if there is none.
+    bool GetPartialFile(PartialFile& file);
+    // Adds or updates the entry of file.path
+    void SetPartialFile(const PartialFile& file);
+    void DeletePartialFile(const std::wstring& path);
+private:
+    class Stmt {
+    public:
+        Stmt(sqlite3_stmt* stmt)
+            : stmt(stmt)
+        {}
+        Stmt(const Stmt&) = delete;
+        Stmt(Stmt&& other)
+            : stmt(other.stmt)
+        {
+            other.stmt = nullptr;
+        }
+        ~Stmt() {
+            sqlite3_finalize(stmt);
+        }
+        sqlite3_stmt* get() {
+            return stmt;
+        }
+    private:
+        sqlite3_stmt* stmt = nullptr;
+    };
+
+    sqlite3* db = nullptr;
+    Logger& log;
+
+    Stmt createStatement(const char* sql);
+    void queryExec(const char* sql);
+    int queryInt(const char* sql);
+
+    void initSchema();
+    void upgradeDb(int oldver);
+};
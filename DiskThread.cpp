@@ -1,435 +1,920 @@
-#include "DiskThread.h"
-#include "proto/file.h"
-#include "proto/Serializer.h"
-#include "lib/win/encoding.h"
-#include "lib/win/raii.h"
-#include <ShlObj.h>
-
-DiskThread::DiskThread(Logger* logger, SocketThreadApi* socketThread, const std::wstring& receivePath)
-    : log(*logger)
-    , socketThread_(socketThread)
-    , receivePath_(receivePath)
-{
-    socketThread_->setQueueEmptyCb([this](const Contact& c) {
-        RunInThread([this, c] {
-            auto iter = corked_.find(c);
-            if (iter == corked_.end()) {
-                return;
-            }
-            uncorked_[c] = std::move(iter->second);
-            corked_.erase(iter);
-            DoWriteLoop();
-        });
-    });
-
-    socketThread_->setOnMessageCb([this](const Contact& c, Buffer::UniquePtr message) {
-        Buffer* p = message.release();
-        RunInThread([this, c, p]() {
-            OnMessageReceived(c, Buffer::UniquePtr(p));
-        });
-    });
-}
-
-void DiskThread::Enqueue(const Contact& c, const std::wstring& filename) {
-    RunInThread([this, c, filename] {
-        log.i(L"Enqueued file '{}'", filename);
-        size_t index = filename.rfind(L'\\');
-        std::wstring relativeFilename = index == std::wstring::npos ? filename : filename.substr(index + 1);
-        if (paused_.find(c) != paused_.end()) {
-            paused_[c]->queue_.emplace_back(c, filename, relativeFilename);
-        } else if (corked_.find(c) != corked_.end()) {
-            corked_[c]->queue_.emplace_back(c, filename, relativeFilename);
-        } else {
-            if (uncorked_.find(c) == uncorked_.end()) {
-                uncorked_[c] = std::make_unique<SendData>();
-            }
-            uncorked_[c]->queue_.emplace_back(c, filename, relativeFilename);
-            DoWriteLoop();
-        }
-    });
-}
-
-void DiskThread::Enqueue(const Contact& c, const std::wstring& dir, const std::vector<std::wstring>& files) {
-    RunInThread([this, c, dir, files] {
-        bool callDoWriteLoop = false;
-        SendData* sendData;
-        if (paused_.find(c) != paused_.end()) {
-            sendData = paused_[c].get();
-        } else if (corked_.find(c) != corked_.end()) {
-            sendData = corked_[c].get();
-        } else {
-            if (uncorked_.find(c) == uncorked_.end()) {
-                uncorked_[c] = std::make_unique<SendData>();
-            }
-            sendData = uncorked_[c].get();
-            callDoWriteLoop = true;
-        }
-
-        uint32_t count = files.size();
-        uint64_t size = 0;
-        for (const std::wstring& name : files) {
-            std::wstring filename = dir + L"\\" + name;
-            HANDLE hFile = CreateFile(filename.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
-                NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
-
-            if (hFile == INVALID_HANDLE_VALUE) {
-                log.e(L"Can't open file {}", filename);
-                continue;
-            }
-            LARGE_INTEGER liSize;
-            GetFileSizeEx(hFile, &liSize);
-            CloseHandle(hFile);
-
-            size += liSize.QuadPart;
-        }
-        sendData->queue_.emplace_back(c, count, size);
-        for (const std::wstring& name : files) {
-            std::wstring filename = dir + L"\\" + name;
-            sendData->queue_.emplace_back(c, std::move(filename), name, true);
-        }
-
-        log.i(L"Enqueued {} files, {} bytes", count, size);
-
-        if (callDoWriteLoop) {
-            DoWriteLoop();
-        }
-    });
-}
-
-void DiskThread::setProgressUpdateCb(std::function<void(const Contact& c, const ProgressUpdate& up)> cb) {
-    progressUpdateCb_ = std::move(cb);
-}
-
-void DiskThread::DoWriteLoop() {
-    if (!uncorked_.empty()) {
-        RunInThread([this] {
-            if (!uncorked_.empty()) {
-                DoWriteLoopImpl(uncorked_.begin());
-            }
-        });
-    }
-}
-
-void DiskThread::DoWriteLoopImpl(Map::iterator iter) {
-    enum { MAX_CHUNK = 65536 };
-    std::deque<QueueItem>& queue = iter->second->queue_;
-    if (queue.empty()) {
-        uncorked_.erase(iter);
-        return;
-    }
-    SCOPE_EXIT{
-        DoWriteLoop();
-    };
-    const Contact& c = iter->first;
-    QueueItem& item = queue.front();
-
-    if (item.state == QueueItem::State::SEND_FILE_LIST_HEADER) {
-        SendFileListHeader header;
-        header.count = item.count;
-        header.size = item.size;
-        Buffer::UniquePtr buffer = Serializer().serialize(header);
-        SendBufferToContact(c, SENDFILE_LIST, std::move(buffer));
-
-        progressMap_[c].send.totalBytes += item.size;
-        progressMap_[c].send.totalFiles += item.count;
-        MaybeSendProgressUpdate(c, true);
-
-        queue.pop_front();
-        return;
-    }
-
-    if (item.state == QueueItem::State::SEND_HEADER) {
-        HANDLE hFile = CreateFile(item.filename.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
-            NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
-
-        if (hFile == INVALID_HANDLE_VALUE) {
-            log.e(L"Can't open file {}", item.filename);
-            queue.pop_front();
-            return;
-        }
-        log.i(L"Starting to send '{}'", item.filename);
-
-        item.hFile = hFile;
-        item.state = QueueItem::State::SEND_DATA;
-        LARGE_INTEGER size;
-        GetFileSizeEx(hFile, &size);
-
-        if (!item.dontUpdateSizes) {
-            progressMap_[c].send.totalBytes += size.QuadPart;
-            progressMap_[c].send.totalFiles++;
-            MaybeSendProgressUpdate(c, true);
-        }
-
-
-        SendFileHeader header;
-        header.name = Utf16ToUtf8(item.relativeFilename);
-        header.size = size.QuadPart;
-        Buffer::UniquePtr buffer = Serializer().serialize(header);
-        if (SendBufferToContact(c, SENDFILE_HEADER, std::move(buffer))) {
-            return;
-        }
-    }
-
-    if (item.state == QueueItem::State::SEND_DATA) {
-        int numBuffers = 0;
-        while (true) {
-            Buffer::UniquePtr buffer(Buffer::create(MAX_CHUNK));
-            DWORD count;
-            bool success = ReadFile(item.hFile, buffer->writeData(),
-                buffer->writeSize(), &count, NULL);
-            if (!success) {
-                log.e(L"Error reading from file '{}'", item.filename);
-                CloseHandle(item.hFile);
-                queue.pop_front();
-                //CloseSocket(s);
-                return;
-            }
-            if (count == 0) {
-                // EOF
-                log.i(L"Finished sending file '{}'", item.filename);
-                CloseHandle(item.hFile);
-                item.state = QueueItem::State::SEND_TRAILER;
-                //CloseSocket(s);
-                return;
-            }
-            item.hash.update(buffer->writeData(), count);
-            buffer->adjustWritePos(count);
-            progressMap_[c].send.doneBytes += count;
-            MaybeSendProgressUpdate(c);
-            bool shouldCork = SendBufferToContact(c, SENDFILE_DATA, std::move(buffer));
-            numBuffers++;
-            if (shouldCork || numBuffers >= MAX_BUFFERS_TO_SEND) {
-                return;
-            }
-        }
-    }
-
-    if (item.state == QueueItem::State::SEND_TRAILER) {
-        SendFileTrailer trailer;
-        trailer.checksum = item.hash.result();
-        Buffer::UniquePtr buffer = Serializer().serialize(trailer);
-        // Ignore possible corking, since this is the last buffer
-        progressMap_[c].send.doneFiles++;
-        MaybeSendProgressUpdate(c, true);
-        SendBufferToContact(c, SENDFILE_TRAILER, std::move(buffer));
-        queue.pop_front();
-    }
-}
-
-bool DiskThread::SendBufferToContact(const Contact& c, MessageType type, Buffer::UniquePtr buffer) {
-    Header header;
-    header.streamId = 5555;
-    header.type = type;
-    uint8_t* buf = buffer->prependHeader(sizeof(header));
-    memcpy(buf, &header, sizeof(header));
-    bool shouldCork = socketThread_->SendBuffer(c, buffer.release());
-    if (shouldCork) {
-        corked_[c] = std::move(uncorked_[c]);
-        uncorked_.erase(c);
-    }
-    return shouldCork;
-}
-
-void DiskThread::OnMessageReceived(const Contact& c, Buffer::UniquePtr message) {
-    Header header;
-    memcpy(&header, message->buffer(), sizeof(header));
-    message->adjustReadPos(sizeof(header));
-
-    if (header.streamId != 5555) {
-        log.e(L"Bad streamId {}", header.streamId);
-        return;
-    }
-
-    ReceiveData& data = receive_[c];
-    if (data.state == ReceiveData::State::RECEIVE_HEADER) {
-        if (header.type == SENDFILE_LIST) {
-            SendFileListHeader fileListHeader;
-            if (!Serializer().deserialize(fileListHeader, message.get())) {
-                log.e(L"Can't deserialize SendFileListHeader");
-                return;
-            }
-            if (fileListHeader.count > 0) {
-                data.receiveDir = makeReceiveDir();
-                data.filelistCount = fileListHeader.count;
-                data.filelistCountDone = 0;
-                ProgressUpdate::Stats& stats = progressMap_[c].recv;
-                stats.totalFiles += fileListHeader.count;
-                stats.totalBytes += fileListHeader.size;
-                MaybeSendProgressUpdate(c, true);
-                log.i(L"Going to receive {} files, {} bytes", fileListHeader.count, fileListHeader.size);
-            }
-            return;
-        }
-
-        if (header.type != SENDFILE_HEADER) {
-            log.e(L"Expected type SENDFILE_HEADER, got {}", header.type);
-            return;
-        }
-        SendFileHeader fileHeader;
-        if (!Serializer().deserialize(fileHeader, message.get())) {
-            log.e(L"Can't deserialize SendFileHeader");
-            return;
-        }
-        std::wstring origFilename = Utf8ToUtf16(fileHeader.name);
-        log.i(L"Receiving file '{}' of size {}", origFilename, fileHeader.size);
-
-        if (data.filelistCountDone == data.filelistCount) {
-            data.receiveDir.clear();
-            data.filelistCount++;
-            ProgressUpdate::Stats& stats = progressMap_[c].recv;
-            stats.totalFiles++;
-            stats.totalBytes += fileHeader.size;
-            MaybeSendProgressUpdate(c, true);
-        }
-
-        std::wstring filename;
-        HANDLE hFile = GetReceiveFile(data.receiveDir, origFilename, filename);
-
-        if (hFile == INVALID_HANDLE_VALUE) {
-            log.e(L"Can't create file {}", origFilename);
-            return;
-        }
-
-        data.hReceiveFile = hFile;
-        data.receiveFilename = filename;
-        data.receivedCount = 0;
-        data.receiveSize = fileHeader.size;
-        data.hash.reset();
-        data.state = ReceiveData::State::RECEIVE_DATA_OR_TRAILER;
-    } else if (data.state == ReceiveData::State::RECEIVE_DATA_OR_TRAILER) {
-        if (header.type == SENDFILE_DATA) {
-            data.hash.update(message->readData(), message->readSize());
-            data.receivedCount += message->readSize();
-            progressMap_[c].recv.doneBytes += message->readSize();
-            while (message->readSize() != 0) {
-                DWORD count;
-                if (!WriteFile(data.hReceiveFile, message->readData(), message->readSize(), &count, NULL)) {
-                    log.e(L"Error writing to file being received '{}'", data.receiveFilename);
-                    CloseHandle(data.hReceiveFile);
-                    data.hReceiveFile = NULL;
-                    return;
-                }
-                message->adjustReadPos(count);
-            }
-            MaybeSendProgressUpdate(c);
-        } else if (header.type == SENDFILE_TRAILER) {
-            CloseHandle(data.hReceiveFile);
-            data.hReceiveFile = NULL;
-            SendFileTrailer fileTrailer;
-            if (!Serializer().deserialize(fileTrailer, message.get())) {
-                log.e(L"Can't deserialize SendFileTrailer");
-                return;
-            }
-            std::string dataHash = data.hash.result();
-            if (data.receivedCount != data.receiveSize) {
-                log.e(L"Bad size for file '{}', expected {}, received {} bytes",
-                    data.receiveFilename, data.receiveSize, data.receivedCount);
-            } else if (dataHash != fileTrailer.checksum) {
-                log.e(L"Corrupt file '{}', expected hash {}, actual {}",
-                    data.receiveFilename, keyToDisplayStr(fileTrailer.checksum), keyToDisplayStr(dataHash));
-            } else {
-                log.i(L"Finished receiving file '{}', checksum OK", data.receiveFilename);
-                // The move will fail if the destination file exists, and the .part file will live on.
-                // This is better than overwriting an existing file
-                MoveFile((data.receiveFilename + L".part").c_str(), data.receiveFilename.c_str());
-            }
-            data.filelistCountDone++;
-            if (data.filelistCountDone == data.filelistCount) {
-                data.receiveDir.clear();
-            }
-            progressMap_[c].recv.doneFiles++;
-            MaybeSendProgressUpdate(c, true);
-            data.state = ReceiveData::State::RECEIVE_HEADER;
-        } else {
-            log.e(L"Expected type SENDFILE_DATA or SENDFILE_TRAILER, got {}", header.type);
-            CloseHandle(data.hReceiveFile);
-            data.hReceiveFile = NULL;
-            return;
-        }
-    }
-
-}
-
-HANDLE DiskThread::GetReceiveFile(const std::wstring receiveDir, const std::wstring& origFilename, std::wstring& filename) {
-    if (origFilename.empty() || origFilename.find(L':') != std::wstring::npos || origFilename[0] == L'\\') {
-        return INVALID_HANDLE_VALUE;
-    }
-    size_t index = origFilename.rfind(L'\\');
-    if (index != std::wstring::npos) {
-        std::wstring dirToMake = receiveDir + L"\\" + origFilename.substr(0, index);
-        int error = SHCreateDirectory(NULL, dirToMake.c_str());
-        if (error != ERROR_SUCCESS && error != ERROR_ALREADY_EXISTS) {
-            return INVALID_HANDLE_VALUE;
-        }
-    }
-    for (int i = 0; i < 20; i++) {
-        std::wstring tempFilename = origFilename;
-        if (i != 0) {
-            size_t dotPos = tempFilename.rfind(L'.');
-            if (dotPos == std::wstring::npos) {
-                tempFilename += L"-" + std::to_wstring(i);
-            } else {
-                tempFilename = tempFilename.substr(0, dotPos) + L"-" + std::to_wstring(i) + tempFilename.substr(dotPos);
-            }
-        }
-        std::wstring candidateFilename = (receiveDir.empty() ? receivePath_ : receiveDir) + L"\\" + tempFilename;
-        std::wstring candidateFilenamePart = candidateFilename + L".part";
-
-        HANDLE hFile = CreateFile(candidateFilename.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
-            NULL, CREATE_NEW, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_DELETE_ON_CLOSE, NULL);
-        if (hFile == INVALID_HANDLE_VALUE) {
-            continue;
-        }
-
-        HANDLE hPartFile = CreateFile(candidateFilenamePart.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
-            NULL, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, NULL);
-        if (hPartFile == INVALID_HANDLE_VALUE) {
-            CloseHandle(hFile);
-            continue;
-        }
-
-        CloseHandle(hFile);
-        filename = candidateFilename;
-        return hPartFile;
-    }
-    return INVALID_HANDLE_VALUE;
-}
-
-std::wstring DiskThread::makeReceiveDir() {
-    auto now = std::chrono::system_clock::now();
-    std::time_t t = std::chrono::system_clock::to_time_t(now);
-    struct tm tm;
-    localtime_s(&tm, &t);
-    std::wstring timeStr = fmt::format(L"{}-{:02}-{:02} {:02}-{:02}-{:02}",
-        tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
-        tm.tm_hour, tm.tm_min, tm.tm_sec);
-
-    std::wstring prefix = receivePath_ + L"\\" + timeStr;
-
-    for (int i = 0; i < 20; i++) {
-        std::wstring path = i == 0 ? prefix : fmt::format(L"{}-{}", prefix, i);
-        if (CreateDirectory(path.c_str(), NULL)) {
-            return path;
-        }
-    }
-
-    return L"";
-}
-
-void DiskThread::MaybeSendProgressUpdate(const Contact& c, bool force) {
-    if (!progressUpdateCb_) {
-        return;
-    }
-    auto it = progressMap_.find(c);
-    if (it == progressMap_.end()) {
-        return;
-    }
-    ProgressUpdate& data = it->second;
-    auto now = std::chrono::steady_clock::now();
-    if (!force && now - data.timestamp < std::chrono::milliseconds(500)) {
-        return;
-    }
-    data.timestamp = now;
-
-    progressUpdateCb_(c, data);
-}
+#include "DiskThread.h"
+#include "proto/file.h"
+#include "proto/Serializer.h"
+#include "lib/win/encoding.h"
+#include "lib/win/raii.h"
+#include <algorithm>
+#include <assert.h>
+
+DiskThread::DiskThread(Logger* logger, SocketThreadApi* socketThread, ProgressTracker* progress)
+    : log(*logger)
+    , socketThread_(socketThread)
+    , progress_(progress)
+    , fileIo_(FileIo::create(FileIo::NATIVE))
+    , hashPool_(std::max(1u, std::thread::hardware_concurrency()) - 1)
+{
+    socketThread_->setFeatures(FEATURE_STREAMS | FEATURE_RESUME | FEATURE_MERKLE | FEATURE_BUNDLES | FEATURE_LIST_PARTS);
+    socketThread_->setQueueEmptyCb([this](const Contact& c) {
+        RunInThread([this, c] {
+            auto iter = corked_.find(c);
+            if (iter == corked_.end()) {
+                return;
+            }
+            Uncork(c, std::move(iter->second));
+            corked_.erase(iter);
+            DoWriteLoop();
+        });
+    });
+}
+
+void DiskThread::Enqueue(const Contact& c, const std::wstring& filename) {
+    RunInThread([this, c, filename] {
+        log.i(L"Enqueued file '{}'", filename);
+        size_t index = filename.rfind(L'\\');
+        bool callDoWriteLoop = false;
+        SendData& sendData = GetSendData(c, callDoWriteLoop);
+        sendData.queue_.emplace_back();
+        QueuedList& list = sendData.queue_.back();
+        list.single = true;
+        list.headerSent = true;
+        if (index != std::wstring::npos) {
+            list.dir = filename.substr(0, index);
+        }
+        list.files.push_back(QueuedFile{ 0, list.names.add(filename.substr(index + 1)), false });
+        if (callDoWriteLoop) {
+            DoWriteLoop();
+        }
+    });
+}
+
+void DiskThread::EnqueueListPart(const Contact& c, const std::wstring& dir, uint32_t listId,
+    std::vector<TreeWalker::Entry> files, bool last) {
+    RunInThread([this, c, dir, listId, files = std::move(files), last]() mutable {
+        // A list stays sent the way it started if c reconnects meanwhile
+        bool parts = openLists_.count(listId) != 0 ||
+            (heldLists_.count(listId) == 0 && (socketThread_->GetFeatures(c) & FEATURE_LIST_PARTS));
+        if (!parts) {
+            // Sent as one list, the receiver would make a directory for each part
+            std::vector<TreeWalker::Entry>& heldFiles = heldLists_[listId];
+            heldFiles.insert(heldFiles.end(), std::make_move_iterator(files.begin()), std::make_move_iterator(files.end()));
+            if (!last) {
+                return;
+            }
+            files = std::move(heldFiles);
+            heldLists_.erase(listId);
+        }
+        if (files.empty() && openLists_.count(listId) == 0) {
+            log.e(L"No files to send");
+            return;
+        }
+
+        bool callDoWriteLoop = false;
+        SendData& sendData = GetSendData(c, callDoWriteLoop);
+        uint64_t size = 0;
+        for (const TreeWalker::Entry& entry : files) {
+            size += entry.size;
+        }
+        sendData.queue_.emplace_back();
+        QueuedList& list = sendData.queue_.back();
+        list.dir = dir;
+        list.size = size;
+        if (parts) {
+            list.listId = listId;
+            list.moreParts = !last;
+            if (last) {
+                openLists_.erase(listId);
+            } else {
+                openLists_.insert(listId);
+            }
+        }
+        list.files.reserve(files.size());
+        for (const TreeWalker::Entry& entry : files) {
+            list.files.push_back(QueuedFile{ entry.size, list.names.add(entry.name), true });
+        }
+
+        if (!files.empty()) {
+            log.i(L"Enqueued {} files, {} bytes", files.size(), size);
+        }
+
+        if (callDoWriteLoop) {
+            DoWriteLoop();
+        }
+    });
+}
+
+void DiskThread::setWeight(const Contact& c, uint32_t weight) {
+    RunInThread([this, c, weight] {
+        weights_[c] = std::clamp<uint32_t>(weight, 1, MAX_WEIGHT);
+    });
+}
+
+void DiskThread::setRateLimit(uint64_t bytesPerSecond) {
+    RunInThread([this, bytesPerSecond] {
+        rateLimit_.setRate(bytesPerSecond, RateLimitBurst(bytesPerSecond));
+        WakeThrottled(true);
+    });
+}
+
+void DiskThread::setRateLimit(const Contact& c, uint64_t bytesPerSecond) {
+    RunInThread([this, c, bytesPerSecond] {
+        contactRateLimits_[c].setRate(bytesPerSecond, RateLimitBurst(bytesPerSecond));
+        WakeThrottled(true);
+    });
+}
+
+uint64_t DiskThread::RateLimitBurst(uint64_t bytesPerSecond) {
+    // Wakeups are late by a timer tick, or by other contacts' turns when busy. Allow catching up
+    // for a while, or the limit would not be reached
+    return std::max<uint64_t>(RATE_LIMIT_MIN_BURST, bytesPerSecond * RATE_LIMIT_BURST_MS / 1000);
+}
+
+void DiskThread::ScheduleThrottleTimer() {
+    auto next = std::min_element(throttled_.begin(), throttled_.end(), [](const auto& a, const auto& b) {
+        return a.second < b.second;
+    })->second;
+    auto delay = std::chrono::ceil<std::chrono::milliseconds>(next - std::chrono::steady_clock::now());
+    SetTimer(GetHWND(), THROTTLE_TIMER_ID, (UINT)std::max<int64_t>(delay.count(), 1), NULL);
+}
+
+void DiskThread::WakeThrottled(bool all) {
+    if (throttled_.empty()) {
+        return;
+    }
+    auto now = std::chrono::steady_clock::now();
+    for (auto it = throttled_.begin(); it != throttled_.end();) {
+        if (all || it->second <= now) {
+            if (it->first.pubkey.empty()) {
+                globalThrottled_ = false;
+            } else {
+                // It's late already, and it only sends what its limit allows, so it goes first
+                ready_.push_front(it->first);
+            }
+            it = throttled_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    KillTimer(GetHWND(), THROTTLE_TIMER_ID);
+    if (!throttled_.empty()) {
+        ScheduleThrottleTimer();
+    }
+    DoWriteLoop();
+}
+
+std::optional<LRESULT> DiskThread::HandleMessage(UINT uMsg, WPARAM wParam, LPARAM lParam) {
+    if (uMsg == WM_TIMER && wParam == THROTTLE_TIMER_ID) {
+        WakeThrottled(false);
+        return (LRESULT)0;
+    }
+    return std::nullopt;
+}
+
+uint32_t DiskThread::GetWeight(const Contact& c) {
+    auto it = weights_.find(c);
+    return it == weights_.end() ? 1 : it->second;
+}
+
+DiskThread::SendData& DiskThread::GetSendData(const Contact& c, bool& callDoWriteLoop) {
+    if (paused_.find(c) != paused_.end()) {
+        return *paused_[c];
+    }
+    if (corked_.find(c) != corked_.end()) {
+        return *corked_[c];
+    }
+    if (uncorked_.find(c) == uncorked_.end()) {
+        Uncork(c, std::make_unique<SendData>());
+    }
+    callDoWriteLoop = true;
+    return *uncorked_[c];
+}
+
+void DiskThread::Uncork(const Contact& c, std::unique_ptr<SendData> sendData) {
+    assert(std::find(ready_.begin(), ready_.end(), c) == ready_.end());
+    // Its turn finds out if it still waits for the disk, and OnItemReady mustn't add it again
+    sendData->waitingForDisk = false;
+    uncorked_[c] = std::move(sendData);
+    ready_.push_back(c);
+}
+
+void DiskThread::Cork(const Contact& c) {
+    auto it = uncorked_.find(c);
+    if (it == uncorked_.end()) {
+        return;
+    }
+    corked_[c] = std::move(it->second);
+    uncorked_.erase(it);
+    // Whether it's on its turn or a message was sent between turns, it waits for queueEmptyCb
+    Unschedule(c);
+}
+
+void DiskThread::Unschedule(const Contact& c) {
+    ready_.erase(std::remove(ready_.begin(), ready_.end(), c), ready_.end());
+    if (throttled_.erase(c) != 0) {
+        KillTimer(GetHWND(), THROTTLE_TIMER_ID);
+        if (!throttled_.empty()) {
+            ScheduleThrottleTimer();
+        }
+    }
+}
+
+void DiskThread::DoWriteLoop() {
+    if (!ready_.empty() && !globalThrottled_) {
+        RunInThread([this] {
+            if (!ready_.empty() && !globalThrottled_) {
+                DoWriteLoopImpl();
+            }
+        });
+    }
+}
+
+// Deficit round robin over the uncorked contacts: on its turn a contact may send
+// DRR_QUANTUM bytes times its weight, going over or under is settled on its next turn
+void DiskThread::DoWriteLoopImpl() {
+    SCOPE_EXIT{
+        DoWriteLoop();
+    };
+    const Contact c = ready_.front();
+    ready_.pop_front();
+    auto iter = uncorked_.find(c);
+    // Cork and Unschedule keep ready_ to uncorked contacts
+    assert(iter != uncorked_.end());
+    if (iter == uncorked_.end()) {
+        return;
+    }
+    SendData& sendData = *iter->second;
+    if (sendData.deficit <= 0) {
+        // Otherwise this is the rest of a turn interrupted by the global rate limit
+        sendData.deficit += (int64_t)DRR_QUANTUM * GetWeight(c);
+    }
+    while (sendData.deficit > 0) {
+        if (sendData.queue_.empty() && sendData.active_.empty()) {
+            uncorked_.erase(iter);
+            Unschedule(c);
+            return;
+        }
+        auto now = std::chrono::steady_clock::now();
+        auto delay = rateLimit_.delay(now);
+        if (delay > delay.zero()) {
+            // Everyone waits, and then this contact goes on with its turn
+            ready_.push_front(c);
+            globalThrottled_ = true;
+            throttled_[Contact()] = now + delay;
+            ScheduleThrottleTimer();
+            return;
+        }
+        TokenBucket& contactLimit = contactRateLimits_[c];
+        delay = contactLimit.delay(now);
+        if (delay > delay.zero()) {
+            // The contact gets its next turn when it has tokens again
+            sendData.deficit = 0;
+            throttled_[c] = now + delay;
+            ScheduleThrottleTimer();
+            return;
+        }
+        size_t sent = SendNextBuffer(c, sendData);
+        rateLimit_.consume(sent, now);
+        contactLimit.consume(sent, now);
+        sendData.deficit -= sent;
+        sentBytes_[c] += sent;
+        if (corked_.find(c) != corked_.end()) {
+            // A contact that can't take more gives up the rest of its turn
+            sendData.deficit = 0;
+            return;
+        }
+        if (sendData.waitingForDisk) {
+            // Same when the disk can't keep up, OnItemReady gives it a new turn
+            sendData.deficit = 0;
+            return;
+        }
+    }
+    ready_.push_back(c);
+    MaybeLogSendRates();
+}
+
+size_t DiskThread::SendNextBuffer(const Contact& c, SendData& sendData) {
+    std::deque<QueuedList>& queue = sendData.queue_;
+    std::deque<QueueItem>& active = sendData.active_;
+    bool multiStream = (socketThread_->GetFeatures(c) & FEATURE_STREAMS) != 0;
+
+    bool listHeaderNext = !queue.empty() && !queue.front().headerSent;
+    if (listHeaderNext && std::none_of(active.begin(), active.end(), [](const QueueItem& item) {
+        return item.state == QueueItem::State::SEND_BUNDLE;
+    })) {
+        // All files of the previous list have been started, and their bundles sent, so the receiver
+        // won't confuse them
+        QueuedList& list = queue.front();
+        SendFileListHeader header;
+        header.count = (uint32_t)list.files.size();
+        header.size = list.size;
+        header.listId = list.listId;
+        header.more = list.moreParts;
+        Buffer::UniquePtr buffer = Serializer().serialize(header);
+
+        progress_->update(c, true, [&header](ProgressUpdate& up) {
+            up.send.totalBytes += header.size;
+            up.send.totalFiles += header.count;
+        });
+
+        list.headerSent = true;
+        if (list.files.empty()) {
+            // The last part of a list, with nothing more found
+            queue.pop_front();
+        }
+        size_t size = buffer->readSize();
+        SendBufferToContact(c, multiStream ? CONTROL_STREAM_ID : LEGACY_STREAM_ID, SENDFILE_LIST, std::move(buffer));
+        return size;
+    }
+
+    // Otherwise the header waits for the bundles, and the next list for it
+    bool canStart = !queue.empty() && !listHeaderNext && active.size() < (multiStream ? MAX_STREAMS : 1);
+    if (canStart && multiStream && (socketThread_->GetFeatures(c) & FEATURE_BUNDLES)) {
+        const QueuedList& list = queue.front();
+        const QueuedFile& next = list.files[list.next];
+        if (next.sizeKnown && next.size <= BUNDLE_MAX_FILE_SIZE) {
+            StartBundle(c, sendData);
+            return 0;
+        }
+    }
+
+    if (canStart) {
+        bool single = queue.front().single;
+        std::wstring relativeFilename, filename;
+        GetNextFilename(queue.front(), relativeFilename, filename);
+        PopFile(queue);
+        FileIo::File file = fileIo_->open(filename, FileIo::OPEN_READ);
+
+        if (file == FileIo::INVALID_FILE) {
+            log.e(L"Can't open file {}", filename);
+            return 0;
+        }
+        log.i(L"Starting to send '{}'", filename);
+
+        active.emplace_back(c, filename, relativeFilename, !single);
+        QueueItem& item = active.back();
+        item.file = file;
+        item.state = QueueItem::State::SEND_DATA;
+        if (multiStream) {
+            // Stream ids are reused only after 64K files, long after the previous user is done
+            item.streamId = sendData.nextStreamId++;
+            if (sendData.nextStreamId == CONTROL_STREAM_ID) {
+                sendData.nextStreamId++;
+            }
+        }
+        item.size = fileIo_->size(file);
+        item.readEnd = item.size;
+        item.merkle = (socketThread_->GetFeatures(c) & FEATURE_MERKLE) != 0;
+        StartReads(c, item);
+
+        if (!item.dontUpdateSizes) {
+            progress_->update(c, true, [&item](ProgressUpdate& up) {
+                up.send.totalBytes += item.size;
+                up.send.totalFiles++;
+            });
+        }
+
+        SendFileHeader header;
+        header.name = Utf16ToUtf8(item.relativeFilename);
+        header.size = item.size;
+        if ((socketThread_->GetFeatures(c) & FEATURE_RESUME) && item.size >= RESUME_MIN_SIZE) {
+            header.identity = GetFileIdentity(item.filename);
+            item.waitingForResume = !header.identity.empty();
+        }
+        Buffer::UniquePtr buffer = Serializer().serialize(header);
+        uint16_t streamId = item.streamId;
+        size_t bufferSize = buffer->readSize();
+        SendBufferToContact(c, streamId, SENDFILE_HEADER, std::move(buffer));
+        return bufferSize;
+    }
+
+    // Send a chunk of each active file in turn, so that a small file isn't stuck behind a large
+    // one. Skip those whose next chunk is still being read.
+    bool found = false;
+    for (size_t i = 0; i < active.size() && !found; i++) {
+        QueueItem& item = active.front();
+        if (item.state == QueueItem::State::SEND_BUNDLE) {
+            // Sent once all its files are read
+            found = std::all_of(item.reads.begin(), item.reads.end(), [](const std::unique_ptr<PendingRead>& read) {
+                return read->done;
+            });
+        } else {
+            found = !item.waitingForResume && (item.reads.empty() ? item.finished : item.reads.front()->done);
+        }
+        if (!found) {
+            QueueItem skipped = std::move(active.front());
+            active.pop_front();
+            active.push_back(std::move(skipped));
+        }
+    }
+    if (!found) {
+        sendData.waitingForDisk = true;
+        return 0;
+    }
+    if (active.front().merkle) {
+        HashReadBlocks(sendData);
+    }
+    QueueItem item = std::move(active.front());
+    active.pop_front();
+
+    if (item.state == QueueItem::State::SEND_BUNDLE) {
+        return SendBundle(c, item);
+    }
+    if (item.reads.empty()) {
+        // Finished, and no read is in flight anymore
+        if (item.file != FileIo::INVALID_FILE) {
+            fileIo_->close(item.file);
+            item.file = FileIo::INVALID_FILE;
+        }
+        if (item.failed) {
+            return 0;
+        }
+        SendFileTrailer trailer;
+        if (item.merkle && !item.resend) {
+            if (item.block.size() > 0) {
+                item.blockHashes.push_back(item.block.result());
+            }
+            if (item.hashesSent < item.blockHashes.size()) {
+                // The block hashes go first, one message per turn
+                size_t count = std::min<size_t>(HASHES_PER_MESSAGE, item.blockHashes.size() - item.hashesSent);
+                SendFileHashes hashes;
+                for (size_t i = item.hashesSent; i < item.hashesSent + count; i++) {
+                    hashes.hashes += item.blockHashes[i];
+                }
+                item.hashesSent += count;
+                Buffer::UniquePtr buffer = Serializer().serialize(hashes);
+                uint16_t streamId = item.streamId;
+                active.push_back(std::move(item));
+                size_t size = buffer->readSize();
+                SendBufferToContact(c, streamId, SENDFILE_HASHES, std::move(buffer));
+                return size;
+            }
+            item.root = MerkleHash::root(std::move(item.blockHashes));
+            std::deque<SentFile>& sentFiles = sentFiles_[c];
+            sentFiles.push_back({ item.streamId, item.filename, item.relativeFilename, item.size, item.root });
+            if (sentFiles.size() > MAX_SENT_FILES) {
+                sentFiles.pop_front();
+            }
+        }
+        if (item.merkle) {
+            trailer.root = item.root;
+        } else {
+            trailer.checksum = item.hash.result();
+        }
+        if (item.resend) {
+            log.i(L"Finished sending blocks of '{}' again", item.filename);
+        } else {
+            log.i(L"Finished sending file '{}'", item.filename);
+            progress_->update(c, true, [](ProgressUpdate& up) {
+                up.send.doneFiles++;
+            });
+        }
+        Buffer::UniquePtr buffer = Serializer().serialize(trailer);
+        size_t size = buffer->readSize();
+        SendBufferToContact(c, item.streamId, SENDFILE_TRAILER, std::move(buffer));
+        return size;
+    }
+
+    std::unique_ptr<PendingRead> read = std::move(item.reads.front());
+    item.reads.pop_front();
+    if (item.finished) {
+        // Read past the end, or after an error
+    } else if (read->error != 0) {
+        log.e(L"Error reading from file '{}': {}", item.filename, errstr(read->error));
+        item.finished = true;
+        item.failed = true;
+    } else if (read->count == 0) {
+        // The file got shorter since it was opened
+        item.finished = true;
+    } else if (read->seek) {
+        // The receiver is told where the data of the block sent again goes
+        read->seek = false;
+        SendFileSeek seek;
+        seek.offset = read->offset;
+        Buffer::UniquePtr buffer = Serializer().serialize(seek);
+        item.reads.push_front(std::move(read));
+        uint16_t streamId = item.streamId;
+        active.push_back(std::move(item));
+        size_t size = buffer->readSize();
+        SendBufferToContact(c, streamId, SENDFILE_SEEK, std::move(buffer));
+        return size;
+    } else {
+        uint32_t count = read->count;
+        if (!item.resend) {
+            HashRead(item, *read);
+            progress_->update(c, false, [count](ProgressUpdate& up) {
+                up.send.doneBytes += count;
+            });
+        }
+        StartReads(c, item);
+        // The receiver has what comes before sendOffset already
+        uint64_t skip = item.sendOffset > read->offset ? std::min<uint64_t>(item.sendOffset - read->offset, count) : 0;
+        uint16_t streamId = item.streamId;
+        active.push_back(std::move(item));
+        if (skip == count) {
+            return 0;
+        }
+        read->buffer->adjustReadPos((intptr_t)skip);
+        SendBufferToContact(c, streamId, SENDFILE_DATA, std::move(read->buffer));
+        return count - (size_t)skip;
+    }
+    active.push_back(std::move(item));
+    return 0;
+}
+
+void DiskThread::StartReads(const Contact& c, QueueItem& item) {
+    // Files are read in multiples of MAX_CHUNK, as large as the connection allows
+    enum { MAX_CHUNK = 65536 };
+    size_t chunk = (socketThread_->GetMaxBufferSize(c) - sizeof(Header)) / MAX_CHUNK * MAX_CHUNK;
+    if (rateLimit_.isLimited() || contactRateLimits_[c].isLimited()) {
+        // Pace in small steps, or the limit would be kept only on average, in bursts
+        chunk = MAX_CHUNK;
+    }
+    while (true) {
+        while (item.reads.size() < readAhead_ && item.readOffset < item.readEnd) {
+            // Back on chunk boundaries if the chunk size changed, then blocks are read whole
+            uint32_t size = (uint32_t)std::min<uint64_t>(chunk - item.readOffset % chunk, item.readEnd - item.readOffset);
+            std::unique_ptr<PendingRead> read = StartRead(c, item.file, item.readOffset, size);
+            read->seek = item.seekNext;
+            item.seekNext = false;
+            item.readOffset += size;
+            item.reads.push_back(std::move(read));
+        }
+        if (item.readOffset < item.readEnd || item.resendBlocks.empty()) {
+            break;
+        }
+        // On to the next block to send again. Chunks divide blocks, so it takes whole reads.
+        item.readOffset = item.resendBlocks.front() * MerkleHash::BLOCK_SIZE;
+        item.readEnd = std::min<uint64_t>(item.size, item.readOffset + MerkleHash::BLOCK_SIZE);
+        item.seekNext = true;
+        item.resendBlocks.pop_front();
+    }
+    if (item.reads.empty()) {
+        // All read and sent
+        item.finished = true;
+    }
+    SubmitIo();
+}
+
+std::unique_ptr<DiskThread::PendingRead> DiskThread::StartRead(const Contact& c, FileIo::File file, uint64_t offset, uint32_t size) {
+    std::unique_ptr<PendingRead> read = std::make_unique<PendingRead>();
+    // Not registered with fileIo_ like ReceiveThread's write buffers, as each goes on to the
+    // socket thread with its data and is freed there
+    read->buffer.reset(Buffer::create(size));
+    read->offset = offset;
+    if (size == 0) {
+        read->done = true;
+        return read;
+    }
+    PendingRead* p = read.get();
+    fileIo_->read(file, offset, read->buffer->writeData(), size, [this, c, p](int error, uint32_t count) {
+        p->done = true;
+        p->error = error;
+        p->count = count;
+        if (error == 0) {
+            p->buffer->adjustWritePos(count);
+        }
+        OnItemReady(c);
+    });
+    return read;
+}
+
+void DiskThread::GetNextFilename(const QueuedList& list, std::wstring& relativeFilename, std::wstring& filename) {
+    relativeFilename = list.names.get(list.files[list.next].name);
+    filename = list.dir.empty() ? relativeFilename : list.dir + L"\\" + relativeFilename;
+}
+
+void DiskThread::PopFile(std::deque<QueuedList>& queue) {
+    if (++queue.front().next == queue.front().files.size()) {
+        queue.pop_front();
+    }
+}
+
+void DiskThread::StartBundle(const Contact& c, SendData& sendData) {
+    std::deque<QueuedList>& queue = sendData.queue_;
+    QueueItem bundle(c, L"", L"", true);
+    bundle.state = QueueItem::State::SEND_BUNDLE;
+    bundle.streamId = CONTROL_STREAM_ID;
+    size_t room = socketThread_->GetMaxBufferSize(c) - sizeof(Header);
+    // Only from one list, the next one's header goes first
+    size_t left = queue.front().files.size() - queue.front().next;
+    for (; left > 0 && bundle.bundle.size() < MAX_BUNDLE_FILES; left--) {
+        QueuedList* list = &queue.front();
+        QueuedFile& next = list->files[list->next];
+        if (!next.sizeKnown || next.size > BUNDLE_MAX_FILE_SIZE) {
+            break;
+        }
+        std::wstring relativeFilename, filename;
+        GetNextFilename(*list, relativeFilename, filename);
+        std::string name = Utf16ToUtf8(relativeFilename);
+        size_t entrySize = BUNDLE_ENTRY_OVERHEAD + name.size() + (size_t)next.size;
+        if (entrySize > room) {
+            if (bundle.bundle.empty()) {
+                // Sent on its own
+                next.sizeKnown = false;
+            }
+            break;
+        }
+        FileIo::File file = fileIo_->open(filename, FileIo::OPEN_READ);
+        if (file == FileIo::INVALID_FILE) {
+            log.e(L"Can't open file {}", filename);
+            PopFile(queue);
+            continue;
+        }
+        if (fileIo_->size(file) != next.size) {
+            // Changed since it was enqueued, sent on its own
+            fileIo_->close(file);
+            next.sizeKnown = false;
+            break;
+        }
+        room -= entrySize;
+        bundle.reads.push_back(StartRead(c, file, 0, (uint32_t)next.size));
+        bundle.bundle.push_back({ filename, std::move(name), file });
+        PopFile(queue);
+    }
+    if (!bundle.bundle.empty()) {
+        bundle.finished = true;
+        sendData.active_.push_back(std::move(bundle));
+        SubmitIo();
+    }
+}
+
+size_t DiskThread::SendBundle(const Contact& c, QueueItem& item) {
+    for (BundledFile& file : item.bundle) {
+        fileIo_->close(file.file);
+    }
+    if (item.failed) {
+        return 0;
+    }
+    std::vector<SendFileBundleEntry> entries(item.bundle.size());
+    hashPool_.parallelFor(entries.size(), [&](size_t i) {
+        const PendingRead& read = *item.reads[i];
+        if (read.error == 0) {
+            entries[i].data.assign((const char*)read.buffer->readData(), read.count);
+            entries[i].checksum = MerkleHash::hashBlock(read.buffer->readData(), read.count);
+        }
+    });
+    size_t size = 0;
+    uint64_t bytes = 0;
+    for (size_t i = 0; i < entries.size(); i++) {
+        entries[i].name = std::move(item.bundle[i].name);
+        size += Serializer().serializedSize(entries[i]);
+        bytes += entries[i].data.size();
+    }
+    Buffer::UniquePtr buffer(Buffer::create(size));
+    uint32_t count = 0;
+    for (size_t i = 0; i < entries.size(); i++) {
+        if (item.reads[i]->error != 0) {
+            // Left out of the list the receiver gets, like files that can't be opened
+            log.e(L"Error reading from file '{}': {}", item.bundle[i].filename, errstr(item.reads[i]->error));
+            continue;
+        }
+        Serializer().serializeTo(entries[i], buffer.get());
+        count++;
+    }
+    log.i(L"Sending {} small files together, {} bytes", count, bytes);
+    progress_->update(c, true, [&item, bytes](ProgressUpdate& up) {
+        up.send.doneBytes += bytes;
+        up.send.doneFiles += (uint32_t)item.bundle.size();
+    });
+    size_t sent = buffer->readSize();
+    SendBufferToContact(c, item.streamId, SENDFILE_BUNDLE, std::move(buffer));
+    return sent;
+}
+
+void DiskThread::HashReadBlocks(SendData& sendData) {
+    std::vector<PendingRead*> reads;
+    for (QueueItem& item : sendData.active_) {
+        if (!item.merkle || item.resend) {
+            continue;
+        }
+        for (const auto& read : item.reads) {
+            bool wholeBlock = read->offset % MerkleHash::BLOCK_SIZE == 0 &&
+                (read->count == MerkleHash::BLOCK_SIZE || read->offset + read->count == item.size);
+            if (read->done && read->error == 0 && read->count > 0 && wholeBlock && read->blockHash.empty()) {
+                reads.push_back(read.get());
+            }
+        }
+    }
+    hashPool_.parallelFor(reads.size(), [&reads](size_t i) {
+        reads[i]->blockHash = MerkleHash::hashBlock(reads[i]->buffer->readData(), reads[i]->count);
+    });
+}
+
+void DiskThread::HashRead(QueueItem& item, PendingRead& read) {
+    const uint8_t* data = read.buffer->readData();
+    uint32_t count = read.count;
+    if (!item.merkle) {
+        item.hash.update(data, count);
+        return;
+    }
+    if (!read.blockHash.empty()) {
+        item.blockHashes.push_back(std::move(read.blockHash));
+        return;
+    }
+    // Reads smaller than a block, with a rate limit
+    while (count > 0) {
+        uint32_t n = (uint32_t)std::min<size_t>(count, MerkleHash::BLOCK_SIZE - item.block.size());
+        item.block.update(data, n);
+        data += n;
+        count -= n;
+        if (item.block.size() == MerkleHash::BLOCK_SIZE) {
+            item.blockHashes.push_back(item.block.result());
+        }
+    }
+}
+
+void DiskThread::OnItemReady(const Contact& c) {
+    auto it = uncorked_.find(c);
+    if (it != uncorked_.end() && it->second->waitingForDisk) {
+        it->second->waitingForDisk = false;
+        ready_.push_back(c);
+        DoWriteLoop();
+    }
+}
+
+// Reads are submitted once the messages already posted have been handled, so that those made
+// for several files go together
+void DiskThread::SubmitIo() {
+    if (ioSubmitQueued_) {
+        return;
+    }
+    ioSubmitQueued_ = true;
+    RunInThread([this] {
+        ioSubmitQueued_ = false;
+        fileIo_->submit();
+    });
+}
+
+void DiskThread::ResumeFrom(const Contact& c, uint16_t streamId, uint64_t offset) {
+    RunInThread([this, c, streamId, offset] {
+        for (Map* map : { &uncorked_, &corked_ }) {
+            auto it = map->find(c);
+            if (it == map->end()) {
+                continue;
+            }
+            for (QueueItem& item : it->second->active_) {
+                if (item.streamId == streamId && item.waitingForResume) {
+                    item.waitingForResume = false;
+                    item.sendOffset = std::min(offset, item.size);
+                    if (item.sendOffset > 0) {
+                        log.i(L"Resuming '{}' from {} bytes", item.filename, item.sendOffset);
+                    }
+                    OnItemReady(c);
+                    return;
+                }
+            }
+        }
+        log.e(L"Got SENDFILE_RESUME for stream {} which isn't waiting for it", streamId);
+    });
+}
+
+void DiskThread::ContactDisconnected(const Contact& c) {
+    RunInThread([this, c] {
+        for (Map* map : { &uncorked_, &corked_ }) {
+            auto it = map->find(c);
+            if (it == map->end()) {
+                continue;
+            }
+            for (QueueItem& item : it->second->active_) {
+                if (!item.failed && item.state != QueueItem::State::SEND_BUNDLE) {
+                    log.i(L"Stopped sending '{}'", item.filename);
+                }
+                // Dropped without a trailer once its reads in flight are done
+                item.finished = true;
+                item.failed = true;
+                item.waitingForResume = false;
+            }
+        }
+        sentFiles_.erase(c);
+        // Messages of the dropped items that were sent meanwhile aren't for the next connection
+        socketThread_->DisconnectHandled(c);
+    });
+}
+
+void DiskThread::SendResumeOffset(const Contact& c, uint16_t streamId, uint64_t offset) {
+    RunInThread([this, c, streamId, offset] {
+        SendFileResume resume;
+        resume.offset = offset;
+        SendBufferToContact(c, streamId, SENDFILE_RESUME, Serializer().serialize(resume));
+    });
+}
+
+void DiskThread::ResendBlocks(const Contact& c, uint16_t streamId, const std::vector<uint64_t>& blocks) {
+    RunInThread([this, c, streamId, blocks] {
+        auto it = sentFiles_.find(c);
+        if (it == sentFiles_.end()) {
+            log.e(L"Got SENDFILE_RESEND for stream {} which wasn't sent lately", streamId);
+            return;
+        }
+        auto sent = std::find_if(it->second.rbegin(), it->second.rend(), [streamId](const SentFile& f) {
+            return f.streamId == streamId;
+        });
+        if (sent == it->second.rend()) {
+            log.e(L"Got SENDFILE_RESEND for stream {} which wasn't sent lately", streamId);
+            return;
+        }
+        QueueItem item(c, sent->filename, sent->relativeFilename, true);
+        item.file = fileIo_->open(item.filename, FileIo::OPEN_READ);
+        if (item.file == FileIo::INVALID_FILE) {
+            log.e(L"Can't open file {}", item.filename);
+            return;
+        }
+        log.w(L"Sending {} blocks of '{}' again, they arrived corrupt", blocks.size(), item.filename);
+        item.state = QueueItem::State::SEND_DATA;
+        item.streamId = streamId;
+        item.size = sent->size;
+        item.merkle = true;
+        item.resend = true;
+        item.resendBlocks.assign(blocks.begin(), blocks.end());
+        item.root = sent->root;
+        StartReads(c, item);
+
+        SendData* sendData;
+        if (corked_.find(c) != corked_.end()) {
+            sendData = corked_[c].get();
+        } else {
+            if (uncorked_.find(c) == uncorked_.end()) {
+                Uncork(c, std::make_unique<SendData>());
+            }
+            sendData = uncorked_[c].get();
+        }
+        sendData->active_.push_back(std::move(item));
+        OnItemReady(c);
+        DoWriteLoop();
+    });
+}
+
+void DiskThread::SendResendRequest(const Contact& c, uint16_t streamId, const std::vector<uint64_t>& blocks) {
+    RunInThread([this, c, streamId, blocks] {
+        SendFileResend resend;
+        resend.blocks.assign((const char*)blocks.data(), blocks.size() * sizeof(uint64_t));
+        SendBufferToContact(c, streamId, SENDFILE_RESEND, Serializer().serialize(resend));
+    });
+}
+
+std::string DiskThread::GetFileIdentity(const std::wstring& filename) {
+    HANDLE hFile = CreateFile(filename.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+        NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) {
+        return "";
+    }
+    BY_HANDLE_FILE_INFORMATION info;
+    BOOL ok = GetFileInformationByHandle(hFile, &info);
+    CloseHandle(hFile);
+    if (!ok) {
+        return "";
+    }
+    uint32_t identity[] = {
+        info.dwVolumeSerialNumber, info.nFileIndexHigh, info.nFileIndexLow,
+        info.ftLastWriteTime.dwHighDateTime, info.ftLastWriteTime.dwLowDateTime
+    };
+    return std::string((const char*)identity, sizeof(identity));
+}
+
+void DiskThread::setReadAhead(uint32_t chunks) {
+    RunInThread([this, chunks] {
+        readAhead_ = std::max<uint32_t>(chunks, 1);
+    });
+}
+
+void DiskThread::MaybeLogSendRates() {
+    auto now = std::chrono::steady_clock::now();
+    if (now - sentBytesTimestamp_ < std::chrono::seconds(SEND_RATES_LOG_SECONDS)) {
+        return;
+    }
+    using float_seconds = std::chrono::duration<double>;
+    double seconds = float_seconds(now - sentBytesTimestamp_).count();
+    bool first = sentBytesTimestamp_ == std::chrono::steady_clock::time_point();
+    sentBytesTimestamp_ = now;
+    // Only interesting when several contacts compete
+    if (!first && sentBytes_.size() > 1) {
+        uint64_t total = 0;
+        for (const auto& kv : sentBytes_) {
+            total += kv.second;
+        }
+        for (const auto& kv : sentBytes_) {
+            log.i(L"Sent {:.1f} MB/s ({:.0f}%) to {}, weight {}", kv.second / seconds / 1e6,
+                total == 0 ? 0.0 : 100.0 * kv.second / total, keyToDisplayStr(kv.first.pubkey), GetWeight(kv.first));
+        }
+    }
+    sentBytes_.clear();
+    if (!first) {
+        BufferPool::Stats pool = BufferPool::stats();
+        log.d(L"Buffers: {} allocated, {:.1f}% reused, {} freed by another thread, {:.1f} MB cached",
+            pool.allocations, pool.allocations == 0 ? 0.0 : 100.0 * pool.reused / pool.allocations,
+            pool.remoteFrees, pool.cachedBytes / 1e6);
+    }
+}
+
+bool DiskThread::SendBufferToContact(const Contact& c, uint16_t streamId, MessageType type, Buffer::UniquePtr buffer) {
+    Header header;
+    header.streamId = streamId;
+    header.type = type;
+    uint8_t* buf = buffer->prependHeader(sizeof(header));
+    memcpy(buf, &header, sizeof(header));
+    bool shouldCork = socketThread_->SendBuffer(c, buffer.release());
+    // Not uncorked when only answering SENDFILE_RESUME, with nothing to send
+    if (shouldCork) {
+        Cork(c);
+    }
+    return shouldCork;
+}
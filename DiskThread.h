@@ -1,97 +1,246 @@
-#pragma once
-
-#include "lib/win/MessageThread.h"
-#include "lib/Buffer.h"
-#include "SocketThread.h"
-#include "Logger.h"
-#include "proto/file.h"
-#include "lib/crypto.h"
-#include <deque>
-#include <memory>
-
-struct ProgressUpdate {
-    struct Stats {
-        uint64_t doneBytes = 0;
-        uint64_t totalBytes = 0;
-        uint32_t doneFiles = 0;
-        uint32_t totalFiles = 0;
-    };
-
-    std::chrono::steady_clock::time_point timestamp;
-    Stats send;
-    Stats recv;
-};
-
-class DiskThread : public MessageThread {
-public:
-    DiskThread(Logger* logger, SocketThreadApi* socketThread, const std::wstring& receivePath);
-    void Enqueue(const Contact& c, const std::wstring& filename);
-    void Enqueue(const Contact& c, const std::wstring& dir, const std::vector<std::wstring>& files);
-    void setProgressUpdateCb(std::function<void(const Contact& c, const ProgressUpdate& up)> cb);
-
-private:
-    enum { MAX_BUFFERS_TO_SEND = 10 };
-    struct QueueItem {
-        enum class State { SEND_HEADER, SEND_DATA, SEND_TRAILER, SEND_FILE_LIST_HEADER };
-        QueueItem(const Contact& c, const std::wstring& filename, const std::wstring& relativeFilename, bool dontUpdateSizes = false)
-            : c(c)
-            , filename(filename)
-            , relativeFilename(relativeFilename)
-            , dontUpdateSizes(dontUpdateSizes)
-        {}
-        QueueItem(const Contact& c, uint32_t count, uint64_t size)
-            : c(c)
-            , count(count)
-            , size(size)
-            , state(State::SEND_FILE_LIST_HEADER)
-        {}
-        Contact c;
-        std::wstring filename;
-        std::wstring relativeFilename;
-        bool dontUpdateSizes;
-        uint32_t count;     // only used by SEND_FILE_LIST_HEADER
-        uint64_t size;      // file size for 1 file, total size for SEND_FILE_LIST_HEADER
-        State state = State::SEND_HEADER;
-        HANDLE hFile = NULL;
-        GenericHash hash;
-    };
-    struct SendData {
-        std::deque<QueueItem> queue_;
-    };
-    struct ReceiveData {
-        enum class State { RECEIVE_HEADER, RECEIVE_DATA_OR_TRAILER };
-        State state = State::RECEIVE_HEADER;
-        HANDLE hReceiveFile = NULL;
-        uint64_t receivedCount;
-        uint64_t receiveSize;
-        GenericHash hash;
-        std::wstring receiveFilename;
-        uint32_t filelistCount = 0;
-        uint32_t filelistCountDone = 0;
-        std::wstring receiveDir;
-    };
-    using Map = std::unordered_map<Contact, std::unique_ptr<SendData>>;
-
-    void DoWriteLoop();
-    void DoWriteLoopImpl(Map::iterator iter);
-    bool SendBufferToContact(const Contact& c, MessageType type, Buffer::UniquePtr buffer);
-    void OnMessageReceived(const Contact& c, Buffer::UniquePtr message);
-
-    HANDLE GetReceiveFile(const std::wstring receiveDir, const std::wstring& origFilename, std::wstring& filename);
-    std::wstring makeReceiveDir();
-
-    void MaybeSendProgressUpdate(const Contact& c, bool force = false);
-
-    Logger& log;
-    SocketThreadApi* socketThread_;
-    std::wstring receivePath_;
-
-    Map corked_;
-    Map uncorked_;
-    Map paused_;
-
-    std::unordered_map<Contact, ReceiveData> receive_;
-
-    std::unordered_map<Contact, ProgressUpdate> progressMap_;
-    std::function<void(const Contact& c, const ProgressUpdate& up)> progressUpdateCb_;
-};
+#pragma once
+
+#include "lib/win/MessageThread.h"
+#include "lib/Buffer.h"
+#include "SocketThread.h"
+#include "Logger.h"
+#include "proto/file.h"
+#include "lib/crypto.h"
+#include "lib/TokenBucket.h"
+#include "lib/FileIo.h"
+#include "lib/MerkleHash.h"
+#include "lib/PathTable.h"
+#include "lib/WorkerPool.h"
+#include "ProgressTracker.h"
+#include "TreeWalker.h"
+#include <deque>
+#include <memory>
+#include <unordered_set>
+
+// Reads the files sent to contacts, ReceiveThread writes those received, so that one direction
+// never waits for the other's disk
+class DiskThread : public MessageThread {
+public:
+    DiskThread(Logger* logger, SocketThreadApi* socketThread, ProgressTracker* progress);
+    void Enqueue(const Contact& c, const std::wstring& filename);
+    // Files found under dir by a walk still going on, with their sizes from the listing. The parts
+    // of listId are sent as they come if c has FEATURE_LIST_PARTS, otherwise as one list once
+    // the last has come.
+    void EnqueueListPart(const Contact& c, const std::wstring& dir, uint32_t listId,
+        std::vector<TreeWalker::Entry> files, bool last);
+    // Share of the upload bandwidth c gets while sending to other contacts too, relative to theirs.
+    // Contacts have a weight of 1 unless set, the maximum is MAX_WEIGHT
+    void setWeight(const Contact& c, uint32_t weight);
+    // Upload bandwidth limit in bytes per second, for all contacts together or for one. 0 for none
+    void setRateLimit(uint64_t bytesPerSecond);
+    void setRateLimit(const Contact& c, uint64_t bytesPerSecond);
+    // Chunks of each file being sent that are read ahead of the socket, so disk and network
+    // latencies overlap
+    void setReadAhead(uint32_t chunks);
+    // From the receive thread: c's answer to the SENDFILE_HEADER of a stream, and ours to c's
+    void ResumeFrom(const Contact& c, uint16_t streamId, uint64_t offset);
+    void SendResumeOffset(const Contact& c, uint16_t streamId, uint64_t offset);
+    // Same for SENDFILE_RESEND, about a file whose trailer has been sent
+    void ResendBlocks(const Contact& c, uint16_t streamId, const std::vector<uint64_t>& blocks);
+    void SendResendRequest(const Contact& c, uint16_t streamId, const std::vector<uint64_t>& blocks);
+    // Stops sending the files started for c, the receiver forgot their streams. The queued ones
+    // are sent once it's connected again
+    void ContactDisconnected(const Contact& c);
+
+    enum { MAX_WEIGHT = 16 };
+
+private:
+    // Bytes sent to a contact of weight 1 on each of its turns
+    enum { DRR_QUANTUM = 1024 * 1024 };
+    enum { SEND_RATES_LOG_SECONDS = 10 };
+    enum { THROTTLE_TIMER_ID = 1 };
+    enum { RATE_LIMIT_MIN_BURST = 64 * 1024 };
+    enum { RATE_LIMIT_BURST_MS = 200 };
+    enum { DEFAULT_READ_AHEAD = 4 };
+    // Smaller files are sent whole, rather than waiting for the receiver to tell where to resume
+    enum { RESUME_MIN_SIZE = 64 * 1024 * 1024 };
+    // Block hashes per SENDFILE_HASHES, well under the message size of legacy peers
+    enum { HASHES_PER_MESSAGE = 1024 };
+    // Files sent to a contact whose blocks it may still ask again
+    enum { MAX_SENT_FILES = 64 };
+    // Files of a list up to this size go in a SENDFILE_BUNDLE with FEATURE_BUNDLES, as many as fit
+    // in a message
+    enum { BUNDLE_MAX_FILE_SIZE = 64 * 1024 };
+    enum { MAX_BUNDLE_FILES = 1024 };
+    // Room taken in the message by a SendFileBundleEntry besides the name and data: field ids,
+    // lengths and the checksum
+    enum { BUNDLE_ENTRY_OVERHEAD = 64 };
+    // A read of a chunk of a file being sent
+    struct PendingRead {
+        Buffer::UniquePtr buffer;
+        uint64_t offset = 0;
+        bool done = false;
+        int error = 0;
+        uint32_t count = 0;
+        // Set for a whole MerkleHash block, hashed with others before it's sent
+        std::string blockHash;
+        // A SENDFILE_SEEK to offset goes before the data
+        bool seek = false;
+    };
+    // Files sent at once to a contact, if it supports FEATURE_STREAMS
+    enum { MAX_STREAMS = 4 };
+    struct BundledFile {
+        std::wstring filename;
+        std::string name;       // as sent, UTF-8
+        FileIo::File file;
+    };
+    // A file waiting to be sent, its name is in the list's PathTable
+    struct QueuedFile {
+        uint64_t size;
+        PathTable::Id name;
+        bool sizeKnown;     // size set when enqueued, the file may go in a bundle
+    };
+    // Files enqueued together, and the SENDFILE_LIST header that goes before them. Kept compact
+    // so that millions of files can wait: a file only gets a QueueItem, with its hash state,
+    // once it's started.
+    struct QueuedList {
+        std::wstring dir;           // the files' names are relative to it
+        PathTable names;
+        std::vector<QueuedFile> files;
+        size_t next = 0;            // first file not started yet
+        // A file enqueued on its own goes without header, and counts in the progress once started
+        bool single = false;
+        bool headerSent = false;
+        uint64_t size = 0;
+        // Of a list part, see SendFileListHeader::listId
+        uint32_t listId = 0;
+        bool moreParts = false;
+    };
+    struct QueueItem {
+        enum class State { SEND_HEADER, SEND_DATA, SEND_TRAILER, SEND_BUNDLE };
+        QueueItem(const Contact& c, const std::wstring& filename, const std::wstring& relativeFilename, bool dontUpdateSizes = false)
+            : c(c)
+            , filename(filename)
+            , relativeFilename(relativeFilename)
+            , dontUpdateSizes(dontUpdateSizes)
+        {}
+        Contact c;
+        std::wstring filename;
+        std::wstring relativeFilename;
+        bool dontUpdateSizes;
+        uint64_t size;
+        State state = State::SEND_HEADER;
+        FileIo::File file = FileIo::INVALID_FILE;
+        GenericHash hash;
+        uint16_t streamId = LEGACY_STREAM_ID;
+        // In file order, the first one is sent next
+        std::deque<std::unique_ptr<PendingRead>> reads;
+        uint64_t readOffset = 0;    // Of the next read to start
+        uint64_t readEnd = 0;       // Reads stop there, the size or the end of a resent block
+        bool finished = false;      // Nothing more to send, but reads may still be in flight
+        bool failed = false;
+        // Data isn't sent until the receiver's SENDFILE_RESUME, and then only from sendOffset on.
+        // What comes before is still read, for the checksum.
+        bool waitingForResume = false;
+        uint64_t sendOffset = 0;
+        // With FEATURE_MERKLE, the hashes of the blocks sent so far and the one being hashed
+        // from smaller reads. The first hashesSent have gone in SENDFILE_HASHES.
+        bool merkle = false;
+        std::vector<std::string> blockHashes;
+        MerkleHash::Block block;
+        size_t hashesSent = 0;
+        // Sends only the blocks the receiver asked again, then the trailer with the same root
+        bool resend = false;
+        std::deque<uint64_t> resendBlocks;
+        bool seekNext = false;
+        std::string root;
+        // SEND_BUNDLE: the files sent together, read whole, one of reads each
+        std::vector<BundledFile> bundle;
+    };
+    // What's kept of a file once sent, in case the receiver asks for some blocks again
+    struct SentFile {
+        uint16_t streamId;
+        std::wstring filename;
+        std::wstring relativeFilename;
+        uint64_t size;
+        std::string root;
+    };
+    struct SendData {
+        std::deque<QueuedList> queue_;
+        // Files whose header has been sent, their data is sent in turns
+        std::deque<QueueItem> active_;
+        uint16_t nextStreamId = 1;
+        // Bytes left to send on this turn, negative if the last turn went over
+        int64_t deficit = 0;
+        // Out of ready_ until one of the reads in flight completes, or an item gets its
+        // SENDFILE_RESUME
+        bool waitingForDisk = false;
+    };
+    using Map = std::unordered_map<Contact, std::unique_ptr<SendData>>;
+
+    std::optional<LRESULT> HandleMessage(UINT uMsg, WPARAM wParam, LPARAM lParam) override;
+
+    static uint64_t RateLimitBurst(uint64_t bytesPerSecond);
+    void ScheduleThrottleTimer();
+    // Gives their turn back to the throttled contacts that have waited enough, or to all
+    void WakeThrottled(bool all);
+    uint32_t GetWeight(const Contact& c);
+    void Uncork(const Contact& c, std::unique_ptr<SendData> sendData);
+    // Moves c to corked_ if it's uncorked, whether during its turn or between turns
+    void Cork(const Contact& c);
+    // Takes c out of ready_ and throttled_, when it leaves uncorked_
+    void Unschedule(const Contact& c);
+    // Where items for c are queued, set callDoWriteLoop if it's uncorked
+    SendData& GetSendData(const Contact& c, bool& callDoWriteLoop);
+    void DoWriteLoop();
+    void DoWriteLoopImpl();
+    // Sends one message to c, returns its size
+    size_t SendNextBuffer(const Contact& c, SendData& sendData);
+    // Starts reads until readAhead_ are in flight for the item, or the end of the file.
+    // Marks it finished if there is nothing left to read.
+    void StartReads(const Contact& c, QueueItem& item);
+    static void GetNextFilename(const QueuedList& list, std::wstring& relativeFilename, std::wstring& filename);
+    // Moves past the next file of the first list, which goes once they're all started
+    static void PopFile(std::deque<QueuedList>& queue);
+    std::unique_ptr<PendingRead> StartRead(const Contact& c, FileIo::File file, uint64_t offset, uint32_t size);
+    // Takes the small files at the front of the queue, as many as fit in a message, into an active
+    // SEND_BUNDLE item and starts reading them
+    void StartBundle(const Contact& c, SendData& sendData);
+    size_t SendBundle(const Contact& c, QueueItem& item);
+    // Hashes the whole blocks read and not hashed yet for the files being sent to the contact,
+    // on all cores
+    void HashReadBlocks(SendData& sendData);
+    // Adds the data of a read to the item's hash, reads must come in file order
+    static void HashRead(QueueItem& item, PendingRead& read);
+    void OnItemReady(const Contact& c);
+    // Which file it is and when it was modified, for SendFileHeader::identity. Empty on error
+    static std::string GetFileIdentity(const std::wstring& filename);
+    void SubmitIo();
+    void MaybeLogSendRates();
+    bool SendBufferToContact(const Contact& c, uint16_t streamId, MessageType type, Buffer::UniquePtr buffer);
+
+    Logger& log;
+    SocketThreadApi* socketThread_;
+    ProgressTracker* progress_;
+    std::unique_ptr<FileIo> fileIo_;
+    bool ioSubmitQueued_ = false;
+    WorkerPool hashPool_;
+
+    Map corked_;
+    Map uncorked_;
+    Map paused_;
+    // Contacts in uncorked_ and not throttled_, in the order of their next turn
+    std::deque<Contact> ready_;
+    std::unordered_map<Contact, uint32_t> weights_;
+    TokenBucket rateLimit_;
+    std::unordered_map<Contact, TokenBucket> contactRateLimits_;
+    // Contacts in uncorked_ but not in ready_ because of their rate limit, and when to retry.
+    // The empty contact is there while everyone waits for the global limit.
+    std::unordered_map<Contact, std::chrono::steady_clock::time_point> throttled_;
+    bool globalThrottled_ = false;
+    uint32_t readAhead_ = DEFAULT_READ_AHEAD;
+    // Bytes sent to each contact since sentBytesTimestamp_
+    std::unordered_map<Contact, uint64_t> sentBytes_;
+    std::chrono::steady_clock::time_point sentBytesTimestamp_;
+    // Last files sent to each contact with FEATURE_MERKLE, oldest first
+    std::unordered_map<Contact, std::deque<SentFile>> sentFiles_;
+    // Parts of lists for contacts without FEATURE_LIST_PARTS, until the last comes
+    std::unordered_map<uint32_t, std::vector<TreeWalker::Entry>> heldLists_;
+    // Lists sent in parts whose last part hasn't come yet
+    std::unordered_set<uint32_t> openLists_;
+};
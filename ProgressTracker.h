@@ -0,0 +1,62 @@
+#pragma once
+
+#include "SocketThread.h"
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+
+struct ProgressUpdate {
+    struct Stats {
+        uint64_t doneBytes = 0;
+        uint64_t totalBytes = 0;
+        uint32_t doneFiles = 0;
+        uint32_t totalFiles = 0;
+    };
+
+    std::chrono::steady_clock::time_point timestamp;
+    Stats send;
+    Stats recv;
+    uint64_t sendQueueBytes = 0;
+};
+
+// Progress of the transfers with each contact, updated by both the send and the receive thread
+class ProgressTracker {
+public:
+    ProgressTracker(SocketThreadApi* socketThread)
+        : socketThread_(socketThread)
+    {}
+
+    // Called from the thread doing the update, to be set before the threads start
+    void setUpdateCb(std::function<void(const Contact& c, const ProgressUpdate& up)> cb) {
+        updateCb_ = std::move(cb);
+    }
+
+    // Applies func to c's progress, which is then reported if forced, or if the last report
+    // is old enough
+    void update(const Contact& c, bool force, const std::function<void(ProgressUpdate& up)>& func) {
+        // Reported under the lock too, the UI computes speeds from consecutive updates
+        std::lock_guard<std::mutex> lock(mutex_);
+        ProgressUpdate& data = progressMap_[c];
+        func(data);
+        auto now = std::chrono::steady_clock::now();
+        if (!updateCb_ || (!force && now - data.timestamp < std::chrono::milliseconds(UPDATE_INTERVAL_MS))) {
+            return;
+        }
+        data.timestamp = now;
+        data.sendQueueBytes = socketThread_->GetQueuedBytes(c);
+        updateCb_(c, data);
+    }
+
+    void update(const Contact& c, bool force = false) {
+        update(c, force, [](ProgressUpdate&) {});
+    }
+
+private:
+    enum { UPDATE_INTERVAL_MS = 500 };
+
+    SocketThreadApi* socketThread_;
+    std::function<void(const Contact& c, const ProgressUpdate& up)> updateCb_;
+    std::mutex mutex_;
+    std::unordered_map<Contact, ProgressUpdate> progressMap_;
+};
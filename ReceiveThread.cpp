@@ -0,0 +1,780 @@
+#include "ReceiveThread.h"
+#include "DiskThread.h"
+#include "proto/file.h"
+#include "proto/Serializer.h"
+#include "lib/win/encoding.h"
+#include "lib/win/raii.h"
+#include <ShlObj.h>
+
+ReceiveThread::ReceiveThread(Logger* logger, SocketThreadApi* socketThread, ProgressTracker* progress, DiskThread* diskThread,
+    Database* db, const std::wstring& receivePath, std::unique_ptr<FileIo> fileIo)
+    : log(*logger)
+    , socketThread_(socketThread)
+    , progress_(progress)
+    , diskThread_(diskThread)
+    , db_(db)
+    , receivePath_(receivePath)
+    , fileIo_(std::move(fileIo))
+    , hashPool_(std::max(1u, std::thread::hardware_concurrency()) - 1)
+{
+    socketThread_->setOnMessageCb([this](const Contact& c, Buffer::UniquePtr message) {
+        Buffer* p = message.release();
+        RunInThread([this, c, p]() {
+            OnMessageReceived(c, Buffer::UniquePtr(p));
+        });
+    });
+}
+
+void ReceiveThread::OnMessageReceived(const Contact& c, Buffer::UniquePtr message) {
+    size_t size = message->readSize();
+    // Unless it is written to disk, the message is handled when this returns
+    bool writing = false;
+    SCOPE_EXIT {
+        if (!writing) {
+            socketThread_->MessageHandled(c, size);
+        }
+    };
+    Header header;
+    memcpy(&header, message->buffer(), sizeof(header));
+    message->adjustReadPos(sizeof(header));
+
+    if (header.type == SENDFILE_RESUME) {
+        // About a file we send
+        SendFileResume resume;
+        if (!Serializer().deserialize(resume, message.get())) {
+            log.e(L"Can't deserialize SendFileResume");
+            return;
+        }
+        diskThread_->ResumeFrom(c, header.streamId, resume.offset);
+        return;
+    }
+    if (header.type == SENDFILE_RESEND) {
+        SendFileResend resend;
+        if (!Serializer().deserialize(resend, message.get())) {
+            log.e(L"Can't deserialize SendFileResend");
+            return;
+        }
+        std::vector<uint64_t> blocks(resend.blocks.size() / sizeof(uint64_t));
+        memcpy(blocks.data(), resend.blocks.data(), blocks.size() * sizeof(uint64_t));
+        diskThread_->ResendBlocks(c, header.streamId, blocks);
+        return;
+    }
+
+    ReceiveData& data = receive_[c];
+    if (header.type == SENDFILE_LIST) {
+        SendFileListHeader fileListHeader;
+        if (!Serializer().deserialize(fileListHeader, message.get())) {
+            log.e(L"Can't deserialize SendFileListHeader");
+            return;
+        }
+        if (fileListHeader.listId != 0) {
+            ReceiveListPart(c, data, fileListHeader);
+        } else if (fileListHeader.count > 0) {
+            data.receiveDir = makeReceiveDir();
+            data.madeDirs.clear();
+            data.filelistRemaining = fileListHeader.count;
+            progress_->update(c, true, [&fileListHeader](ProgressUpdate& up) {
+                up.recv.totalFiles += fileListHeader.count;
+                up.recv.totalBytes += fileListHeader.size;
+            });
+            log.i(L"Going to receive {} files, {} bytes", fileListHeader.count, fileListHeader.size);
+        }
+        return;
+    }
+
+    if (header.type == SENDFILE_BUNDLE) {
+        writing = ReceiveBundle(c, data, std::move(message), size);
+        return;
+    }
+
+    if (header.type == SENDFILE_HEADER) {
+        if (data.streams.find(header.streamId) != data.streams.end()) {
+            log.e(L"Got SENDFILE_HEADER for stream {} which is in use", header.streamId);
+            return;
+        }
+        SendFileHeader fileHeader;
+        if (!Serializer().deserialize(fileHeader, message.get())) {
+            log.e(L"Can't deserialize SendFileHeader");
+            return;
+        }
+        std::wstring origFilename = Utf8ToUtf16(fileHeader.name);
+        log.i(L"Receiving file '{}' of size {}", origFilename, fileHeader.size);
+
+        std::wstring receiveDir;
+        if (data.filelistRemaining == 0) {
+            // Not part of a list
+            progress_->update(c, true, [&fileHeader](ProgressUpdate& up) {
+                up.recv.totalFiles++;
+                up.recv.totalBytes += fileHeader.size;
+            });
+        } else {
+            receiveDir = data.receiveDir;
+            data.filelistRemaining--;
+        }
+
+        bool resumable = !fileHeader.identity.empty();
+        Database::PartialFile partial;
+        partial.pubkey = c.pubkey;
+        partial.name = fileHeader.name;
+        partial.size = fileHeader.size;
+        partial.identity = fileHeader.identity;
+        std::wstring filename;
+        FileIo::File file = resumable ? GetPartialFile(partial, filename) : FileIo::INVALID_FILE;
+        if (file == FileIo::INVALID_FILE) {
+            file = GetReceiveFile(receiveDir, origFilename, filename);
+            partial.length = 0;
+        }
+
+        if (file == FileIo::INVALID_FILE) {
+            log.e(L"Can't create file {}", origFilename);
+            if (resumable) {
+                // The sender waits for the answer. It gets the errors about the unknown stream
+                // as without FEATURE_RESUME
+                diskThread_->SendResumeOffset(c, header.streamId, 0);
+            }
+            return;
+        }
+
+        std::shared_ptr<ReceiveStream> stream = std::make_shared<ReceiveStream>();
+        stream->c = c;
+        stream->streamId = header.streamId;
+        stream->receiveFile = file;
+        stream->receiveFilename = filename;
+        stream->receiveSize = fileHeader.size;
+        stream->merkle = (socketThread_->GetFeatures(c) & FEATURE_MERKLE) != 0;
+        if (stream->merkle) {
+            stream->blockHashes.resize(MerkleHash::blockCount(fileHeader.size));
+        }
+        // In one piece if possible, rather than in as many extents as there are writes
+        if (fileHeader.size > 0) {
+            fileIo_->reserve(file, fileHeader.size);
+        }
+        if (resumable) {
+            stream->resumable = true;
+            stream->partial = partial;
+            stream->partial.path = filename + L".part";
+            db_->SetPartialFile(stream->partial);
+            uint64_t offset = partial.length;
+            if (stream->merkle) {
+                // The blocks received now are hashed as they come
+                offset -= offset % MerkleHash::BLOCK_SIZE;
+            }
+            stream->receivedCount = offset;
+            stream->dataOffset = offset;
+            stream->writtenCount = offset;
+            stream->resumeOffset = offset;
+            stream->resumed = offset > 0;
+            if (stream->resumed) {
+                log.i(L"Resuming '{}' from {} bytes", filename, offset);
+                progress_->update(c, false, [offset](ProgressUpdate& up) {
+                    up.recv.doneBytes += offset;
+                });
+                HashWritten(stream);
+            }
+            diskThread_->SendResumeOffset(c, header.streamId, offset);
+        }
+        data.streams[header.streamId] = std::move(stream);
+        return;
+    }
+
+    auto it = data.streams.find(header.streamId);
+    if (it == data.streams.end()) {
+        log.e(L"Got message type {} for unknown stream {}", header.type, header.streamId);
+        return;
+    }
+    std::shared_ptr<ReceiveStream> stream = it->second;
+    if (header.type == SENDFILE_DATA) {
+        uint32_t count = (uint32_t)message->readSize();
+        if (stream->merkle && !stream->failed && stream->dataOffset + count > stream->receiveSize) {
+            log.e(L"Got more data than the size of '{}'", stream->receiveFilename);
+            stream->failed = true;
+        }
+        if (!stream->resumed && !stream->merkle) {
+            stream->hash.update(message->readData(), count);
+        }
+        if (!stream->failed) {
+            // Handled once written, so that reading from c stops when the disk falls behind
+            writing = true;
+            const uint8_t* p = message->readData();
+            uint32_t left = count;
+            while (left > 0) {
+                if (!stream->pending) {
+                    stream->pending = AllocateWriteBuffer();
+                    stream->pendingOffset = stream->dataOffset + (count - left);
+                }
+                uint32_t n = std::min(left, (uint32_t)stream->pending->writeSize());
+                memcpy(stream->pending->writeData(), p, n);
+                stream->pending->adjustWritePos(n);
+                p += n;
+                left -= n;
+                if (stream->pending->writeSize() == 0) {
+                    Flush(c, data, stream);
+                }
+            }
+            // Goes with the write of its last bytes
+            stream->pendingMessageBytes += size;
+            data.heldBytes += size;
+            if (data.heldBytes > MAX_HELD_BYTES) {
+                for (auto& s : data.streams) {
+                    Flush(c, data, s.second);
+                }
+            }
+        }
+        stream->dataOffset += count;
+        if (!stream->repairing) {
+            stream->receivedCount += count;
+            progress_->update(c, false, [count](ProgressUpdate& up) {
+                up.recv.doneBytes += count;
+            });
+        }
+    } else if (header.type == SENDFILE_HASHES) {
+        SendFileHashes hashes;
+        if (!Serializer().deserialize(hashes, message.get()) ||
+            stream->senderHashes.size() + hashes.hashes.size() > stream->blockHashes.size() * MerkleHash::HASH_BYTES) {
+            // Corrupt blocks won't be told apart
+            log.e(L"Got bad block hashes for '{}'", stream->receiveFilename);
+            return;
+        }
+        stream->senderHashes += hashes.hashes;
+    } else if (header.type == SENDFILE_SEEK) {
+        SendFileSeek seek;
+        if (!Serializer().deserialize(seek, message.get()) || !stream->repairing ||
+            seek.offset % MerkleHash::BLOCK_SIZE != 0 || seek.offset >= stream->receiveSize) {
+            log.e(L"Got a bad SENDFILE_SEEK for '{}'", stream->receiveFilename);
+            stream->failed = true;
+        }
+        Flush(c, data, stream);
+        stream->dataOffset = seek.offset;
+        stream->block.reset();
+    } else if (header.type == SENDFILE_TRAILER) {
+        // Done with the stream id, the sender may reuse it right away
+        data.streams.erase(it);
+        SendFileTrailer fileTrailer;
+        if (!Serializer().deserialize(fileTrailer, message.get())) {
+            log.e(L"Can't deserialize SendFileTrailer");
+            stream->failed = true;
+        }
+        stream->checksum = fileTrailer.checksum;
+        stream->root = fileTrailer.root;
+        if (!stream->repairing) {
+            progress_->update(c, true, [](ProgressUpdate& up) {
+                up.recv.doneFiles++;
+            });
+        }
+        Flush(c, data, stream);
+        EndReceive(stream);
+    } else {
+        log.e(L"Expected type SENDFILE_DATA or SENDFILE_TRAILER, got {}", header.type);
+        data.streams.erase(it);
+        stream->failed = true;
+        Flush(c, data, stream);
+        EndReceive(stream);
+    }
+}
+
+namespace {
+
+// Entries of a bundle being written, which they outlive
+struct BundleWrites {
+    std::vector<SendFileBundleEntry> entries;
+    uint32_t writesInFlight = 0;
+};
+
+}
+
+bool ReceiveThread::ReceiveBundle(const Contact& c, ReceiveData& data, Buffer::UniquePtr message, size_t messageSize) {
+    std::shared_ptr<BundleWrites> bundle = std::make_shared<BundleWrites>();
+    std::vector<SendFileBundleEntry>& entries = bundle->entries;
+    while (message->readSize() > 0) {
+        entries.emplace_back();
+        if (!Serializer().deserialize(entries.back(), message.get())) {
+            log.e(L"Can't deserialize SendFileBundleEntry");
+            entries.pop_back();
+            break;
+        }
+    }
+    message.reset();
+    std::vector<std::string> hashes(entries.size());
+    hashPool_.parallelFor(entries.size(), [&](size_t i) {
+        hashes[i] = MerkleHash::hashBlock((const uint8_t*)entries[i].data.data(), entries[i].data.size());
+    });
+
+    uint64_t bytes = 0;
+    uint64_t unlistedBytes = 0;
+    uint32_t unlistedFiles = 0;
+    for (size_t i = 0; i < entries.size(); i++) {
+        const SendFileBundleEntry& entry = entries[i];
+        std::wstring origFilename = Utf8ToUtf16(entry.name);
+        uint32_t size = (uint32_t)entry.data.size();
+        bytes += size;
+        std::wstring receiveDir;
+        if (data.filelistRemaining == 0) {
+            unlistedFiles++;
+            unlistedBytes += size;
+        } else {
+            receiveDir = data.receiveDir;
+            data.filelistRemaining--;
+        }
+        if (hashes[i] != entry.checksum) {
+            log.e(L"Corrupt file '{}', expected hash {}, actual {}",
+                origFilename, keyToDisplayStr(entry.checksum), keyToDisplayStr(hashes[i]));
+            continue;
+        }
+        std::wstring filename;
+        FileIo::File file = GetBundledFile(data, receiveDir, origFilename, filename);
+        if (file == FileIo::INVALID_FILE) {
+            log.e(L"Can't create file {}", origFilename);
+            continue;
+        }
+        if (size == 0) {
+            fileIo_->close(file);
+            continue;
+        }
+        bundle->writesInFlight++;
+        fileIo_->write(file, 0, entry.data.data(), size, [this, c, bundle, file, filename, size, messageSize](int error, uint32_t count) {
+            fileIo_->close(file);
+            if (error != 0 || count != size) {
+                std::wstring reason = error != 0 ? errstr(error) : fmt::format(L"wrote {} of {} bytes", count, size);
+                log.e(L"Error writing to file being received '{}': {}", filename, reason);
+                DeleteFile(filename.c_str());
+            }
+            if (--bundle->writesInFlight == 0) {
+                socketThread_->MessageHandled(c, messageSize);
+            }
+        });
+    }
+    log.i(L"Received {} small files together, {} bytes", entries.size(), bytes);
+    progress_->update(c, true, [&](ProgressUpdate& up) {
+        up.recv.totalFiles += unlistedFiles;
+        up.recv.totalBytes += unlistedBytes;
+        up.recv.doneFiles += (uint32_t)entries.size();
+        up.recv.doneBytes += bytes;
+    });
+    if (bundle->writesInFlight == 0) {
+        return false;
+    }
+    SubmitIo();
+    return true;
+}
+
+void ReceiveThread::ReceiveListPart(const Contact& c, ReceiveData& data, const SendFileListHeader& fileListHeader) {
+    auto it = data.listDirs.find(fileListHeader.listId);
+    std::wstring receiveDir;
+    if (it == data.listDirs.end()) {
+        if (fileListHeader.count == 0) {
+            return;
+        }
+        receiveDir = makeReceiveDir();
+        log.i(L"Going to receive a list of files as the sender finds them");
+    } else {
+        receiveDir = it->second;
+    }
+    if (fileListHeader.more) {
+        data.listDirs[fileListHeader.listId] = receiveDir;
+    } else {
+        data.listDirs.erase(fileListHeader.listId);
+    }
+    if (receiveDir != data.receiveDir) {
+        data.receiveDir = receiveDir;
+        data.madeDirs.clear();
+    }
+    data.filelistRemaining = fileListHeader.count;
+    progress_->update(c, true, [&fileListHeader](ProgressUpdate& up) {
+        up.recv.totalFiles += fileListHeader.count;
+        up.recv.totalBytes += fileListHeader.size;
+    });
+}
+
+void ReceiveThread::ContactDisconnected(const Contact& c) {
+    RunInThread([this, c] {
+        auto it = receive_.find(c);
+        if (it == receive_.end()) {
+            return;
+        }
+        ReceiveData& data = it->second;
+        for (auto& kv : data.streams) {
+            if (!kv.second->failed) {
+                log.i(L"Stopped receiving '{}' after {} of {} bytes", kv.second->receiveFilename,
+                    kv.second->receivedCount, kv.second->receiveSize);
+            }
+            kv.second->abandoned = true;
+            // What has been received is kept
+            Flush(c, data, kv.second);
+            EndReceive(kv.second);
+        }
+        receive_.erase(it);
+    });
+}
+
+void ReceiveThread::Flush(const Contact& c, ReceiveData& data, const std::shared_ptr<ReceiveStream>& stream) {
+    size_t messageBytes = stream->pendingMessageBytes;
+    stream->pendingMessageBytes = 0;
+    data.heldBytes -= messageBytes;
+    Buffer::UniquePtr buffer = std::move(stream->pending);
+    uint32_t count = buffer ? (uint32_t)buffer->readSize() : 0;
+    if (count == 0 || stream->failed) {
+        if (buffer) {
+            ReleaseWriteBuffer(std::move(buffer));
+        }
+        if (messageBytes > 0) {
+            socketThread_->MessageHandled(c, messageBytes);
+        }
+        return;
+    }
+    uint64_t offset = stream->pendingOffset;
+    if (stream->merkle) {
+        HashBlocks(*stream, offset, buffer->readData(), count);
+    }
+    stream->writesInFlight++;
+    Buffer* p = buffer.release();
+    fileIo_->write(stream->receiveFile, offset, p->readData(), count,
+        [this, c, stream, p, offset, count, messageBytes](int error, uint32_t written) {
+            ReleaseWriteBuffer(Buffer::UniquePtr(p));
+            OnWriteDone(stream, offset, error, written, count);
+            if (messageBytes > 0) {
+                socketThread_->MessageHandled(c, messageBytes);
+            }
+        });
+    SubmitIo();
+}
+
+void ReceiveThread::OnWriteDone(const std::shared_ptr<ReceiveStream>& stream, uint64_t offset, int error, uint32_t count, uint32_t size) {
+    stream->writesInFlight--;
+    if (!stream->failed && (error != 0 || count != size)) {
+        std::wstring reason = error != 0 ? errstr(error) : fmt::format(L"wrote {} of {} bytes", count, size);
+        log.e(L"Error writing to file being received '{}': {}", stream->receiveFilename, reason);
+        stream->failed = true;
+    }
+    if (!stream->failed && !stream->repairing) {
+        // Writes may complete out of order
+        stream->writesDone[offset] = offset + count;
+        auto it = stream->writesDone.begin();
+        while (it != stream->writesDone.end() && it->first == stream->writtenCount) {
+            stream->writtenCount = it->second;
+            it = stream->writesDone.erase(it);
+        }
+        if (stream->resumable && stream->writtenCount >= stream->partial.length + RESUME_SAVE_INTERVAL) {
+            stream->partial.length = stream->writtenCount;
+            db_->SetPartialFile(stream->partial);
+        }
+        if (stream->resumed) {
+            HashWritten(stream);
+        }
+    }
+    if (stream->ended) {
+        EndReceive(stream);
+    }
+}
+
+void ReceiveThread::HashBlocks(ReceiveStream& stream, uint64_t offset, const uint8_t* data, size_t count) {
+    std::vector<uint64_t> wholeBlocks;
+    uint64_t end = offset + count;
+    for (uint64_t pos = offset; pos < end;) {
+        uint64_t index = pos / MerkleHash::BLOCK_SIZE;
+        uint64_t blockStart = index * MerkleHash::BLOCK_SIZE;
+        uint64_t blockEnd = std::min<uint64_t>(blockStart + MerkleHash::BLOCK_SIZE, stream.receiveSize);
+        uint64_t pieceEnd = std::min(blockEnd, end);
+        if (pos == blockStart && pieceEnd == blockEnd) {
+            wholeBlocks.push_back(index);
+        } else {
+            stream.block.update(data + (pos - offset), (size_t)(pieceEnd - pos));
+            if (pieceEnd == blockEnd) {
+                stream.blockHashes[index] = stream.block.result();
+            }
+        }
+        pos = pieceEnd;
+    }
+    hashPool_.parallelFor(wholeBlocks.size(), [&](size_t i) {
+        uint64_t blockStart = wholeBlocks[i] * MerkleHash::BLOCK_SIZE;
+        uint64_t blockEnd = std::min<uint64_t>(blockStart + MerkleHash::BLOCK_SIZE, stream.receiveSize);
+        stream.blockHashes[wholeBlocks[i]] = MerkleHash::hashBlock(data + (blockStart - offset), (size_t)(blockEnd - blockStart));
+    });
+}
+
+uint64_t ReceiveThread::ReadBackEnd(const ReceiveStream& stream) {
+    // The blocks from resumeOffset on are hashed as they are received
+    return stream.merkle ? stream.resumeOffset : stream.writtenCount;
+}
+
+void ReceiveThread::HashWritten(const std::shared_ptr<ReceiveStream>& stream) {
+    uint64_t end = ReadBackEnd(*stream);
+    if (stream->hashing || stream->failed || stream->hashedCount >= end) {
+        return;
+    }
+    if (!stream->hashBuffer) {
+        stream->hashBuffer = AllocateWriteBuffer();
+    }
+    uint32_t size = (uint32_t)std::min<uint64_t>(WRITE_SIZE, end - stream->hashedCount);
+    stream->hashing = true;
+    fileIo_->read(stream->receiveFile, stream->hashedCount, stream->hashBuffer->writeData(), size,
+        [this, stream, size](int error, uint32_t count) {
+            stream->hashing = false;
+            if (!stream->failed && (error != 0 || count != size)) {
+                std::wstring reason = error != 0 ? errstr(error) : fmt::format(L"read {} of {} bytes", count, size);
+                log.e(L"Error reading back file being received '{}': {}", stream->receiveFilename, reason);
+                stream->failed = true;
+            }
+            if (!stream->failed) {
+                if (stream->merkle) {
+                    HashBlocks(*stream, stream->hashedCount, stream->hashBuffer->writeData(), count);
+                } else {
+                    stream->hash.update(stream->hashBuffer->writeData(), count);
+                }
+                stream->hashedCount += count;
+                HashWritten(stream);
+            }
+            if (stream->ended) {
+                EndReceive(stream);
+            }
+        });
+    SubmitIo();
+}
+
+// Finishes the file once its last message has arrived and everything has been written, and
+// hashed if it was resumed. Or once the contact disconnected and the writes are done
+void ReceiveThread::EndReceive(const std::shared_ptr<ReceiveStream>& stream) {
+    stream->ended = true;
+    if (stream->writesInFlight > 0 || stream->hashing) {
+        return;
+    }
+    if (stream->resumed && !stream->failed && !stream->abandoned && stream->hashedCount < ReadBackEnd(*stream)) {
+        HashWritten(stream);
+        return;
+    }
+    std::string dataHash;
+    if (!stream->failed && !stream->abandoned && stream->receivedCount == stream->receiveSize) {
+        if (stream->merkle) {
+            dataHash = MerkleHash::root(stream->blockHashes);
+            if (dataHash != stream->root && RequestBadBlocks(stream)) {
+                // The file stays open for them
+                return;
+            }
+        } else {
+            dataHash = stream->hash.result();
+        }
+    }
+    fileIo_->close(stream->receiveFile);
+    if (stream->hashBuffer) {
+        ReleaseWriteBuffer(std::move(stream->hashBuffer));
+    }
+    if (stream->resumable) {
+        if (stream->abandoned && !stream->failed) {
+            stream->partial.length = stream->writtenCount;
+            db_->SetPartialFile(stream->partial);
+        } else {
+            // Done, or not worth resuming
+            db_->DeletePartialFile(stream->partial.path);
+        }
+    }
+    if (stream->failed || stream->abandoned) {
+        return;
+    }
+    const std::string& expectedHash = stream->merkle ? stream->root : stream->checksum;
+    if (stream->receivedCount != stream->receiveSize) {
+        log.e(L"Bad size for file '{}', expected {}, received {} bytes",
+            stream->receiveFilename, stream->receiveSize, stream->receivedCount);
+    } else if (dataHash != expectedHash) {
+        log.e(L"Corrupt file '{}', expected hash {}, actual {}",
+            stream->receiveFilename, keyToDisplayStr(expectedHash), keyToDisplayStr(dataHash));
+    } else {
+        log.i(L"Finished receiving file '{}', checksum OK", stream->receiveFilename);
+        // The move will fail if the destination file exists, and the .part file will live on.
+        // This is better than overwriting an existing file
+        MoveFile((stream->receiveFilename + L".part").c_str(), stream->receiveFilename.c_str());
+    }
+}
+
+bool ReceiveThread::RequestBadBlocks(const std::shared_ptr<ReceiveStream>& stream) {
+    if (stream->repairing) {
+        return false;
+    }
+    size_t count = stream->blockHashes.size();
+    if (stream->senderHashes.size() != count * MerkleHash::HASH_BYTES) {
+        return false;
+    }
+    std::vector<std::string> senderHashes(count);
+    std::vector<uint64_t> badBlocks;
+    for (size_t i = 0; i < count; i++) {
+        senderHashes[i] = stream->senderHashes.substr(i * MerkleHash::HASH_BYTES, MerkleHash::HASH_BYTES);
+        if (senderHashes[i] != stream->blockHashes[i]) {
+            badBlocks.push_back(i);
+        }
+    }
+    // Hashes that don't add up to the root may be corrupt themselves
+    if (badBlocks.empty() || badBlocks.size() > MAX_RESEND_BLOCKS || MerkleHash::root(std::move(senderHashes)) != stream->root) {
+        return false;
+    }
+    auto it = receive_.find(stream->c);
+    if (it == receive_.end() || it->second.streams.find(stream->streamId) != it->second.streams.end()) {
+        // Disconnected, or the stream id is taken already
+        return false;
+    }
+    log.w(L"{} blocks of '{}' arrived corrupt, asking for them again", badBlocks.size(), stream->receiveFilename);
+    stream->repairing = true;
+    stream->ended = false;
+    it->second.streams[stream->streamId] = stream;
+    diskThread_->SendResendRequest(stream->c, stream->streamId, badBlocks);
+    return true;
+}
+
+FileIo::File ReceiveThread::GetReceiveFile(const std::wstring receiveDir, const std::wstring& origFilename, std::wstring& filename) {
+    if (origFilename.empty() || origFilename.find(L':') != std::wstring::npos || origFilename[0] == L'\\') {
+        return FileIo::INVALID_FILE;
+    }
+    size_t index = origFilename.rfind(L'\\');
+    if (index != std::wstring::npos) {
+        std::wstring dirToMake = receiveDir + L"\\" + origFilename.substr(0, index);
+        int error = SHCreateDirectory(NULL, dirToMake.c_str());
+        if (error != ERROR_SUCCESS && error != ERROR_ALREADY_EXISTS) {
+            return FileIo::INVALID_FILE;
+        }
+    }
+    for (int i = 0; i < 20; i++) {
+        std::wstring candidateFilename = CandidateFilename(receiveDir, origFilename, i);
+        std::wstring candidateFilenamePart = candidateFilename + L".part";
+
+        HANDLE hFile = CreateFile(candidateFilename.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+            NULL, CREATE_NEW, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+        if (hFile == INVALID_HANDLE_VALUE) {
+            continue;
+        }
+
+        FileIo::File partFile = fileIo_->open(candidateFilenamePart, FileIo::CREATE_WRITE);
+        if (partFile == FileIo::INVALID_FILE) {
+            CloseHandle(hFile);
+            continue;
+        }
+
+        CloseHandle(hFile);
+        filename = candidateFilename;
+        return partFile;
+    }
+    return FileIo::INVALID_FILE;
+}
+
+FileIo::File ReceiveThread::GetBundledFile(ReceiveData& data, const std::wstring receiveDir, const std::wstring& origFilename, std::wstring& filename) {
+    if (origFilename.empty() || origFilename.find(L':') != std::wstring::npos || origFilename[0] == L'\\') {
+        return FileIo::INVALID_FILE;
+    }
+    size_t index = origFilename.rfind(L'\\');
+    if (index != std::wstring::npos) {
+        // Made once per list rather than for each file
+        std::wstring dirToMake = receiveDir + L"\\" + origFilename.substr(0, index);
+        if (data.madeDirs.find(dirToMake) == data.madeDirs.end()) {
+            int error = SHCreateDirectory(NULL, dirToMake.c_str());
+            if (error != ERROR_SUCCESS && error != ERROR_ALREADY_EXISTS) {
+                return FileIo::INVALID_FILE;
+            }
+            data.madeDirs.insert(dirToMake);
+        }
+    }
+    for (int i = 0; i < 20; i++) {
+        // Fails on the names taken by files being received, until their .part is renamed
+        std::wstring candidateFilename = CandidateFilename(receiveDir, origFilename, i);
+        FileIo::File file = fileIo_->open(candidateFilename, FileIo::CREATE_WRITE);
+        if (file != FileIo::INVALID_FILE) {
+            filename = candidateFilename;
+            return file;
+        }
+    }
+    return FileIo::INVALID_FILE;
+}
+
+std::wstring ReceiveThread::CandidateFilename(const std::wstring receiveDir, const std::wstring& origFilename, int i) {
+    std::wstring tempFilename = origFilename;
+    if (i != 0) {
+        size_t dotPos = tempFilename.rfind(L'.');
+        if (dotPos == std::wstring::npos) {
+            tempFilename += L"-" + std::to_wstring(i);
+        } else {
+            tempFilename = tempFilename.substr(0, dotPos) + L"-" + std::to_wstring(i) + tempFilename.substr(dotPos);
+        }
+    }
+    return (receiveDir.empty() ? receivePath_ : receiveDir) + L"\\" + tempFilename;
+}
+
+FileIo::File ReceiveThread::GetPartialFile(Database::PartialFile& partial, std::wstring& filename) {
+    if (!db_->GetPartialFile(partial)) {
+        return FileIo::INVALID_FILE;
+    }
+    const std::wstring suffix = L".part";
+    if (partial.path.size() <= suffix.size()) {
+        return FileIo::INVALID_FILE;
+    }
+    std::wstring candidateFilename = partial.path.substr(0, partial.path.size() - suffix.size());
+    HANDLE hFile = CreateFile(candidateFilename.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+        NULL, CREATE_NEW, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) {
+        return FileIo::INVALID_FILE;
+    }
+    FileIo::File partFile = fileIo_->open(partial.path, FileIo::OPEN_READ_WRITE);
+    CloseHandle(hFile);
+    if (partFile == FileIo::INVALID_FILE) {
+        // Deleted or moved away
+        db_->DeletePartialFile(partial.path);
+        return FileIo::INVALID_FILE;
+    }
+    if (fileIo_->size(partFile) < partial.length) {
+        // Truncated since, start over
+        partial.length = 0;
+    }
+    filename = candidateFilename;
+    return partFile;
+}
+
+std::wstring ReceiveThread::makeReceiveDir() {
+    auto now = std::chrono::system_clock::now();
+    std::time_t t = std::chrono::system_clock::to_time_t(now);
+    struct tm tm;
+    localtime_s(&tm, &t);
+    std::wstring timeStr = fmt::format(L"{}-{:02}-{:02} {:02}-{:02}-{:02}",
+        tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+        tm.tm_hour, tm.tm_min, tm.tm_sec);
+
+    std::wstring prefix = receivePath_ + L"\\" + timeStr;
+
+    for (int i = 0; i < 20; i++) {
+        std::wstring path = i == 0 ? prefix : fmt::format(L"{}-{}", prefix, i);
+        if (CreateDirectory(path.c_str(), NULL)) {
+            return path;
+        }
+    }
+
+    return L"";
+}
+
+// Writes are submitted once the messages already posted have been handled, so that those of
+// several messages go together
+void ReceiveThread::SubmitIo() {
+    if (ioSubmitQueued_) {
+        return;
+    }
+    ioSubmitQueued_ = true;
+    RunInThread([this] {
+        ioSubmitQueued_ = false;
+        fileIo_->submit();
+    });
+}
+
+Buffer::UniquePtr ReceiveThread::AllocateWriteBuffer() {
+    if (!freeWriteBuffers_.empty()) {
+        Buffer::UniquePtr buffer = std::move(freeWriteBuffers_.back());
+        freeWriteBuffers_.pop_back();
+        return buffer;
+    }
+    Buffer::UniquePtr buffer(Buffer::create(WRITE_SIZE));
+    if (registeredWriteBuffers_.size() < REGISTERED_WRITE_BUFFERS) {
+        fileIo_->registerMemory(buffer->buffer(), WRITE_SIZE);
+        registeredWriteBuffers_.insert(buffer.get());
+    }
+    return buffer;
+}
+
+void ReceiveThread::ReleaseWriteBuffer(Buffer::UniquePtr buffer) {
+    if (registeredWriteBuffers_.find(buffer.get()) == registeredWriteBuffers_.end()) {
+        return;
+    }
+    buffer->adjustReadPos(-(intptr_t)buffer->readPos());
+    buffer->adjustWritePos(-(intptr_t)buffer->writePos());
+    freeWriteBuffers_.push_back(std::move(buffer));
+}
@@ -0,0 +1,159 @@
+#pragma once
+
+#include "lib/win/MessageThread.h"
+#include "lib/Buffer.h"
+#include "SocketThread.h"
+#include "Logger.h"
+#include "lib/crypto.h"
+#include "lib/FileIo.h"
+#include "lib/MerkleHash.h"
+#include "lib/WorkerPool.h"
+#include "ProgressTracker.h"
+#include "Database.h"
+#include <map>
+#include <memory>
+#include <unordered_set>
+
+class DiskThread;
+struct SendFileListHeader;
+
+// Writes the files received from contacts to disk, while DiskThread reads those sent to them
+class ReceiveThread : public MessageThread {
+public:
+    // Answers to SENDFILE_RESUME and SENDFILE_RESEND go through diskThread, which is the one
+    // sending to contacts. Files are written and read back with fileIo, used from this thread only.
+    ReceiveThread(Logger* logger, SocketThreadApi* socketThread, ProgressTracker* progress, DiskThread* diskThread,
+        Database* db, const std::wstring& receivePath, std::unique_ptr<FileIo> fileIo);
+    // Closes the files being received from c. Those the sender sent an identity for are resumed
+    // if it sends them again.
+    void ContactDisconnected(const Contact& c);
+
+private:
+    // Received data is gathered into writes of this size, at offsets multiple of it, so that
+    // the disk isn't asked for one small write per message
+    enum { WRITE_SIZE = 4 * 1024 * 1024 };
+    // Messages of a contact whose data is held back from the disk, over which it is all written
+    // at once. The socket thread only resumes reading from the contact once less than 8 MiB of
+    // its messages are pending, so what is held once the thread is idle must stay below that,
+    // whatever the number of streams. Past a quarter of its budget, all of it is written.
+    enum { MAX_HELD_BYTES = 4 * 1024 * 1024 };
+    // How often the length of a file that can be resumed is saved, in bytes written
+    enum { RESUME_SAVE_INTERVAL = 64 * 1024 * 1024 };
+    // Past this many corrupt blocks, the file is given up rather than asked again in part
+    enum { MAX_RESEND_BLOCKS = 1024 };
+    // Write buffers registered with fileIo_ as they are first made, and then reused. Enough for
+    // the data held and the writes in flight of a couple of streams, those made past it are freed.
+    enum { REGISTERED_WRITE_BUFFERS = 8 };
+    struct ReceiveStream {
+        Contact c;
+        uint16_t streamId = 0;
+        FileIo::File receiveFile = FileIo::INVALID_FILE;
+        uint64_t receivedCount = 0;
+        // Where the next data goes, past receivedCount once blocks are sent again
+        uint64_t dataOffset = 0;
+        // Data received but not written yet, and the file offset where it goes
+        Buffer::UniquePtr pending;
+        uint64_t pendingOffset = 0;
+        // Size of the messages fully in pending or written, to be handled with its write
+        size_t pendingMessageBytes = 0;
+        uint64_t receiveSize = 0;
+        GenericHash hash;
+        std::wstring receiveFilename;
+        uint32_t writesInFlight = 0;
+        // Bytes at the start of the file that have been written, and the writes that completed
+        // after a gap, by offset, with their end
+        uint64_t writtenCount = 0;
+        std::map<uint64_t, uint64_t> writesDone;
+        bool failed = false;
+        // No more messages will come, it's finished once the writes in flight are done
+        bool ended = false;
+        // Ended because the contact disconnected
+        bool abandoned = false;
+        std::string checksum;
+        // Set if the sender sent an identity, with the entry saved for resuming
+        bool resumable = false;
+        Database::PartialFile partial;
+        // Continues an earlier transfer from resumeOffset. Hashed by reading back what has been
+        // written, as the start of the file wasn't received now: only the start with merkle,
+        // all of it otherwise
+        bool resumed = false;
+        uint64_t resumeOffset = 0;
+        uint64_t hashedCount = 0;
+        bool hashing = false;
+        Buffer::UniquePtr hashBuffer;
+        // With FEATURE_MERKLE, the hashes of the blocks written, empty until done, and the block
+        // split between two writes being hashed
+        bool merkle = false;
+        std::vector<std::string> blockHashes;
+        MerkleHash::Block block;
+        // Those from the sender's SENDFILE_HASHES, one after the other, and its root
+        std::string senderHashes;
+        std::string root;
+        // The blocks that didn't match have been asked again
+        bool repairing = false;
+    };
+    struct ReceiveData {
+        // Files of the last SENDFILE_LIST whose header hasn't arrived yet, and where they go
+        uint32_t filelistRemaining = 0;
+        std::wstring receiveDir;
+        // Where the lists sent in parts go, until their last part
+        std::unordered_map<uint32_t, std::wstring> listDirs;
+        // Directories made for the bundled files of the list
+        std::unordered_set<std::wstring> madeDirs;
+        // Size of the messages held in the pending buffers of the streams, headers included, as
+        // the socket thread counts them: the sum of their pendingMessageBytes
+        size_t heldBytes = 0;
+        // Shared with the writes in flight, which may outlive the entry
+        std::unordered_map<uint16_t, std::shared_ptr<ReceiveStream>> streams;
+    };
+
+    void OnMessageReceived(const Contact& c, Buffer::UniquePtr message);
+    // Creates and writes the files of a SENDFILE_BUNDLE. Returns true if writes are in flight,
+    // the message is handled once they are done.
+    bool ReceiveBundle(const Contact& c, ReceiveData& data, Buffer::UniquePtr message, size_t messageSize);
+    // A SENDFILE_LIST part, its files go where the previous parts' went
+    void ReceiveListPart(const Contact& c, ReceiveData& data, const SendFileListHeader& fileListHeader);
+    // Starts writing the stream's pending data, if any. Dropped if the stream has failed
+    void Flush(const Contact& c, ReceiveData& data, const std::shared_ptr<ReceiveStream>& stream);
+    void OnWriteDone(const std::shared_ptr<ReceiveStream>& stream, uint64_t offset, int error, uint32_t count, uint32_t size);
+    // Hashes data going at offset in a merkle stream, the whole blocks on all cores. Data of a
+    // block split between calls must come in order.
+    void HashBlocks(ReceiveStream& stream, uint64_t offset, const uint8_t* data, size_t count);
+    // Reads back and hashes what has been written to a resumed file since the last call
+    void HashWritten(const std::shared_ptr<ReceiveStream>& stream);
+    static uint64_t ReadBackEnd(const ReceiveStream& stream);
+    void EndReceive(const std::shared_ptr<ReceiveStream>& stream);
+    // Asks the sender for the blocks whose hash isn't the one it sent. False if they can't be
+    // told apart, or were asked once already
+    bool RequestBadBlocks(const std::shared_ptr<ReceiveStream>& stream);
+    void SubmitIo();
+    // A WRITE_SIZE buffer for writing or reading back, a free registered one if there is one
+    Buffer::UniquePtr AllocateWriteBuffer();
+    // Registered buffers go back to the free ones, others are freed
+    void ReleaseWriteBuffer(Buffer::UniquePtr buffer);
+
+    FileIo::File GetReceiveFile(const std::wstring receiveDir, const std::wstring& origFilename, std::wstring& filename);
+    // Same for a bundled file, created under its final name as it's written whole right away
+    FileIo::File GetBundledFile(ReceiveData& data, const std::wstring receiveDir, const std::wstring& origFilename, std::wstring& filename);
+    // Name to try for a received file, with -i added for i > 0
+    std::wstring CandidateFilename(const std::wstring receiveDir, const std::wstring& origFilename, int i);
+    // Opens the .part file of an earlier transfer of the file partial is keyed by, if there is one
+    // and its name is still free
+    FileIo::File GetPartialFile(Database::PartialFile& partial, std::wstring& filename);
+    std::wstring makeReceiveDir();
+
+    Logger& log;
+    SocketThreadApi* socketThread_;
+    ProgressTracker* progress_;
+    DiskThread* diskThread_;
+    Database* db_;
+    std::wstring receivePath_;
+    // Declared before fileIo_, so that the memory registered with it outlives it
+    std::unordered_set<Buffer*> registeredWriteBuffers_;
+    std::vector<Buffer::UniquePtr> freeWriteBuffers_;
+    std::unique_ptr<FileIo> fileIo_;
+    bool ioSubmitQueued_ = false;
+    WorkerPool hashPool_;
+
+    std::unordered_map<Contact, ReceiveData> receive_;
+};
@@ -1,763 +1,1558 @@
-#include <winsock2.h>
-#include "SocketThread.h"
-#include "lib/win/MessageThread.h"
-#include "lib/win/window.h"
-#include "lib/win/raii.h"
-#include "lib/win/encoding.h"
-#include "proto/auth.h"
-#include "lib/crypto.h"
-#include <string>
-#include <vector>
-#include <thread>
-#include <unordered_map>
-#include <deque>
-
-enum { MAX_MESSAGE_SIZE = 100000 };
-
-struct AuthData {
-    enum class Mode { Client, Server };
-    enum class ClientState {
-        Uninitialized,
-        ExpectingServerHelloFinished,
-        Complete,
-        Error,
-    };
-    enum class ServerState {
-        Uninitialized,
-        ExpectingClientHello,
-        ExpectingClientFinished,
-        Complete,
-        Error,
-    };
-    Mode mode;
-    ClientState clientState = ClientState::Uninitialized;
-    ServerState serverState = ServerState::Uninitialized;
-    std::string myKeyShare, myKeySharePriv;
-    std::string peerKeyShare;
-    std::string myRandom, peerRandom;
-    std::string rxkey, txkey;
-    std::string rxnonce, txnonce;
-    std::string peerPubkey;
-    GenericHash transcriptHash;
-
-    Buffer::UniquePtr encryptTx(Buffer::UniquePtr buffer);
-    Buffer::UniquePtr decryptRx(Buffer::UniquePtr buffer);
-};
-
-struct SocketData {
-    SOCKET sock;
-    Contact contact;
-    AuthData auth;
-
-    // Input
-    uint32_t messageLen = 0;
-    uint32_t messageLenLen = 0;
-    Buffer::UniquePtr message;
-
-    // Output
-    bool isCorked = false;
-    bool isQueueFull = false;
-    bool onWriteScheduled = false;
-    std::deque<Buffer*> queue;
-};
-
-class SocketThread : public MessageThread {
-public:
-    enum {
-        WM_SOCKET = WM_APP,
-    };
-
-    enum { LOW_WATERMARK = 10, HIGH_WATERMARK = 100 };
-    enum { MAX_BUFFERS_TO_SEND = 10 };
-
-    SocketThread(Logger& logger, const std::string& myPubkey, const std::string& myPrivKey);
-    void setQueueEmptyCb(std::function<void(const Contact& c)> queueEmptyCb);
-    void setOnMessageCb(std::function<void(const Contact& c, Buffer::UniquePtr message)> onMessageCb);
-    void setOnConnectCb(std::function<void(const Contact& c, bool connected)> cb);
-    void setIsKnownContact(std::function<bool(const std::string& pubkey)> cb);
-    bool SendBuffer(const Contact& c, Buffer::UniquePtr buffer);
-    bool SendBuffer(SocketData& data, Buffer::UniquePtr buffer);
-    void Connect(const Contact& c, const std::string& hostname, uint16_t port);
-    void Disconnect(const Contact& c);
-
-protected:
-    std::optional<LRESULT> HandleMessage(UINT uMsg, WPARAM wParam, LPARAM lParam) override;
-    void InitInThread() override;
-private:
-    void onSocketEvent(SOCKET s, int event, int error);
-    void CloseSocket(SOCKET s);
-    void OnConnect(SOCKET s);
-    void OnRead(SOCKET s);
-    void OnWrite(SOCKET s);
-    void handleIncomingMessage(SocketData& data, Buffer::UniquePtr message);
-
-    void SendClientHelloMessage(SocketData& data);
-    void ServerRecvClientHelloMessage(SocketData& data, Buffer::UniquePtr message);
-    void ClientRecvServerHelloFinishedMessage(SocketData& data, Buffer::UniquePtr message);
-    void ServerRecvClientFinishedMessage(SocketData& data, Buffer::UniquePtr message);
-
-    Logger& log;
-    SOCKET serverSocket_;
-    std::string myPubkey_, myPrivkey_;
-    std::function<void(const Contact& c)> queueEmptyCb_;
-    std::function<void(const Contact& c, Buffer::UniquePtr message)> onMessageCb_;
-    std::function<void(const Contact& c, bool connected)> onConnectCb_;
-    std::function<bool(const std::string& pubkey)> isKnownContact_;
-    std::unordered_map<SOCKET, SocketData> socketData_;
-    std::unordered_map<Contact, SOCKET> contactData_;
-};
-
-void SocketThreadApi::Init(Logger* logger, const std::string& myPubkey, const std::string& myPrivkey) {
-    d = new SocketThread(*logger, myPubkey, myPrivkey);
-    d->Start();
-}
-
-SocketThreadApi::~SocketThreadApi() {
-    delete d;
-}
-
-void SocketThreadApi::setQueueEmptyCb(std::function<void(const Contact& c)> queueEmptyCb) {
-    d->setQueueEmptyCb(std::move(queueEmptyCb));
-}
-
-void SocketThreadApi::setOnMessageCb(std::function<void(const Contact& c, Buffer::UniquePtr message)> onMessageCb) {
-    d->setOnMessageCb(std::move(onMessageCb));
-}
-
-bool SocketThreadApi::SendBuffer(const Contact& c, Buffer* buffer) {
-    return d->RunInThreadWithResult([this, c, buffer] {
-        return d->SendBuffer(c, Buffer::UniquePtr(buffer));
-    });
-}
-void SocketThreadApi::setOnConnectCb(std::function<void(const Contact& c, bool connected)> cb) {
-    d->setOnConnectCb(std::move(cb));
-}
-
-void SocketThreadApi::setIsKnownContact(std::function<bool(const std::string& pubkey)> cb) {
-    d->setIsKnownContact(std::move(cb));
-}
-
-void SocketThreadApi::Connect(const Contact& c, const std::string& hostname, uint16_t port) {
-    d->RunInThread([this, c, hostname, port] {
-        d->Connect(c, hostname, port);
-    });
-}
-
-void SocketThreadApi::Disconnect(const Contact& c) {
-    d->RunInThread([this, c] {
-        d->Disconnect(c);
-    });
-}
-
-SocketThread::SocketThread(Logger& logger, const std::string& myPubkey, const std::string& myPrivkey)
-    : log(logger)
-    , myPubkey_(myPubkey)
-    , myPrivkey_(myPrivkey)
-{
-}
-
-void SocketThread::setQueueEmptyCb(std::function<void(const Contact& c)> queueEmptyCb) {
-    queueEmptyCb_ = std::move(queueEmptyCb);
-}
-
-void SocketThread::setOnMessageCb(std::function<void(const Contact& c, Buffer::UniquePtr message)> onMessageCb) {
-    onMessageCb_ = std::move(onMessageCb);
-}
-
-void SocketThread::setOnConnectCb(std::function<void(const Contact& c, bool connected)> cb) {
-    onConnectCb_ = std::move(cb);
-}
-
-void SocketThread::setIsKnownContact(std::function<bool(const std::string& pubkey)> cb) {
-    isKnownContact_ = std::move(cb);
-}
-
-void SocketThread::InitInThread() {
-    WSADATA wsd;
-    if (WSAStartup(MAKEWORD(2, 2), &wsd) != 0) {
-        log.e(L"WSAStartup error {}", errstr(WSAGetLastError()));
-        return;
-    }
-    serverSocket_ = socket(AF_INET, SOCK_STREAM, 0);
-    sockaddr_in addr = { 0 };
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    addr.sin_port = htons(8890);
-    if (bind(serverSocket_, (sockaddr*)&addr, sizeof(addr)) != 0) {
-        log.e(L"Can bind to port {}, receiving files will not be possible. "
-            "Quit any other program that uses this port and restart this program", 8890);
-        return;
-    }
-    WSAAsyncSelect(serverSocket_, GetHWND(), WM_SOCKET, FD_ACCEPT | FD_CLOSE);
-    listen(serverSocket_, 10);
-}
-
-std::optional<LRESULT> SocketThread::HandleMessage(UINT uMsg, WPARAM wParam, LPARAM lParam) {
-    if (uMsg == WM_SOCKET) {
-        SOCKET sock = (SOCKET)wParam;
-        int error = WSAGETSELECTERROR(lParam);
-        int event = WSAGETSELECTEVENT(lParam);
-        onSocketEvent(sock, event, error);
-        return (LRESULT)0;
-    }
-    return std::nullopt;
-}
-
-void SocketThread::Connect(const Contact& c, const std::string& hostname, uint16_t port) {
-    SOCKET s = socket(AF_INET, SOCK_STREAM, 0);
-    sockaddr_in addr = { 0 };
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = inet_addr(hostname.c_str());
-    addr.sin_port = htons(port);
-    WSAAsyncSelect(s, GetHWND(), WM_SOCKET, FD_CONNECT | FD_READ | FD_WRITE | FD_CLOSE);
-
-    auto it = contactData_.find(c);
-    if (it != contactData_.end()) {
-        CloseSocket(it->second);
-    }
-    contactData_[c] = s;
-    SocketData& data = socketData_[s];
-    data.sock = s;
-    data.contact = c;
-    data.auth.mode = AuthData::Mode::Client;
-    data.auth.clientState = AuthData::ClientState::Uninitialized;
-    data.isCorked = true;
-
-    int res = connect(s, (sockaddr*)&addr, sizeof(addr));
-    if (res < 0 && (res = WSAGetLastError()) != WSAEWOULDBLOCK) {
-        CloseSocket(s);
-        log.e(L"Can't connect, WSAGetLastError={}", errstr(res));
-    }
-}
-
-void SocketThread::Disconnect(const Contact& c) {
-    auto it = contactData_.find(c);
-    if (it != contactData_.end()) {
-        CloseSocket(it->second);
-    }
-}
-
-bool SocketThread::SendBuffer(SocketData& data, Buffer::UniquePtr buffer) {
-    SOCKET s = data.sock;
-
-    if ((data.auth.mode == AuthData::Mode::Client && data.auth.clientState == AuthData::ClientState::Complete) ||
-        (data.auth.mode == AuthData::Mode::Server && data.auth.serverState == AuthData::ServerState::Complete)) {
-        buffer = data.auth.encryptTx(std::move(buffer));
-    }
-    uint32_t size = buffer->readSize();
-    uint8_t* buf = buffer->prependHeader(sizeof(size));
-    memcpy(buf, &size, sizeof(size));
-
-    data.queue.push_back(buffer.release());
-    if (!data.isCorked && !data.onWriteScheduled) {
-        data.onWriteScheduled = true;
-        RunInThread([this, s] {
-            OnWrite(s);
-        });
-    }
-    if (data.queue.size() > HIGH_WATERMARK) {
-        data.isQueueFull = true;
-    }
-    return data.isQueueFull;
-}
-
-bool SocketThread::SendBuffer(const Contact& c, Buffer::UniquePtr buffer) {
-    assert(contactData_.find(c) != contactData_.end());
-
-    SOCKET s = contactData_[c];
-    SocketData& data = socketData_[s];
-    return SendBuffer(data, std::move(buffer));
-}
-
-void SocketThread::CloseSocket(SOCKET s) {
-    if (onConnectCb_) {
-        onConnectCb_(socketData_[s].contact, false);
-    }
-    closesocket(s);
-    contactData_.erase(socketData_[s].contact);
-    socketData_.erase(s);
-}
-
-void SocketThread::OnRead(SOCKET s) {
-    if (socketData_.find(s) == socketData_.end()) {
-        // Socket has been closed, but getting notification for previously received data, ignore
-        return;
-    }
-    SocketData& data = socketData_[s];
-
-    if (data.messageLenLen < 4) {
-        // First read the message length
-        while (data.messageLenLen < 4) {
-            int count = recv(s, (char*)&data.messageLen + data.messageLenLen, 4 - data.messageLenLen, 0);
-            if (count < 0) {
-                int err;
-                if ((err = WSAGetLastError()) == WSAEWOULDBLOCK) {
-                    return;
-                }
-                log.e(L"Error reading from socket, WSAGetLastError={}", errstr(err));
-                CloseSocket(s);
-                return;
-            } else if (count == 0) {
-                // EOF
-                if (data.messageLenLen != 0) {
-                    // Unexpected EOF
-                    log.e(L"End of file reading size from socket");
-                }
-                CloseSocket(s);
-                return;
-            }
-            data.messageLenLen += count;
-        }
-
-        if (data.messageLenLen == 4) {
-            // We just finished reading the length
-            if (data.messageLen < 4 || data.messageLen >= MAX_MESSAGE_SIZE) {
-                log.e(L"Too large message received (dec={0}, hex={0:08x})", data.messageLen);
-                CloseSocket(s);
-                return;
-            }
-            data.message.reset(Buffer::create(data.messageLen));
-        }
-    }
-
-    // Now read the message itself
-    while (data.message->writeSize() != 0) {
-        int count = recv(s, (char*)data.message->writeData(), data.message->writeSize(), 0);
-        if (count < 0) {
-            int err;
-            if ((err = WSAGetLastError()) == WSAEWOULDBLOCK) {
-                return;
-            }
-            log.e(L"Error reading from socket, WSAGetLastError={}", errstr(err));
-            CloseSocket(s);
-        } else if (count == 0) {
-            // Unexpected EOF
-            log.e(L"End of file reading message from socket");
-            CloseSocket(s);
-        }
-        data.message->adjustWritePos(count);
-    }
-
-    // Prepare for next message
-    data.messageLenLen = 0;
-    handleIncomingMessage(data, std::move(data.message));
-}
-
-void SocketThread::OnWrite(SOCKET s) {
-    if (socketData_.find(s) == socketData_.end()) {
-        // Socket has been closed, but getting notification for previously received data, ignore
-        return;
-    }
-    SocketData& data = socketData_[s];
-    data.isCorked = false;
-
-    SCOPE_EXIT {
-        data.onWriteScheduled = !data.isCorked && !data.queue.empty();
-        if (data.onWriteScheduled) {
-            RunInThread([this, s] {
-                OnWrite(s);
-            });
-        }
-        if (data.isQueueFull && data.queue.size() < LOW_WATERMARK) {
-            data.isQueueFull = false;
-            if (queueEmptyCb_) {
-                queueEmptyCb_(data.contact);
-            }
-        }
-    };
-
-    int count = 0;
-    while (!data.queue.empty() && count < MAX_BUFFERS_TO_SEND) {
-        Buffer* buffer = data.queue.front();
-        if (buffer->readSize() == 0) {
-            buffer->destroy();
-            data.queue.pop_front();
-            continue;
-        }
-        int res = send(s, (const char*)buffer->readData(), buffer->readSize(), 0);
-        if (res < 0) {
-            if ((res = WSAGetLastError()) == WSAEWOULDBLOCK) {
-                data.isCorked = true;
-                return;
-            }
-            log.e(L"Error writing to socket, WSAGetLastError={}", errstr(res));
-            CloseSocket(s);
-            return;
-        }
-        buffer->adjustReadPos(res);
-        if (buffer->readSize() == 0) {
-            buffer->destroy();
-            data.queue.pop_front();
-            count++;
-        }
-    }
-}
-
-void SocketThread::onSocketEvent(SOCKET sock, int event, int error) {
-    if (error) {
-        log.e(L"Socket error {}", errstr(error));
-        CloseSocket(sock);
-        return;
-    }
-    switch (event) {
-    case FD_ACCEPT: {
-        sockaddr addr = { 0 };
-        int addrlen = sizeof(addr);
-        SOCKET clientSock = accept(sock, &addr, &addrlen);
-        SocketData& data = socketData_[clientSock];
-        data.sock = clientSock;
-        data.auth.mode = AuthData::Mode::Server;
-        data.auth.serverState = AuthData::ServerState::ExpectingClientHello;
-        WSAAsyncSelect(clientSock, GetHWND(), WM_SOCKET, FD_READ | FD_WRITE | FD_CLOSE);
-        break;
-    }
-    case FD_CONNECT:
-        OnConnect(sock);
-        break;
-    case FD_READ:
-        OnRead(sock);
-        break;
-    case FD_WRITE:
-        OnWrite(sock);
-        break;
-    case FD_CLOSE:
-        OnRead(sock);
-        // Remote side closed, we do nothing, since after reading EOF, we'll close the socket
-        break;
-    }
-}
-
-void SocketThread::OnConnect(SOCKET s) {
-    if (socketData_.find(s) == socketData_.end()) {
-        return;
-    }
-    SocketData& data = socketData_[s];
-    data.isCorked = false;
-
-    assert(data.auth.mode == AuthData::Mode::Client);
-    assert(data.auth.clientState == AuthData::ClientState::Uninitialized);
-    SendClientHelloMessage(data);
-}
-
-void SocketThread::handleIncomingMessage(SocketData& data, Buffer::UniquePtr message) {
-    if ((data.auth.mode == AuthData::Mode::Client && data.auth.clientState == AuthData::ClientState::Complete) ||
-        (data.auth.mode == AuthData::Mode::Server && data.auth.serverState == AuthData::ServerState::Complete)) {
-        message = data.auth.decryptRx(std::move(message));
-        if (!message) {
-            log.e(L"Can't decrypt message");
-            CloseSocket(data.sock);
-            return;
-        }
-        onMessageCb_(data.contact, std::move(message));
-        return;
-    }
-
-    if (data.auth.mode == AuthData::Mode::Client) {
-        if (data.auth.clientState == AuthData::ClientState::ExpectingServerHelloFinished) {
-            ClientRecvServerHelloFinishedMessage(data, std::move(message));
-        } else if (data.auth.clientState == AuthData::ClientState::Error) {
-            log.e(L"Client: Received message in error state");
-            CloseSocket(data.sock);
-        } else if (data.auth.clientState == AuthData::ClientState::Uninitialized) {
-            log.e(L"Client: Received message in uninitialized state");
-            CloseSocket(data.sock);
-        } else {
-            log.e(L"Client: Bad state");
-            CloseSocket(data.sock);
-        }
-    } else {
-        if (data.auth.serverState == AuthData::ServerState::ExpectingClientHello) {
-            ServerRecvClientHelloMessage(data, std::move(message));
-        } else if (data.auth.serverState == AuthData::ServerState::ExpectingClientFinished) {
-            ServerRecvClientFinishedMessage(data, std::move(message));
-        } else if (data.auth.serverState == AuthData::ServerState::Error) {
-            log.e(L"Server: Received message in error state");
-            CloseSocket(data.sock);
-        } else if (data.auth.serverState == AuthData::ServerState::Uninitialized) {
-            log.e(L"Server: Received message in uninitialized state");
-            CloseSocket(data.sock);
-        } else {
-            log.e(L"Server: Bad state");
-            CloseSocket(data.sock);
-        }
-    }
-}
-
-void SocketThread::SendClientHelloMessage(SocketData& data) {
-    AuthData& auth = data.auth;
-
-    auth.transcriptHash.update(std::string(32, ' '));
-
-    auth.myRandom = getRandom(32);
-    auth.txnonce = getRandom(crypto_aead_chacha20poly1305_ietf_NPUBBYTES);
-    auth.myKeyShare.resize(crypto_kx_PUBLICKEYBYTES);
-    auth.myKeySharePriv.resize(crypto_kx_SECRETKEYBYTES);
-    crypto_kx_keypair((unsigned char*)auth.myKeyShare.data(), (unsigned char*)auth.myKeySharePriv.data());
-
-    auth.clientState = AuthData::ClientState::ExpectingServerHelloFinished;
-
-    ClientHelloMessage msg;
-    msg.random = auth.myRandom;
-    msg.kexKeyShare = auth.myKeyShare;
-    msg.nonce = auth.txnonce;
-    Buffer::UniquePtr buf = Serializer().serialize(msg);
-    SendBuffer(data, std::move(buf));
-
-    auth.transcriptHash.update(msg.random);
-    auth.transcriptHash.update(msg.kexKeyShare);
-    auth.transcriptHash.update(msg.nonce);
-}
-
-void SocketThread::ServerRecvClientHelloMessage(SocketData& data, Buffer::UniquePtr message) {
-    AuthData& auth = data.auth;
-    {
-        ClientHelloMessage msg;
-        if (!Serializer().deserialize(msg, message.get()) ||
-            msg.random.size() != 32 ||
-            msg.kexKeyShare.size() != crypto_kx_PUBLICKEYBYTES ||
-            msg.nonce.size() != crypto_aead_chacha20poly1305_ietf_NPUBBYTES) {
-            CloseSocket(data.sock);
-            return;
-        }
-        auth.peerRandom = msg.random;
-        auth.peerKeyShare = msg.kexKeyShare;
-        auth.rxnonce = msg.nonce;
-    }
-
-    auth.transcriptHash.update(std::string(32, ' '));
-    auth.transcriptHash.update(auth.peerRandom);
-    auth.transcriptHash.update(auth.peerKeyShare);
-    auth.transcriptHash.update(auth.rxnonce);
-
-    auth.myRandom = getRandom(32);
-    auth.myKeyShare.resize(crypto_kx_PUBLICKEYBYTES);
-    auth.myKeySharePriv.resize(crypto_kx_SECRETKEYBYTES);
-    crypto_kx_keypair((unsigned char*)auth.myKeyShare.data(), (unsigned char*)auth.myKeySharePriv.data());
-
-    auth.rxkey.resize(crypto_kx_SESSIONKEYBYTES);
-    auth.txkey.resize(crypto_kx_SESSIONKEYBYTES);
-
-    if (crypto_kx_server_session_keys((unsigned char*)auth.rxkey.data(), (unsigned char*)auth.txkey.data(),
-        (unsigned char*)auth.myKeyShare.data(), (unsigned char*)auth.myKeySharePriv.data(),
-        (unsigned char*)auth.peerKeyShare.data()) != 0) {
-        // Suspicious client key
-        CloseSocket(data.sock);
-        return;
-    }
-
-    auth.serverState = AuthData::ServerState::ExpectingClientFinished;
-
-    std::string txnonce = getRandom(crypto_aead_chacha20poly1305_ietf_NPUBBYTES);
-    auth.txnonce = txnonce;
-
-    auth.transcriptHash.update(auth.myRandom);
-    auth.transcriptHash.update(auth.myKeyShare);
-    auth.transcriptHash.update(auth.txnonce);
-    auth.transcriptHash.update(myPubkey_);
-
-    SignatureMessage sigmsg;
-    sigmsg.pubkey = myPubkey_;
-    std::string hash = auth.transcriptHash.resultAndContinue();
-    sigmsg.signature.resize(crypto_sign_BYTES, '\0');
-    crypto_sign_detached((unsigned char*)sigmsg.signature.data(), NULL,
-        (const unsigned char*)hash.data(), hash.size(),
-        (const unsigned char*)myPrivkey_.data());
-    Buffer::UniquePtr serializedSigMsg = Serializer().serialize(sigmsg);
-    Buffer::UniquePtr encrypted = auth.encryptTx(std::move(serializedSigMsg));
-
-    ServerHelloFinishedMessage reply;
-    reply.random = auth.myRandom;
-    reply.kexKeyShare = auth.myKeyShare;
-    reply.nonce = txnonce;  // auth.txnonce has been incremented by encryptTx so don't use it here
-    reply.encryptedSignatureMessage = std::string((const char*)encrypted->readData(), encrypted->readSize());
-    encrypted.reset();
-
-    Buffer::UniquePtr buf = Serializer().serialize(reply);
-    SendBuffer(data, std::move(buf));
-}
-
-void SocketThread::ClientRecvServerHelloFinishedMessage(SocketData& data, Buffer::UniquePtr message) {
-    AuthData& auth = data.auth;
-    ServerHelloFinishedMessage msg;
-
-    if (!Serializer().deserialize(msg, message.get()) ||
-        msg.random.size() != 32 ||
-        msg.kexKeyShare.size() != crypto_kx_PUBLICKEYBYTES ||
-        msg.nonce.size() != crypto_aead_chacha20poly1305_ietf_NPUBBYTES ||
-        msg.encryptedSignatureMessage.size() > 2000) {
-        CloseSocket(data.sock);
-        log.d(L"Client: Bad ServerHelloFinished");
-        return;
-    }
-    auth.peerRandom = msg.random;
-    auth.peerKeyShare = msg.kexKeyShare;
-    auth.rxnonce = msg.nonce;
-
-    auth.rxkey.resize(crypto_kx_SESSIONKEYBYTES);
-    auth.txkey.resize(crypto_kx_SESSIONKEYBYTES);
-
-    if (crypto_kx_client_session_keys((unsigned char*)auth.rxkey.data(), (unsigned char*)auth.txkey.data(),
-        (unsigned char*)auth.myKeyShare.data(), (unsigned char*)auth.myKeySharePriv.data(),
-        (unsigned char*)auth.peerKeyShare.data()) != 0) {
-        // Suspicious server key
-        CloseSocket(data.sock);
-        return;
-    }
-
-    auth.transcriptHash.update(auth.peerRandom);
-    auth.transcriptHash.update(auth.peerKeyShare);
-    auth.transcriptHash.update(auth.rxnonce);
-
-    {
-        Buffer::UniquePtr encrypted(Buffer::create(msg.encryptedSignatureMessage.size()));
-        memcpy(encrypted->writeData(), msg.encryptedSignatureMessage.data(), msg.encryptedSignatureMessage.size());
-        encrypted->adjustWritePos(msg.encryptedSignatureMessage.size());
-
-        Buffer::UniquePtr decrypted = auth.decryptRx(std::move(encrypted));
-        if (!decrypted) {
-            log.d(L"Client: Error decrypting ServerHelloFinished");
-            CloseSocket(data.sock);
-            return;
-        }
-
-        SignatureMessage serversigmsg;
-        if (!Serializer().deserialize(serversigmsg, decrypted.get()) ||
-            serversigmsg.pubkey.size() != crypto_sign_PUBLICKEYBYTES ||
-            serversigmsg.signature.size() != crypto_sign_BYTES) {
-            log.d(L"Client: Wrong server pubkey or signature size");
-            CloseSocket(data.sock);
-            return;
-        }
-        auth.peerPubkey = serversigmsg.pubkey;
-        auth.transcriptHash.update(auth.peerPubkey);
-        std::string hash = auth.transcriptHash.resultAndContinue();
-        if (crypto_sign_verify_detached((const unsigned char*)serversigmsg.signature.data(),
-            (const unsigned char*)hash.data(), hash.size(),
-            (const unsigned char*)auth.peerPubkey.data()) != 0) {
-            log.e(L"Couldn't authenticate server");
-            CloseSocket(data.sock);
-            return;
-        }
-    }
-
-    if (auth.peerPubkey != data.contact.pubkey) {
-        log.e(L"Mismatched peer key, disconnecitng. Excepting: {}, actual: {}",
-            keyToDisplayStr(data.contact.pubkey), keyToDisplayStr(auth.peerPubkey));
-        CloseSocket(data.sock);
-        return;
-    }
-
-    auth.transcriptHash.update(myPubkey_);
-
-    {
-        std::string hash = auth.transcriptHash.result();
-        SignatureMessage clientsigmsg;
-        clientsigmsg.pubkey = myPubkey_;
-        clientsigmsg.signature.resize(crypto_sign_BYTES, '\0');
-        crypto_sign_detached((unsigned char*)clientsigmsg.signature.data(), NULL,
-            (const unsigned char*)hash.data(), hash.size(),
-            (const unsigned char*)myPrivkey_.data());
-        Buffer::UniquePtr serializedSigMsg = Serializer().serialize(clientsigmsg);
-        Buffer::UniquePtr encrypted = auth.encryptTx(std::move(serializedSigMsg));
-
-        ClientFinishedMessage reply;
-        reply.encryptedSignatureMessage = std::string((const char*)encrypted->readData(), encrypted->readSize());
-        encrypted.reset();
-
-        Buffer::UniquePtr buf = Serializer().serialize(reply);
-        SendBuffer(data, std::move(buf));
-    }
-
-    auth.clientState = AuthData::ClientState::Complete;
-
-    if (onConnectCb_) {
-        onConnectCb_(data.contact, true);
-    }
-
-    if (queueEmptyCb_) {
-        queueEmptyCb_(data.contact);
-    }
-}
-
-void SocketThread::ServerRecvClientFinishedMessage(SocketData& data, Buffer::UniquePtr message) {
-    AuthData& auth = data.auth;
-    ClientFinishedMessage msg;
-
-    if (!Serializer().deserialize(msg, message.get()) || msg.encryptedSignatureMessage.size() > 2000) {
-        CloseSocket(data.sock);
-        log.d(L"Server:Bad ClientFinished");
-        return;
-    }
-
-    Buffer::UniquePtr encrypted(Buffer::create(msg.encryptedSignatureMessage.size()));
-    memcpy(encrypted->writeData(), msg.encryptedSignatureMessage.data(), msg.encryptedSignatureMessage.size());
-    encrypted->adjustWritePos(msg.encryptedSignatureMessage.size());
-
-    Buffer::UniquePtr decrypted = auth.decryptRx(std::move(encrypted));
-    if (!decrypted) {
-        log.d(L"Server: Error decrypting ClientFinished");
-        CloseSocket(data.sock);
-        return;
-    }
-
-    SignatureMessage sigmsg;
-    if (!Serializer().deserialize(sigmsg, decrypted.get()) ||
-        sigmsg.pubkey.size() != crypto_sign_PUBLICKEYBYTES ||
-        sigmsg.signature.size() != crypto_sign_BYTES) {
-        log.d(L"Server: Wrong client pubkey or signature size");
-        CloseSocket(data.sock);
-        return;
-    }
-    auth.peerPubkey = sigmsg.pubkey;
-    auth.transcriptHash.update(auth.peerPubkey);
-    std::string hash = auth.transcriptHash.result();
-    if (crypto_sign_verify_detached((const unsigned char*)sigmsg.signature.data(),
-        (const unsigned char*)hash.data(), hash.size(),
-        (const unsigned char*)auth.peerPubkey.data()) != 0) {
-        log.e(L"Couldn't authenticate client");
-        CloseSocket(data.sock);
-        return;
-    }
-
-    
-    if (!isKnownContact_(auth.peerPubkey)) {
-        CloseSocket(data.sock);
-        return;
-    }
-
-    data.contact.pubkey = auth.peerPubkey;
-    contactData_[data.contact] = data.sock;
-    auth.serverState = AuthData::ServerState::Complete;
-
-    if (onConnectCb_) {
-        onConnectCb_(data.contact, true);
-    }
-}
-
-Buffer::UniquePtr AuthData::encryptTx(Buffer::UniquePtr buffer) {
-    Buffer::UniquePtr encrypted(Buffer::create(buffer->readSize() + crypto_aead_chacha20poly1305_IETF_ABYTES));
-    unsigned long long clen;
-    crypto_aead_chacha20poly1305_ietf_encrypt(encrypted->writeData(), &clen, buffer->readData(), buffer->readSize(),
-        NULL, 0, NULL,
-        (const unsigned char*)txnonce.data(), (const unsigned char*)txkey.data());
-    encrypted->adjustWritePos((intptr_t)clen);
-    sodium_increment((unsigned char*)txnonce.data(), txnonce.size());
-    return encrypted;
-}
-
-Buffer::UniquePtr AuthData::decryptRx(Buffer::UniquePtr buffer) {
-    if (buffer->readSize() < crypto_aead_chacha20poly1305_IETF_ABYTES) {
-        return Buffer::UniquePtr();
-    }
-    Buffer::UniquePtr decrypted(Buffer::create(buffer->readSize() - crypto_aead_chacha20poly1305_IETF_ABYTES));
-    unsigned long long mlen;
-    bool forged = crypto_aead_chacha20poly1305_ietf_decrypt(decrypted->writeData(), &mlen, NULL,
-        buffer->readData(), buffer->readSize(), NULL, 0,
-        (const unsigned char*)rxnonce.data(), (const unsigned char*)rxkey.data()) != 0;
-    decrypted->adjustWritePos((intptr_t)mlen);
-    sodium_increment((unsigned char*)rxnonce.data(), rxnonce.size());
-    if (forged) {
-        decrypted.reset();
-    }
-    return decrypted;
-}
+#include "SocketThread.h"
+#include "lib/EventLoop.h"
+#include "lib/win/raii.h"
+#include "lib/win/encoding.h"
+#include "proto/auth.h"
+#include "lib/crypto.h"
+#include "lib/SpscQueue.h"
+#include "lib/WorkerPool.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <thread>
+#include <unordered_map>
+#include <deque>
+
+// Messages must be smaller than this. LEGACY_MESSAGE_SIZE is used with peers that don't
+// negotiate the size, MAX_MESSAGE_SIZE is what we offer in the handshake.
+enum { LEGACY_MESSAGE_SIZE = 100000, MAX_MESSAGE_SIZE = 1024 * 1024 + 64 };
+// Minimal per-connection receive buffer, grown to hold at least two full messages
+enum { RECV_BUFFER_SIZE = 1024 * 1024 };
+
+static uint32_t negotiateMessageSize(uint32_t peerMax) {
+    if (peerMax == 0) {
+        return LEGACY_MESSAGE_SIZE;
+    }
+    return std::max<uint32_t>(LEGACY_MESSAGE_SIZE, std::min<uint32_t>(MAX_MESSAGE_SIZE, peerMax));
+}
+
+// All supported ciphers share the nonce and tag sizes
+enum { NONCE_BYTES = crypto_aead_chacha20poly1305_ietf_NPUBBYTES, TAG_BYTES = crypto_aead_chacha20poly1305_IETF_ABYTES };
+static_assert(NONCE_BYTES == crypto_aead_aes256gcm_NPUBBYTES && TAG_BYTES == crypto_aead_aes256gcm_ABYTES,
+    "Cipher nonce/tag sizes differ");
+
+static uint32_t maxBufferSizeFor(uint32_t maxMessageSize) {
+    return maxMessageSize - 1 - TAG_BYTES;
+}
+
+// AES-GCM is only offered with hardware support, it's slower than ChaCha20 otherwise
+static std::string supportedCiphers() {
+    std::string res;
+    if (crypto_aead_aes256gcm_is_available()) {
+        res += (char)CIPHER_AES256_GCM;
+    }
+    res += (char)CIPHER_CHACHA20_POLY1305;
+    return res;
+}
+
+// What the client offers in ClientHelloMessage, in the transcript of clients and servers that
+// negotiate. Lengths and fixed-size integers keep the fields from running into each other.
+static std::string encodeClientOffer(const std::string& ciphers, uint32_t maxMessageSize, uint32_t features,
+    const std::string& ticket) {
+    std::string res;
+    res += (char)ciphers.size();
+    res += ciphers;
+    res.append((const char*)&maxMessageSize, sizeof(maxMessageSize));
+    res.append((const char*)&features, sizeof(features));
+    res += (char)ticket.size();
+    res += ticket;
+    return res;
+}
+
+// What the server chooses in ServerHelloFinishedMessage, in the transcript after its random
+static std::string encodeServerChoice(uint8_t cipher, uint32_t maxMessageSize, uint32_t features) {
+    std::string res(1, (char)cipher);
+    res.append((const char*)&maxMessageSize, sizeof(maxMessageSize));
+    res.append((const char*)&features, sizeof(features));
+    return res;
+}
+
+// Ends the server's random when the client offered nothing, leaving 24 random bytes. A client that
+// did offer and sees it knows that the offer was removed on the way, even if the server's reply
+// was stripped as well.
+static const char LEGACY_CLIENT_MARK[] = "HSNOOFFR";
+enum { LEGACY_CLIENT_MARK_SIZE = sizeof(LEGACY_CLIENT_MARK) - 1 };
+
+static bool hasLegacyClientMark(const std::string& random) {
+    return random.size() >= LEGACY_CLIENT_MARK_SIZE &&
+        random.compare(random.size() - LEGACY_CLIENT_MARK_SIZE, LEGACY_CLIENT_MARK_SIZE, LEGACY_CLIENT_MARK) == 0;
+}
+
+// Keyed BLAKE2b, derives keys and proofs from a session secret
+static std::string keyedHash(const std::string& key, const char* label, const std::string& data) {
+    std::string input = std::string(label) + '\0' + data;
+    std::string res(crypto_generichash_BYTES, '\0');
+    crypto_generichash((unsigned char*)res.data(), res.size(), (const unsigned char*)input.data(), input.size(),
+        (const unsigned char*)key.data(), key.size());
+    return res;
+}
+
+// Secret left over from a completed handshake. Presenting it on the next connection skips
+// the key exchange and the signatures. Each ticket is used once, every session (resumed
+// or not) produces the next one.
+struct ResumptionTicket {
+    enum { LIFETIME_SECONDS = 24 * 60 * 60, MAX_TICKETS = 1000 };
+    std::string id;
+    std::string secret;
+    std::string peerPubkey;
+    std::chrono::steady_clock::time_point expires;
+};
+
+struct AuthData {
+    enum class Mode { Client, Server };
+    enum class ClientState {
+        Uninitialized,
+        ExpectingServerHelloFinished,
+        Complete,
+        Error,
+    };
+    enum class ServerState {
+        Uninitialized,
+        ExpectingClientHello,
+        ExpectingClientFinished,
+        Complete,
+        Error,
+    };
+    Mode mode;
+    ClientState clientState = ClientState::Uninitialized;
+    ServerState serverState = ServerState::Uninitialized;
+    std::string myKeyShare, myKeySharePriv;
+    std::string peerKeyShare;
+    std::string myRandom, peerRandom;
+    std::string rxkey, txkey;
+    std::string rxnonce, txnonce;
+    std::string peerPubkey;
+    std::string offeredCiphers;
+    uint8_t cipher = CIPHER_CHACHA20_POLY1305;
+    std::string offeredTicket, ticketSecret;
+    GenericHash transcriptHash;
+    std::string handshakeHash;  // Final transcript hash
+
+    bool isComplete() const {
+        return (mode == Mode::Client && clientState == ClientState::Complete) ||
+            (mode == Mode::Server && serverState == ServerState::Complete);
+    }
+
+    // Encrypts in place, appending the tag in the buffer's trailer room
+    Buffer::UniquePtr encryptTx(Buffer::UniquePtr buffer);
+    Buffer::UniquePtr decryptRx(const uint8_t* data, size_t size);
+
+    // Nonces are a counter, so messages can be assigned their nonces in order
+    // and then encrypted/decrypted in any order (and in parallel)
+    std::string nextTxNonce();
+    std::string nextRxNonce();
+    void encrypt(Buffer* buffer, const std::string& nonce) const;
+    Buffer::UniquePtr decrypt(const uint8_t* data, size_t size, const std::string& nonce) const;
+};
+
+// The send queue's high watermark is twice the bandwidth-delay product plus one message,
+// where the delay includes the time the disk thread takes to respond to being uncorked
+enum { MIN_WATERMARK = 256 * 1024, DEFAULT_WATERMARK = 2 * 1024 * 1024, MAX_WATERMARK = 32 * 1024 * 1024 };
+enum { PRODUCER_LATENCY_US = 5000 };
+// Throughput is measured over this interval
+enum { RATE_TIMER_ID = 1, RATE_INTERVAL_MS = 500 };
+
+// Buffers handed over from the disk thread (the only producer) to the socket thread
+struct SendQueue {
+    // Hard limit on the number of buffers, the byte watermarks normally cork well before it
+    enum { CAPACITY = 4096 };
+    SpscQueue<Buffer*> queue{CAPACITY};
+    // Bytes posted and not yet taken by the socket thread
+    std::atomic<size_t> queuedBytes{0};
+    // Bytes taken by the socket thread and not yet sent, only written by the socket thread
+    std::atomic<size_t> sendingBytes{0};
+    // The producer is corked at highWatermark and uncorked below half of it
+    std::atomic<size_t> highWatermark{DEFAULT_WATERMARK};
+    // Set by the producer when it should stop, cleared by whichever side sees the queue drained
+    std::atomic<bool> corked{false};
+    // Set while a wakeup of the socket thread is pending
+    std::atomic<bool> drainScheduled{false};
+    // Largest buffer the producer may send, updated when a connection negotiates it
+    std::atomic<uint32_t> maxBufferSize{maxBufferSizeFor(LEGACY_MESSAGE_SIZE)};
+    // Features supported by both sides, updated when a connection is established
+    std::atomic<uint32_t> features{0};
+    // Socket thread only. Connections closed whose buffers are still to drop, each up to the
+    // marker (a null buffer) that DisconnectHandled posts.
+    uint32_t closedConnections = 0;
+
+    ~SendQueue() {
+        Buffer* buffer;
+        while (queue.pop(buffer)) {
+            if (buffer != nullptr) {
+                buffer->destroy();
+            }
+        }
+    }
+
+    size_t totalBytes() const {
+        return queuedBytes + sendingBytes;
+    }
+    bool isAboveHighWatermark() const {
+        return totalBytes() >= highWatermark || queue.size() >= CAPACITY / 2;
+    }
+    bool isBelowLowWatermark() const {
+        return totalBytes() < highWatermark / 2 && queue.size() < CAPACITY / 4;
+    }
+};
+
+// Received messages handed to onMessageCb_ that its owner hasn't handled yet
+struct ReceiveBudget {
+    // Reading from the contact stops above this, and resumes below half of it. Only
+    // MessageHandled resumes it, so a receiver must not hold back messages totalling half of
+    // this or more (whole message sizes, header included, over all its streams) while waiting
+    // for more to come: it would wait forever.
+    enum { MAX_PENDING_BYTES = 16 * 1024 * 1024 };
+    std::atomic<size_t> pendingBytes{0};
+    // Set by the socket thread when it stops reading, cleared by whoever resumes it
+    std::atomic<bool> paused{false};
+};
+
+struct SocketData {
+    SOCKET sock;
+    Contact contact;
+    AuthData auth;
+
+    // Input, may hold several messages, the last one possibly partial
+    Buffer::UniquePtr recvBuffer;
+    uint32_t maxMessageSize = LEGACY_MESSAGE_SIZE;
+    uint32_t peerFeatures = 0;
+    // Set once authenticated
+    std::shared_ptr<ReceiveBudget> receiveBudget;
+    bool readPaused = false;
+
+    // Output
+    bool isCorked = false;
+    bool onWriteScheduled = false;
+    std::deque<Buffer*> queue;
+    size_t queuedBytes = 0;     // In queue
+    // Set once authenticated, buffers are taken from it as the socket drains
+    std::shared_ptr<SendQueue> sendQueue;
+
+    // For sizing sendQueue
+    uint64_t sentBytes = 0;     // Since the last rate timer tick
+    bool wasBacklogged = false; // Socket send buffer filled up since the last tick
+    double sendRate = 0;        // Bytes per second
+    uint32_t handshakeRttUs = 0;    // Used if the OS doesn't tell the RTT
+    std::chrono::steady_clock::time_point handshakeStart;
+};
+
+class SocketThread : public EventLoop {
+public:
+    // Limits for a single gather-send in OnWrite
+    enum { MAX_IOVECS = 64, MAX_BYTES_PER_SEND = 1024 * 1024 };
+    // Smaller batches are encrypted/decrypted on the socket thread alone
+    enum { MIN_PARALLEL_CRYPTO_BYTES = 256 * 1024 };
+
+    SocketThread(Logger& logger, const std::string& myPubkey, const std::string& myPrivKey);
+    void setQueueEmptyCb(std::function<void(const Contact& c)> queueEmptyCb);
+    void setOnMessageCb(std::function<void(const Contact& c, Buffer::UniquePtr message)> onMessageCb);
+    void setOnConnectCb(std::function<void(const Contact& c, bool connected)> cb);
+    void setIsKnownContact(std::function<bool(const std::string& pubkey)> cb);
+    // Called from the disk thread
+    bool PostBuffer(const Contact& c, Buffer::UniquePtr buffer);
+    size_t GetMaxBufferSize(const Contact& c);
+    size_t GetQueuedBytes(const Contact& c);
+    void setFeatures(uint32_t features);
+    uint32_t GetFeatures(const Contact& c);
+    void MessageHandled(const Contact& c, size_t size);
+    void DisconnectHandled(const Contact& c);
+    void SendBuffer(SocketData& data, Buffer::UniquePtr buffer);
+    void Connect(const Contact& c, const std::string& hostname, uint16_t port);
+    void Disconnect(const Contact& c);
+
+protected:
+    void InitInThread() override;
+    void OnSocketEvent(SOCKET s, int event, int error) override;
+    void OnTimer(uintptr_t id) override;
+private:
+    void CloseSocket(SOCKET s);
+    void OnConnect(SOCKET s);
+    void OnRead(SOCKET s);
+    void OnWrite(SOCKET s);
+    void ScheduleWrite(SocketData& data);
+    void QueueBuffer(SocketData& data, Buffer::UniquePtr buffer);
+    void QueueEncryptedBatch(SocketData& data, Buffer** buffers, size_t count);
+    void HandleDecryptedBatch(SocketData& data, const std::vector<std::pair<const uint8_t*, size_t>>& messages);
+    std::shared_ptr<SendQueue> GetSendQueue(const Contact& c);
+    bool Post(const Contact& c, Buffer* buffer);
+    bool DropClosedMessages(SendQueue& q);
+    void MaybeUncork(SendQueue& q, const Contact& c);
+    std::shared_ptr<ReceiveBudget> GetReceiveBudget(const Contact& c);
+    bool MaybePauseReading(SocketData& data);
+    void ResumeReading(const Contact& c);
+    void handleIncomingMessage(SocketData& data, const uint8_t* message, size_t size);
+
+    void SendClientHelloMessage(SocketData& data);
+    void ServerRecvClientHelloMessage(SocketData& data, Buffer::UniquePtr message);
+    void ClientRecvServerHelloFinishedMessage(SocketData& data, Buffer::UniquePtr message);
+    void ServerRecvClientFinishedMessage(SocketData& data, Buffer::UniquePtr message);
+    bool ServerResumeSession(SocketData& data, const std::string& binder);
+    void ClientResumeSession(SocketData& data, const ServerHelloFinishedMessage& msg);
+    void CompleteHandshake(SocketData& data);
+    void StoreResumptionTicket(SocketData& data);
+
+    Logger& log;
+    SOCKET serverSocket_;
+    std::string myPubkey_, myPrivkey_;
+    std::function<void(const Contact& c)> queueEmptyCb_;
+    std::function<void(const Contact& c, Buffer::UniquePtr message)> onMessageCb_;
+    std::function<void(const Contact& c, bool connected)> onConnectCb_;
+    std::function<bool(const std::string& pubkey)> isKnownContact_;
+    uint32_t features_ = 0;
+    std::unordered_map<SOCKET, SocketData> socketData_;
+    std::unordered_map<Contact, SOCKET> contactData_;
+    std::mutex sendQueuesMutex_;
+    std::unordered_map<Contact, std::shared_ptr<SendQueue>> sendQueues_;
+    std::mutex receiveBudgetsMutex_;
+    std::unordered_map<Contact, std::shared_ptr<ReceiveBudget>> receiveBudgets_;
+    // Tickets to present when connecting, by peer pubkey
+    std::unordered_map<std::string, ResumptionTicket> clientTickets_;
+    // Tickets peers may present when connecting to us, by ticket id
+    std::unordered_map<std::string, ResumptionTicket> serverTickets_;
+    // Encrypts and decrypts large batches of messages on all cores
+    WorkerPool cryptoPool_;
+};
+
+void SocketThreadApi::Init(Logger* logger, const std::string& myPubkey, const std::string& myPrivkey) {
+    d = new SocketThread(*logger, myPubkey, myPrivkey);
+    d->Start();
+}
+
+SocketThreadApi::~SocketThreadApi() {
+    delete d;
+}
+
+void SocketThreadApi::setQueueEmptyCb(std::function<void(const Contact& c)> queueEmptyCb) {
+    d->setQueueEmptyCb(std::move(queueEmptyCb));
+}
+
+void SocketThreadApi::setOnMessageCb(std::function<void(const Contact& c, Buffer::UniquePtr message)> onMessageCb) {
+    d->setOnMessageCb(std::move(onMessageCb));
+}
+
+bool SocketThreadApi::SendBuffer(const Contact& c, Buffer* buffer) {
+    return d->PostBuffer(c, Buffer::UniquePtr(buffer));
+}
+
+size_t SocketThreadApi::GetMaxBufferSize(const Contact& c) {
+    return d->GetMaxBufferSize(c);
+}
+
+size_t SocketThreadApi::GetQueuedBytes(const Contact& c) {
+    return d->GetQueuedBytes(c);
+}
+
+void SocketThreadApi::setFeatures(uint32_t features) {
+    d->setFeatures(features);
+}
+
+uint32_t SocketThreadApi::GetFeatures(const Contact& c) {
+    return d->GetFeatures(c);
+}
+
+void SocketThreadApi::MessageHandled(const Contact& c, size_t size) {
+    d->MessageHandled(c, size);
+}
+
+void SocketThreadApi::DisconnectHandled(const Contact& c) {
+    d->DisconnectHandled(c);
+}
+void SocketThreadApi::setOnConnectCb(std::function<void(const Contact& c, bool connected)> cb) {
+    d->setOnConnectCb(std::move(cb));
+}
+
+void SocketThreadApi::setIsKnownContact(std::function<bool(const std::string& pubkey)> cb) {
+    d->setIsKnownContact(std::move(cb));
+}
+
+void SocketThreadApi::Connect(const Contact& c, const std::string& hostname, uint16_t port) {
+    d->RunInThread([this, c, hostname, port] {
+        d->Connect(c, hostname, port);
+    });
+}
+
+void SocketThreadApi::Disconnect(const Contact& c) {
+    d->RunInThread([this, c] {
+        d->Disconnect(c);
+    });
+}
+
+SocketThread::SocketThread(Logger& logger, const std::string& myPubkey, const std::string& myPrivkey)
+    : log(logger)
+    , myPubkey_(myPubkey)
+    , myPrivkey_(myPrivkey)
+    , cryptoPool_(std::max(1u, std::thread::hardware_concurrency()) - 1)
+{
+}
+
+void SocketThread::setQueueEmptyCb(std::function<void(const Contact& c)> queueEmptyCb) {
+    queueEmptyCb_ = std::move(queueEmptyCb);
+}
+
+void SocketThread::setOnMessageCb(std::function<void(const Contact& c, Buffer::UniquePtr message)> onMessageCb) {
+    onMessageCb_ = std::move(onMessageCb);
+}
+
+void SocketThread::setOnConnectCb(std::function<void(const Contact& c, bool connected)> cb) {
+    onConnectCb_ = std::move(cb);
+}
+
+void SocketThread::setIsKnownContact(std::function<bool(const std::string& pubkey)> cb) {
+    isKnownContact_ = std::move(cb);
+}
+
+void SocketThread::InitInThread() {
+#ifdef _WIN32
+    WSADATA wsd;
+    if (WSAStartup(MAKEWORD(2, 2), &wsd) != 0) {
+        log.e(L"WSAStartup error {}", errstr(WSAGetLastError()));
+        return;
+    }
+#endif
+    SetTimer(RATE_TIMER_ID, RATE_INTERVAL_MS);
+
+    serverSocket_ = socket(AF_INET, SOCK_STREAM, 0);
+#ifndef _WIN32
+    // Allow restarting while old connections are in TIME_WAIT. On Windows SO_REUSEADDR
+    // means something else entirely (allows stealing the port), so it's not used there.
+    int reuse = 1;
+    setsockopt(serverSocket_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+#endif
+    sockaddr_in addr = { 0 };
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(8890);
+    if (bind(serverSocket_, (sockaddr*)&addr, sizeof(addr)) != 0) {
+        log.e(L"Can bind to port {}, receiving files will not be possible. "
+            "Quit any other program that uses this port and restart this program", 8890);
+        return;
+    }
+    WatchSocket(serverSocket_, EV_ACCEPT | EV_CLOSE);
+    listen(serverSocket_, 10);
+}
+
+void SocketThread::Connect(const Contact& c, const std::string& hostname, uint16_t port) {
+    SOCKET s = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr = { 0 };
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr(hostname.c_str());
+    addr.sin_port = htons(port);
+    WatchSocket(s, EV_CONNECT | EV_READ | EV_WRITE | EV_CLOSE);
+
+    auto it = contactData_.find(c);
+    if (it != contactData_.end()) {
+        CloseSocket(it->second);
+    }
+    contactData_[c] = s;
+    SocketData& data = socketData_[s];
+    data.sock = s;
+    data.contact = c;
+    data.auth.mode = AuthData::Mode::Client;
+    data.auth.clientState = AuthData::ClientState::Uninitialized;
+    data.isCorked = true;
+
+    int res = connect(s, (sockaddr*)&addr, sizeof(addr));
+    if (res < 0 && !isWouldBlock(res = socketError())) {
+        CloseSocket(s);
+        log.e(L"Can't connect, error={}", errstr(res));
+    }
+}
+
+void SocketThread::Disconnect(const Contact& c) {
+    auto it = contactData_.find(c);
+    if (it != contactData_.end()) {
+        CloseSocket(it->second);
+    }
+}
+
+static void prependLength(Buffer* buffer) {
+    uint32_t size = buffer->readSize();
+    uint8_t* buf = buffer->prependHeader(sizeof(size));
+    memcpy(buf, &size, sizeof(size));
+}
+
+void SocketThread::QueueBuffer(SocketData& data, Buffer::UniquePtr buffer) {
+    if (data.auth.isComplete()) {
+        buffer = data.auth.encryptTx(std::move(buffer));
+    }
+    prependLength(buffer.get());
+    data.queuedBytes += buffer->readSize();
+    data.queue.push_back(buffer.release());
+}
+
+void SocketThread::QueueEncryptedBatch(SocketData& data, Buffer** buffers, size_t count) {
+    std::vector<std::string> nonces(count);
+    size_t bytes = 0;
+    for (size_t i = 0; i < count; i++) {
+        nonces[i] = data.auth.nextTxNonce();
+        bytes += buffers[i]->readSize();
+    }
+    auto encryptOne = [&](size_t i) {
+        data.auth.encrypt(buffers[i], nonces[i]);
+    };
+    if (bytes >= MIN_PARALLEL_CRYPTO_BYTES) {
+        cryptoPool_.parallelFor(count, encryptOne);
+    } else {
+        for (size_t i = 0; i < count; i++) {
+            encryptOne(i);
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        prependLength(buffers[i]);
+        data.queuedBytes += buffers[i]->readSize();
+        data.queue.push_back(buffers[i]);
+    }
+}
+
+void SocketThread::SendBuffer(SocketData& data, Buffer::UniquePtr buffer) {
+    QueueBuffer(data, std::move(buffer));
+    ScheduleWrite(data);
+}
+
+void SocketThread::ScheduleWrite(SocketData& data) {
+    if (!data.isCorked && !data.onWriteScheduled) {
+        data.onWriteScheduled = true;
+        SOCKET s = data.sock;
+        RunInThread([this, s] {
+            OnWrite(s);
+        });
+    }
+}
+
+std::shared_ptr<SendQueue> SocketThread::GetSendQueue(const Contact& c) {
+    std::lock_guard<std::mutex> lock(sendQueuesMutex_);
+    std::shared_ptr<SendQueue>& q = sendQueues_[c];
+    if (!q) {
+        q = std::make_shared<SendQueue>();
+    }
+    return q;
+}
+
+std::shared_ptr<ReceiveBudget> SocketThread::GetReceiveBudget(const Contact& c) {
+    std::lock_guard<std::mutex> lock(receiveBudgetsMutex_);
+    std::shared_ptr<ReceiveBudget>& b = receiveBudgets_[c];
+    if (!b) {
+        b = std::make_shared<ReceiveBudget>();
+    }
+    return b;
+}
+
+void SocketThread::MessageHandled(const Contact& c, size_t size) {
+    std::shared_ptr<ReceiveBudget> b = GetReceiveBudget(c);
+    size_t pending = b->pendingBytes -= size;
+    if (pending < ReceiveBudget::MAX_PENDING_BYTES / 2 && b->paused.exchange(false)) {
+        RunInThread([this, c] {
+            ResumeReading(c);
+        });
+    }
+}
+
+bool SocketThread::MaybePauseReading(SocketData& data) {
+    ReceiveBudget& b = *data.receiveBudget;
+    if (b.pendingBytes < ReceiveBudget::MAX_PENDING_BYTES) {
+        return false;
+    }
+    b.paused = true;
+    // MessageHandled may have drained the budget before seeing paused set, and won't resume
+    if (b.pendingBytes < ReceiveBudget::MAX_PENDING_BYTES / 2 && b.paused.exchange(false)) {
+        return false;
+    }
+    // The receiver can't keep up (e.g. a slow disk). Not reading fills the socket's receive
+    // buffer, and TCP flow control then slows down the sender.
+    data.readPaused = true;
+    WatchSocket(data.sock, EV_WRITE | EV_CLOSE);
+    return true;
+}
+
+void SocketThread::ResumeReading(const Contact& c) {
+    auto it = contactData_.find(c);
+    if (it == contactData_.end()) {
+        // Disconnected meanwhile
+        return;
+    }
+    SocketData& data = socketData_[it->second];
+    if (data.readPaused) {
+        data.readPaused = false;
+        // Reports the data that has been waiting right away
+        WatchSocket(data.sock, EV_READ | EV_WRITE | EV_CLOSE);
+    }
+}
+
+size_t SocketThread::GetMaxBufferSize(const Contact& c) {
+    return GetSendQueue(c)->maxBufferSize;
+}
+
+size_t SocketThread::GetQueuedBytes(const Contact& c) {
+    return GetSendQueue(c)->totalBytes();
+}
+
+void SocketThread::setFeatures(uint32_t features) {
+    features_ = features;
+}
+
+uint32_t SocketThread::GetFeatures(const Contact& c) {
+    return GetSendQueue(c)->features;
+}
+
+bool SocketThread::PostBuffer(const Contact& c, Buffer::UniquePtr buffer) {
+    return Post(c, buffer.release());
+}
+
+void SocketThread::DisconnectHandled(const Contact& c) {
+    if (!c.pubkey.empty()) {
+        // Marks the end of what was posted for the closed connection
+        Post(c, nullptr);
+    }
+}
+
+bool SocketThread::Post(const Contact& c, Buffer* buffer) {
+    std::shared_ptr<SendQueue> q = GetSendQueue(c);
+    // Counted before it's visible to the socket thread, which subtracts it when taking the buffer
+    q->queuedBytes += buffer != nullptr ? buffer->readSize() : 0;
+    while (!q->queue.push(buffer)) {
+        // Only possible if the caller keeps sending after being corked
+        std::this_thread::yield();
+    }
+
+    if (!q->drainScheduled.exchange(true)) {
+        RunInThread([this, c, q] {
+            q->drainScheduled = false;
+            auto it = contactData_.find(c);
+            if (it == contactData_.end()) {
+                if (q->closedConnections > 0) {
+                    DropClosedMessages(*q);
+                    MaybeUncork(*q, c);
+                }
+                return;
+            }
+            SocketData& data = socketData_[it->second];
+            if (data.sendQueue == q) {
+                ScheduleWrite(data);
+            }
+        });
+    }
+
+    if (!q->isAboveHighWatermark()) {
+        return false;
+    }
+    q->corked = true;
+    // The socket thread may have drained the queue before seeing corked set, so it won't uncork
+    if (q->isBelowLowWatermark() && q->corked.exchange(false)) {
+        return false;
+    }
+    return true;
+}
+
+// Drops what was posted for connections that closed, up to the markers of DisconnectHandled.
+// Returns true once the buffers left are for the next connection.
+bool SocketThread::DropClosedMessages(SendQueue& q) {
+    Buffer* buffer;
+    while (q.closedConnections > 0 && q.queue.pop(buffer)) {
+        if (buffer == nullptr) {
+            q.closedConnections--;
+        } else {
+            q.queuedBytes -= buffer->readSize();
+            buffer->destroy();
+        }
+    }
+    return q.closedConnections == 0;
+}
+
+void SocketThread::MaybeUncork(SendQueue& q, const Contact& c) {
+    if (q.isBelowLowWatermark() && q.corked.exchange(false)) {
+        if (queueEmptyCb_) {
+            queueEmptyCb_(c);
+        }
+    }
+}
+
+void SocketThread::CloseSocket(SOCKET s) {
+    SocketData& data = socketData_[s];
+    Contact c = data.contact;
+    std::shared_ptr<SendQueue> q;
+    if (!c.pubkey.empty()) {
+        // Counted before the owner hears of it, so that its DisconnectHandled marker comes after
+        q = GetSendQueue(c);
+        q->closedConnections++;
+    }
+    if (onConnectCb_) {
+        onConnectCb_(c, false);
+    }
+    // Frames are encrypted for this connection, and the posted buffers are parts of transfers
+    // that the contact will drop. Neither mean anything to the next connection.
+    for (Buffer* buffer : data.queue) {
+        buffer->destroy();
+    }
+    data.queue.clear();
+    data.queuedBytes = 0;
+    if (q) {
+        q->sendingBytes = 0;
+        DropClosedMessages(*q);
+        // The owner may be waiting to be uncorked, and then goes on with what it sends next
+        MaybeUncork(*q, c);
+    }
+    UnwatchSocket(s);
+    closesocket(s);
+    contactData_.erase(socketData_[s].contact);
+    socketData_.erase(s);
+}
+
+void SocketThread::OnRead(SOCKET s) {
+    if (socketData_.find(s) == socketData_.end()) {
+        // Socket has been closed, but getting notification for previously received data, ignore
+        return;
+    }
+    SocketData& data = socketData_[s];
+    if (data.readPaused) {
+        // Notification from before pausing
+        return;
+    }
+    if (data.receiveBudget && MaybePauseReading(data)) {
+        return;
+    }
+
+    size_t wantedSize = std::max<size_t>(RECV_BUFFER_SIZE, 2 * (sizeof(uint32_t) + data.maxMessageSize));
+    if (!data.recvBuffer || data.recvBuffer->capacity() < wantedSize) {
+        // First read, or the handshake raised the message size
+        Buffer::UniquePtr newBuffer(Buffer::create(wantedSize));
+        if (data.recvBuffer) {
+            memcpy(newBuffer->writeData(), data.recvBuffer->readData(), data.recvBuffer->readSize());
+            newBuffer->adjustWritePos(data.recvBuffer->readSize());
+        }
+        data.recvBuffer = std::move(newBuffer);
+    }
+    Buffer* buf = data.recvBuffer.get();
+    if (buf->readSize() == 0 || buf->writeSize() < sizeof(uint32_t) + data.maxMessageSize) {
+        // Move the partial message (if any) to the front, so that it can be completed in place
+        buf->compact();
+    }
+
+    // Read as much as is available with one call, and then handle all complete messages
+    int count = recv(s, (char*)buf->writeData(), buf->writeSize(), 0);
+    if (count < 0) {
+        int err;
+        if (isWouldBlock(err = socketError())) {
+            return;
+        }
+        log.e(L"Error reading from socket, error={}", errstr(err));
+        CloseSocket(s);
+        return;
+    } else if (count == 0) {
+        // EOF
+        if (buf->readSize() != 0) {
+            // Unexpected EOF
+            log.e(L"End of file reading message from socket");
+        }
+        CloseSocket(s);
+        return;
+    }
+    buf->adjustWritePos(count);
+
+    // Messages after the handshake are collected and decrypted together
+    std::vector<std::pair<const uint8_t*, size_t>> batch;
+    while (buf->readSize() >= sizeof(uint32_t)) {
+        uint32_t messageLen;
+        memcpy(&messageLen, buf->readData(), sizeof(messageLen));
+        if (messageLen < 4 || messageLen >= data.maxMessageSize) {
+            log.e(L"Too large message received (dec={0}, hex={0:08x})", messageLen);
+            CloseSocket(s);
+            return;
+        }
+        if (buf->readSize() < sizeof(messageLen) + messageLen) {
+            // Partial message, wait for the rest
+            break;
+        }
+        // The message stays valid until the next recv() into the buffer
+        const uint8_t* message = buf->readData() + sizeof(messageLen);
+        buf->adjustReadPos(sizeof(messageLen) + messageLen);
+        if (data.auth.isComplete()) {
+            batch.emplace_back(message, messageLen);
+            continue;
+        }
+        handleIncomingMessage(data, message, messageLen);
+        if (socketData_.find(s) == socketData_.end()) {
+            // Closed while handling the message
+            return;
+        }
+    }
+    if (!batch.empty()) {
+        HandleDecryptedBatch(data, batch);
+    }
+}
+
+void SocketThread::HandleDecryptedBatch(SocketData& data, const std::vector<std::pair<const uint8_t*, size_t>>& messages) {
+    size_t count = messages.size();
+    std::vector<std::string> nonces(count);
+    size_t bytes = 0;
+    for (size_t i = 0; i < count; i++) {
+        nonces[i] = data.auth.nextRxNonce();
+        bytes += messages[i].second;
+    }
+    std::vector<Buffer::UniquePtr> decrypted(count);
+    auto decryptOne = [&](size_t i) {
+        decrypted[i] = data.auth.decrypt(messages[i].first, messages[i].second, nonces[i]);
+    };
+    if (bytes >= MIN_PARALLEL_CRYPTO_BYTES) {
+        cryptoPool_.parallelFor(count, decryptOne);
+    } else {
+        for (size_t i = 0; i < count; i++) {
+            decryptOne(i);
+        }
+    }
+
+    // Deliver in order, up to the first message that fails to decrypt
+    SOCKET s = data.sock;
+    for (size_t i = 0; i < count; i++) {
+        if (!decrypted[i]) {
+            log.e(L"Can't decrypt message");
+            CloseSocket(s);
+            return;
+        }
+        data.receiveBudget->pendingBytes += decrypted[i]->readSize();
+        onMessageCb_(data.contact, std::move(decrypted[i]));
+        if (socketData_.find(s) == socketData_.end()) {
+            return;
+        }
+    }
+}
+
+void SocketThread::OnWrite(SOCKET s) {
+    if (socketData_.find(s) == socketData_.end()) {
+        // Socket has been closed, but getting notification for previously received data, ignore
+        return;
+    }
+    SocketData& data = socketData_[s];
+    data.isCorked = false;
+
+    SCOPE_EXIT {
+        if (socketData_.find(s) == socketData_.end()) {
+            // Closed on error
+            return;
+        }
+        if (data.sendQueue) {
+            data.sendQueue->sendingBytes = data.queuedBytes;
+        }
+        bool more = !data.queue.empty() || (data.sendQueue && !data.sendQueue->queue.empty());
+        data.onWriteScheduled = !data.isCorked && more;
+        if (data.onWriteScheduled) {
+            RunInThread([this, s] {
+                OnWrite(s);
+            });
+        }
+        if (data.sendQueue) {
+            MaybeUncork(*data.sendQueue, data.contact);
+        }
+    };
+
+    if (data.sendQueue && DropClosedMessages(*data.sendQueue)) {
+        // Take over buffers from the disk thread, encrypting them just before they're sent
+        Buffer* batch[MAX_IOVECS];
+        size_t count = 0;
+        while (data.queue.size() + count < MAX_IOVECS && data.sendQueue->queue.pop(batch[count])) {
+            // A marker with no close to answer, DisconnectHandled was called without a disconnect
+            assert(batch[count] != nullptr);
+            if (batch[count] != nullptr) {
+                data.sendQueue->queuedBytes -= batch[count]->readSize();
+                count++;
+            }
+        }
+        QueueEncryptedBatch(data, batch, count);
+    }
+
+    // Send as many queued buffers as fit in one syscall
+    IoVec vecs[MAX_IOVECS];
+    int count = 0;
+    size_t bytes = 0;
+    for (Buffer* buffer : data.queue) {
+        if (count == MAX_IOVECS || bytes >= MAX_BYTES_PER_SEND) {
+            break;
+        }
+        if (buffer->readSize() != 0) {
+            setIoVec(vecs[count++], buffer->readData(), buffer->readSize());
+            bytes += buffer->readSize();
+        }
+    }
+
+    size_t sent = 0;
+    if (count != 0) {
+        int res = sendv(s, vecs, count);
+        if (res < 0) {
+            if (isWouldBlock(res = socketError())) {
+                data.isCorked = true;
+                data.wasBacklogged = true;
+                RequestWriteEvent(s);
+                return;
+            }
+            log.e(L"Error writing to socket, error={}", errstr(res));
+            CloseSocket(s);
+            return;
+        }
+        sent = res;
+        data.sentBytes += sent;
+        data.queuedBytes -= sent;
+    }
+
+    // Free the buffers that were sent completely, and advance a partially sent one
+    while (!data.queue.empty()) {
+        Buffer* buffer = data.queue.front();
+        if (buffer->readSize() > sent) {
+            buffer->adjustReadPos(sent);
+            break;
+        }
+        sent -= buffer->readSize();
+        buffer->destroy();
+        data.queue.pop_front();
+    }
+}
+
+void SocketThread::OnSocketEvent(SOCKET sock, int event, int error) {
+    if (error) {
+        log.e(L"Socket error {}", errstr(error));
+        CloseSocket(sock);
+        return;
+    }
+    switch (event) {
+    case EV_ACCEPT: {
+        sockaddr addr = { 0 };
+        socklen_t addrlen = sizeof(addr);
+        SOCKET clientSock = accept(sock, &addr, &addrlen);
+        SocketData& data = socketData_[clientSock];
+        data.sock = clientSock;
+        data.auth.mode = AuthData::Mode::Server;
+        data.auth.serverState = AuthData::ServerState::ExpectingClientHello;
+        WatchSocket(clientSock, EV_READ | EV_WRITE | EV_CLOSE);
+        break;
+    }
+    case EV_CONNECT:
+        OnConnect(sock);
+        break;
+    case EV_READ:
+        OnRead(sock);
+        break;
+    case EV_WRITE:
+        OnWrite(sock);
+        break;
+    case EV_CLOSE: {
+        auto it = socketData_.find(sock);
+        if (it != socketData_.end() && it->second.readPaused) {
+            // What the contact sent before closing is still to be read, once reading resumes.
+            // A reset comes with an error instead, and closes the socket above.
+            WatchSocket(sock, EV_WRITE);
+            break;
+        }
+        OnRead(sock);
+        // Remote side closed, we do nothing, since after reading EOF, we'll close the socket
+        break;
+    }
+    }
+}
+
+void SocketThread::OnTimer(uintptr_t id) {
+    if (id != RATE_TIMER_ID) {
+        return;
+    }
+    // Resize each connection's send queue to the measured bandwidth-delay product
+    for (auto& p : socketData_) {
+        SocketData& data = p.second;
+        if (!data.sendQueue) {
+            continue;
+        }
+        double rate = data.sentBytes * 1000.0 / RATE_INTERVAL_MS;
+        if (data.wasBacklogged) {
+            // The link was the bottleneck, so this is its actual throughput
+            data.sendRate = data.sendRate == 0 ? rate : 0.75 * data.sendRate + 0.25 * rate;
+        } else {
+            // We didn't send as fast as the link allows, which tells nothing about it
+            data.sendRate = std::max(data.sendRate, rate);
+        }
+        data.sentBytes = 0;
+        data.wasBacklogged = false;
+
+        uint32_t rttUs = socketRttUs(data.sock);
+        if (rttUs == 0) {
+            rttUs = data.handshakeRttUs;
+        }
+        if (data.sendRate == 0 || rttUs == 0) {
+            continue;
+        }
+        double bdp = data.sendRate * (rttUs + PRODUCER_LATENCY_US) / 1e6;
+        size_t watermark = (size_t)(2 * bdp) + data.sendQueue->maxBufferSize;
+        data.sendQueue->highWatermark = std::min<size_t>(MAX_WATERMARK, std::max<size_t>(MIN_WATERMARK, watermark));
+    }
+}
+
+void SocketThread::OnConnect(SOCKET s) {
+    if (socketData_.find(s) == socketData_.end()) {
+        return;
+    }
+    SocketData& data = socketData_[s];
+    data.isCorked = false;
+
+    assert(data.auth.mode == AuthData::Mode::Client);
+    assert(data.auth.clientState == AuthData::ClientState::Uninitialized);
+    SendClientHelloMessage(data);
+}
+
+void SocketThread::handleIncomingMessage(SocketData& data, const uint8_t* buf, size_t size) {
+    // Only handshake messages get here, they're small so copy them out of the receive buffer
+    Buffer::UniquePtr message(Buffer::create(size));
+    memcpy(message->writeData(), buf, size);
+    message->adjustWritePos(size);
+
+    if (data.auth.mode == AuthData::Mode::Client) {
+        if (data.auth.clientState == AuthData::ClientState::ExpectingServerHelloFinished) {
+            ClientRecvServerHelloFinishedMessage(data, std::move(message));
+        } else if (data.auth.clientState == AuthData::ClientState::Error) {
+            log.e(L"Client: Received message in error state");
+            CloseSocket(data.sock);
+        } else if (data.auth.clientState == AuthData::ClientState::Uninitialized) {
+            log.e(L"Client: Received message in uninitialized state");
+            CloseSocket(data.sock);
+        } else {
+            log.e(L"Client: Bad state");
+            CloseSocket(data.sock);
+        }
+    } else {
+        if (data.auth.serverState == AuthData::ServerState::ExpectingClientHello) {
+            ServerRecvClientHelloMessage(data, std::move(message));
+        } else if (data.auth.serverState == AuthData::ServerState::ExpectingClientFinished) {
+            ServerRecvClientFinishedMessage(data, std::move(message));
+        } else if (data.auth.serverState == AuthData::ServerState::Error) {
+            log.e(L"Server: Received message in error state");
+            CloseSocket(data.sock);
+        } else if (data.auth.serverState == AuthData::ServerState::Uninitialized) {
+            log.e(L"Server: Received message in uninitialized state");
+            CloseSocket(data.sock);
+        } else {
+            log.e(L"Server: Bad state");
+            CloseSocket(data.sock);
+        }
+    }
+}
+
+void SocketThread::SendClientHelloMessage(SocketData& data) {
+    AuthData& auth = data.auth;
+
+    auth.transcriptHash.update(std::string(32, ' '));
+
+    auth.myRandom = getRandom(32);
+    auth.txnonce = getRandom(NONCE_BYTES);
+    auth.offeredCiphers = supportedCiphers();
+    auto it = clientTickets_.find(data.contact.pubkey);
+    if (it != clientTickets_.end()) {
+        if (it->second.expires > std::chrono::steady_clock::now()) {
+            auth.offeredTicket = it->second.id;
+            auth.ticketSecret = it->second.secret;
+        }
+        clientTickets_.erase(it);
+    }
+    // Needed even when resuming, in case the server doesn't accept the ticket
+    auth.myKeyShare.resize(crypto_kx_PUBLICKEYBYTES);
+    auth.myKeySharePriv.resize(crypto_kx_SECRETKEYBYTES);
+    crypto_kx_keypair((unsigned char*)auth.myKeyShare.data(), (unsigned char*)auth.myKeySharePriv.data());
+
+    auth.clientState = AuthData::ClientState::ExpectingServerHelloFinished;
+    data.handshakeStart = std::chrono::steady_clock::now();
+
+    ClientHelloMessage msg;
+    msg.random = auth.myRandom;
+    msg.kexKeyShare = auth.myKeyShare;
+    msg.nonce = auth.txnonce;
+    msg.maxMessageSize = MAX_MESSAGE_SIZE;
+    msg.ciphers = auth.offeredCiphers;
+    msg.ticket = auth.offeredTicket;
+    msg.features = features_;
+
+    auth.transcriptHash.update(msg.random);
+    auth.transcriptHash.update(msg.kexKeyShare);
+    auth.transcriptHash.update(msg.nonce);
+    // The offer is added to the transcript once we know whether the server negotiates
+    if (!msg.ticket.empty()) {
+        GenericHash binderHash = auth.transcriptHash;
+        binderHash.update(encodeClientOffer(msg.ciphers, msg.maxMessageSize, msg.features, msg.ticket));
+        msg.binder = keyedHash(auth.ticketSecret, "binder", binderHash.result());
+    }
+
+    Buffer::UniquePtr buf = Serializer().serialize(msg);
+    SendBuffer(data, std::move(buf));
+}
+
+void SocketThread::ServerRecvClientHelloMessage(SocketData& data, Buffer::UniquePtr message) {
+    AuthData& auth = data.auth;
+    std::string binder, offer;
+    {
+        ClientHelloMessage msg;
+        if (!Serializer().deserialize(msg, message.get()) ||
+            msg.random.size() != 32 ||
+            msg.kexKeyShare.size() != crypto_kx_PUBLICKEYBYTES ||
+            msg.nonce.size() != NONCE_BYTES) {
+            CloseSocket(data.sock);
+            return;
+        }
+        auth.peerRandom = msg.random;
+        auth.peerKeyShare = msg.kexKeyShare;
+        auth.rxnonce = msg.nonce;
+        auth.offeredCiphers = msg.ciphers;
+        auth.offeredTicket = msg.ticket;
+        binder = msg.binder;
+        if (!msg.ciphers.empty()) {
+            offer = encodeClientOffer(msg.ciphers, msg.maxMessageSize, msg.features, msg.ticket);
+        }
+        data.peerFeatures = msg.features;
+        data.maxMessageSize = negotiateMessageSize(msg.maxMessageSize);
+    }
+
+    // Pick the client's most preferred cipher we support
+    std::string ourCiphers = supportedCiphers();
+    for (char c : auth.offeredCiphers) {
+        if (ourCiphers.find(c) != std::string::npos) {
+            auth.cipher = (uint8_t)c;
+            break;
+        }
+    }
+
+    auth.transcriptHash.update(std::string(32, ' '));
+    auth.transcriptHash.update(auth.peerRandom);
+    auth.transcriptHash.update(auth.peerKeyShare);
+    auth.transcriptHash.update(auth.rxnonce);
+    // Empty for older clients, whose transcript doesn't have it
+    auth.transcriptHash.update(offer);
+
+    if (!auth.offeredTicket.empty() && ServerResumeSession(data, binder)) {
+        return;
+    }
+
+    auth.myRandom = getRandom(32);
+    if (auth.offeredCiphers.empty()) {
+        auth.myRandom.replace(auth.myRandom.size() - LEGACY_CLIENT_MARK_SIZE, LEGACY_CLIENT_MARK_SIZE,
+            LEGACY_CLIENT_MARK);
+    }
+    auth.myKeyShare.resize(crypto_kx_PUBLICKEYBYTES);
+    auth.myKeySharePriv.resize(crypto_kx_SECRETKEYBYTES);
+    crypto_kx_keypair((unsigned char*)auth.myKeyShare.data(), (unsigned char*)auth.myKeySharePriv.data());
+
+    auth.rxkey.resize(crypto_kx_SESSIONKEYBYTES);
+    auth.txkey.resize(crypto_kx_SESSIONKEYBYTES);
+
+    if (crypto_kx_server_session_keys((unsigned char*)auth.rxkey.data(), (unsigned char*)auth.txkey.data(),
+        (unsigned char*)auth.myKeyShare.data(), (unsigned char*)auth.myKeySharePriv.data(),
+        (unsigned char*)auth.peerKeyShare.data()) != 0) {
+        // Suspicious client key
+        CloseSocket(data.sock);
+        return;
+    }
+
+    auth.serverState = AuthData::ServerState::ExpectingClientFinished;
+
+    std::string txnonce = getRandom(NONCE_BYTES);
+    auth.txnonce = txnonce;
+    // Older clients don't offer ciphers and don't expect one in the reply
+    uint8_t replyCipher = auth.offeredCiphers.empty() ? 0 : auth.cipher;
+
+    auth.transcriptHash.update(auth.myRandom);
+    auth.transcriptHash.update(auth.myKeyShare);
+    auth.transcriptHash.update(auth.txnonce);
+    if (replyCipher) {
+        auth.transcriptHash.update(encodeServerChoice(replyCipher, MAX_MESSAGE_SIZE, features_));
+    }
+    auth.transcriptHash.update(myPubkey_);
+
+    SignatureMessage sigmsg;
+    sigmsg.pubkey = myPubkey_;
+    std::string hash = auth.transcriptHash.resultAndContinue();
+    sigmsg.signature.resize(crypto_sign_BYTES, '\0');
+    crypto_sign_detached((unsigned char*)sigmsg.signature.data(), NULL,
+        (const unsigned char*)hash.data(), hash.size(),
+        (const unsigned char*)myPrivkey_.data());
+    Buffer::UniquePtr serializedSigMsg = Serializer().serialize(sigmsg);
+    Buffer::UniquePtr encrypted = auth.encryptTx(std::move(serializedSigMsg));
+
+    ServerHelloFinishedMessage reply;
+    reply.random = auth.myRandom;
+    reply.kexKeyShare = auth.myKeyShare;
+    reply.nonce = txnonce;  // auth.txnonce has been incremented by encryptTx so don't use it here
+    reply.encryptedSignatureMessage = std::string((const char*)encrypted->readData(), encrypted->readSize());
+    reply.maxMessageSize = MAX_MESSAGE_SIZE;
+    reply.cipher = replyCipher;
+    reply.features = features_;
+    encrypted.reset();
+
+    Buffer::UniquePtr buf = Serializer().serialize(reply);
+    SendBuffer(data, std::move(buf));
+    data.handshakeStart = std::chrono::steady_clock::now();
+}
+
+void SocketThread::ClientRecvServerHelloFinishedMessage(SocketData& data, Buffer::UniquePtr message) {
+    AuthData& auth = data.auth;
+    ServerHelloFinishedMessage msg;
+
+    if (!Serializer().deserialize(msg, message.get()) ||
+        msg.random.size() != 32 ||
+        (!msg.resumed && msg.kexKeyShare.size() != crypto_kx_PUBLICKEYBYTES) ||
+        msg.nonce.size() != NONCE_BYTES ||
+        msg.encryptedSignatureMessage.size() > 2000 ||
+        (msg.cipher != 0 && auth.offeredCiphers.find((char)msg.cipher) == std::string::npos)) {
+        CloseSocket(data.sock);
+        log.d(L"Client: Bad ServerHelloFinished");
+        return;
+    }
+    if (msg.cipher == 0 && hasLegacyClientMark(msg.random)) {
+        log.e(L"Client: Server didn't get our offer, the handshake was tampered with");
+        CloseSocket(data.sock);
+        return;
+    }
+    data.handshakeRttUs = (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - data.handshakeStart).count();
+    // An older server doesn't choose and uses the default cipher
+    if (msg.cipher != 0) {
+        auth.cipher = msg.cipher;
+    }
+    auth.peerRandom = msg.random;
+    auth.peerKeyShare = msg.kexKeyShare;
+    auth.rxnonce = msg.nonce;
+    data.maxMessageSize = negotiateMessageSize(msg.maxMessageSize);
+    data.peerFeatures = msg.features;
+
+    if (msg.resumed) {
+        ClientResumeSession(data, msg);
+        return;
+    }
+
+    auth.rxkey.resize(crypto_kx_SESSIONKEYBYTES);
+    auth.txkey.resize(crypto_kx_SESSIONKEYBYTES);
+
+    if (crypto_kx_client_session_keys((unsigned char*)auth.rxkey.data(), (unsigned char*)auth.txkey.data(),
+        (unsigned char*)auth.myKeyShare.data(), (unsigned char*)auth.myKeySharePriv.data(),
+        (unsigned char*)auth.peerKeyShare.data()) != 0) {
+        // Suspicious server key
+        CloseSocket(data.sock);
+        return;
+    }
+
+    // Only a server that negotiates adds the offer and its choice to its transcript. One that
+    // seems not to either predates negotiation, or has its reply stripped and won't agree on
+    // the transcript, or never got the offer and says so in its random.
+    if (msg.cipher != 0) {
+        auth.transcriptHash.update(encodeClientOffer(auth.offeredCiphers, MAX_MESSAGE_SIZE, features_,
+            auth.offeredTicket));
+    }
+    auth.transcriptHash.update(auth.peerRandom);
+    auth.transcriptHash.update(auth.peerKeyShare);
+    auth.transcriptHash.update(auth.rxnonce);
+    if (msg.cipher != 0) {
+        auth.transcriptHash.update(encodeServerChoice(msg.cipher, msg.maxMessageSize, msg.features));
+    }
+
+    {
+        Buffer::UniquePtr decrypted = auth.decryptRx((const uint8_t*)msg.encryptedSignatureMessage.data(),
+            msg.encryptedSignatureMessage.size());
+        if (!decrypted) {
+            log.d(L"Client: Error decrypting ServerHelloFinished");
+            CloseSocket(data.sock);
+            return;
+        }
+
+        SignatureMessage serversigmsg;
+        if (!Serializer().deserialize(serversigmsg, decrypted.get()) ||
+            serversigmsg.pubkey.size() != crypto_sign_PUBLICKEYBYTES ||
+            serversigmsg.signature.size() != crypto_sign_BYTES) {
+            log.d(L"Client: Wrong server pubkey or signature size");
+            CloseSocket(data.sock);
+            return;
+        }
+        auth.peerPubkey = serversigmsg.pubkey;
+        auth.transcriptHash.update(auth.peerPubkey);
+        std::string hash = auth.transcriptHash.resultAndContinue();
+        if (crypto_sign_verify_detached((const unsigned char*)serversigmsg.signature.data(),
+            (const unsigned char*)hash.data(), hash.size(),
+            (const unsigned char*)auth.peerPubkey.data()) != 0) {
+            log.e(L"Couldn't authenticate server");
+            CloseSocket(data.sock);
+            return;
+        }
+    }
+
+    if (auth.peerPubkey != data.contact.pubkey) {
+        log.e(L"Mismatched peer key, disconnecitng. Excepting: {}, actual: {}",
+            keyToDisplayStr(data.contact.pubkey), keyToDisplayStr(auth.peerPubkey));
+        CloseSocket(data.sock);
+        return;
+    }
+
+    auth.transcriptHash.update(myPubkey_);
+
+    {
+        std::string hash = auth.transcriptHash.result();
+        auth.handshakeHash = hash;
+        SignatureMessage clientsigmsg;
+        clientsigmsg.pubkey = myPubkey_;
+        clientsigmsg.signature.resize(crypto_sign_BYTES, '\0');
+        crypto_sign_detached((unsigned char*)clientsigmsg.signature.data(), NULL,
+            (const unsigned char*)hash.data(), hash.size(),
+            (const unsigned char*)myPrivkey_.data());
+        Buffer::UniquePtr serializedSigMsg = Serializer().serialize(clientsigmsg);
+        Buffer::UniquePtr encrypted = auth.encryptTx(std::move(serializedSigMsg));
+
+        ClientFinishedMessage reply;
+        reply.encryptedSignatureMessage = std::string((const char*)encrypted->readData(), encrypted->readSize());
+        encrypted.reset();
+
+        Buffer::UniquePtr buf = Serializer().serialize(reply);
+        SendBuffer(data, std::move(buf));
+    }
+
+    CompleteHandshake(data);
+}
+
+void SocketThread::ServerRecvClientFinishedMessage(SocketData& data, Buffer::UniquePtr message) {
+    AuthData& auth = data.auth;
+    ClientFinishedMessage msg;
+
+    if (!Serializer().deserialize(msg, message.get()) || msg.encryptedSignatureMessage.size() > 2000) {
+        CloseSocket(data.sock);
+        log.d(L"Server:Bad ClientFinished");
+        return;
+    }
+    data.handshakeRttUs = (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - data.handshakeStart).count();
+
+    Buffer::UniquePtr decrypted = auth.decryptRx((const uint8_t*)msg.encryptedSignatureMessage.data(),
+        msg.encryptedSignatureMessage.size());
+    if (!decrypted) {
+        log.d(L"Server: Error decrypting ClientFinished");
+        CloseSocket(data.sock);
+        return;
+    }
+
+    SignatureMessage sigmsg;
+    if (!Serializer().deserialize(sigmsg, decrypted.get()) ||
+        sigmsg.pubkey.size() != crypto_sign_PUBLICKEYBYTES ||
+        sigmsg.signature.size() != crypto_sign_BYTES) {
+        log.d(L"Server: Wrong client pubkey or signature size");
+        CloseSocket(data.sock);
+        return;
+    }
+    auth.peerPubkey = sigmsg.pubkey;
+    auth.transcriptHash.update(auth.peerPubkey);
+    std::string hash = auth.transcriptHash.result();
+    auth.handshakeHash = hash;
+    if (crypto_sign_verify_detached((const unsigned char*)sigmsg.signature.data(),
+        (const unsigned char*)hash.data(), hash.size(),
+        (const unsigned char*)auth.peerPubkey.data()) != 0) {
+        log.e(L"Couldn't authenticate client");
+        CloseSocket(data.sock);
+        return;
+    }
+
+    
+    if (!isKnownContact_(auth.peerPubkey)) {
+        CloseSocket(data.sock);
+        return;
+    }
+
+    CompleteHandshake(data);
+}
+
+bool SocketThread::ServerResumeSession(SocketData& data, const std::string& binder) {
+    AuthData& auth = data.auth;
+    auto it = serverTickets_.find(auth.offeredTicket);
+    if (it == serverTickets_.end()) {
+        log.d(L"Server: Unknown ticket, doing a full handshake");
+        return false;
+    }
+    ResumptionTicket ticket = std::move(it->second);
+    serverTickets_.erase(it);
+
+    std::string expectedBinder = keyedHash(ticket.secret, "binder", auth.transcriptHash.resultAndContinue());
+    if (ticket.expires < std::chrono::steady_clock::now() ||
+        auth.offeredCiphers.empty() ||
+        binder.size() != expectedBinder.size() ||
+        sodium_memcmp(binder.data(), expectedBinder.data(), binder.size()) != 0 ||
+        !isKnownContact_(ticket.peerPubkey)) {
+        log.d(L"Server: Rejected ticket, doing a full handshake");
+        return false;
+    }
+
+    auth.myRandom = getRandom(32);
+    std::string txnonce = getRandom(NONCE_BYTES);
+    auth.txnonce = txnonce;
+    std::string randoms = auth.peerRandom + auth.myRandom;
+    auth.rxkey = keyedHash(ticket.secret, "client key", randoms);
+    auth.txkey = keyedHash(ticket.secret, "server key", randoms);
+    auth.peerPubkey = ticket.peerPubkey;
+
+    auth.transcriptHash.update(auth.myRandom);
+    auth.transcriptHash.update(auth.txnonce);
+    auth.transcriptHash.update(encodeServerChoice(auth.cipher, MAX_MESSAGE_SIZE, features_));
+    auth.handshakeHash = auth.transcriptHash.result();
+
+    // Proves we know the ticket's secret
+    Buffer::UniquePtr finished(Buffer::create(auth.handshakeHash.size()));
+    memcpy(finished->writeData(), auth.handshakeHash.data(), auth.handshakeHash.size());
+    finished->adjustWritePos(auth.handshakeHash.size());
+    Buffer::UniquePtr encrypted = auth.encryptTx(std::move(finished));
+
+    ServerHelloFinishedMessage reply;
+    reply.random = auth.myRandom;
+    reply.nonce = txnonce;
+    reply.encryptedSignatureMessage = std::string((const char*)encrypted->readData(), encrypted->readSize());
+    reply.maxMessageSize = MAX_MESSAGE_SIZE;
+    reply.cipher = auth.cipher;
+    reply.resumed = 1;
+    reply.features = features_;
+    encrypted.reset();
+
+    Buffer::UniquePtr buf = Serializer().serialize(reply);
+    SendBuffer(data, std::move(buf));
+
+    CompleteHandshake(data);
+    return true;
+}
+
+void SocketThread::ClientResumeSession(SocketData& data, const ServerHelloFinishedMessage& msg) {
+    AuthData& auth = data.auth;
+    if (auth.offeredTicket.empty() || msg.cipher == 0) {
+        log.d(L"Client: Unexpected resumed ServerHelloFinished");
+        CloseSocket(data.sock);
+        return;
+    }
+
+    auth.transcriptHash.update(encodeClientOffer(auth.offeredCiphers, MAX_MESSAGE_SIZE, features_, auth.offeredTicket));
+    auth.transcriptHash.update(auth.peerRandom);
+    auth.transcriptHash.update(auth.rxnonce);
+    auth.transcriptHash.update(encodeServerChoice(msg.cipher, msg.maxMessageSize, msg.features));
+    auth.handshakeHash = auth.transcriptHash.result();
+
+    std::string randoms = auth.myRandom + auth.peerRandom;
+    auth.txkey = keyedHash(auth.ticketSecret, "client key", randoms);
+    auth.rxkey = keyedHash(auth.ticketSecret, "server key", randoms);
+
+    Buffer::UniquePtr decrypted = auth.decryptRx((const uint8_t*)msg.encryptedSignatureMessage.data(),
+        msg.encryptedSignatureMessage.size());
+    if (!decrypted || decrypted->readSize() != auth.handshakeHash.size() ||
+        sodium_memcmp(decrypted->readData(), auth.handshakeHash.data(), auth.handshakeHash.size()) != 0) {
+        log.e(L"Couldn't authenticate server");
+        CloseSocket(data.sock);
+        return;
+    }
+    auth.peerPubkey = data.contact.pubkey;
+
+    CompleteHandshake(data);
+}
+
+void SocketThread::CompleteHandshake(SocketData& data) {
+    AuthData& auth = data.auth;
+    if (auth.mode == AuthData::Mode::Client) {
+        auth.clientState = AuthData::ClientState::Complete;
+    } else {
+        data.contact.pubkey = auth.peerPubkey;
+        contactData_[data.contact] = data.sock;
+        auth.serverState = AuthData::ServerState::Complete;
+    }
+    StoreResumptionTicket(data);
+
+    data.sendQueue = GetSendQueue(data.contact);
+    data.sendQueue->maxBufferSize = maxBufferSizeFor(data.maxMessageSize);
+    data.sendQueue->features = features_ & data.peerFeatures;
+    data.receiveBudget = GetReceiveBudget(data.contact);
+    ScheduleWrite(data);
+
+    if (onConnectCb_) {
+        onConnectCb_(data.contact, true);
+    }
+
+    if (auth.mode == AuthData::Mode::Client && queueEmptyCb_) {
+        queueEmptyCb_(data.contact);
+    }
+}
+
+void SocketThread::StoreResumptionTicket(SocketData& data) {
+    AuthData& auth = data.auth;
+    const std::string& clientKey = auth.mode == AuthData::Mode::Client ? auth.txkey : auth.rxkey;
+    const std::string& serverKey = auth.mode == AuthData::Mode::Client ? auth.rxkey : auth.txkey;
+
+    ResumptionTicket ticket;
+    ticket.secret = keyedHash(clientKey + serverKey, "resumption", auth.handshakeHash);
+    ticket.id = keyedHash(ticket.secret, "ticket id", std::string());
+    ticket.peerPubkey = auth.peerPubkey;
+    ticket.expires = std::chrono::steady_clock::now() + std::chrono::seconds(ResumptionTicket::LIFETIME_SECONDS);
+
+    // Both sides keep the ticket in both roles, whoever connects next uses it
+    auto it = clientTickets_.find(ticket.peerPubkey);
+    if (it != clientTickets_.end()) {
+        serverTickets_.erase(it->second.id);
+    }
+    if (serverTickets_.size() >= ResumptionTicket::MAX_TICKETS) {
+        auto now = std::chrono::steady_clock::now();
+        for (auto st = serverTickets_.begin(); st != serverTickets_.end(); ) {
+            st = st->second.expires < now ? serverTickets_.erase(st) : std::next(st);
+        }
+        if (serverTickets_.size() >= ResumptionTicket::MAX_TICKETS) {
+            serverTickets_.erase(serverTickets_.begin());
+        }
+    }
+    clientTickets_[ticket.peerPubkey] = ticket;
+    serverTickets_[ticket.id] = std::move(ticket);
+}
+
+std::string AuthData::nextTxNonce() {
+    std::string nonce = txnonce;
+    sodium_increment((unsigned char*)txnonce.data(), txnonce.size());
+    return nonce;
+}
+
+std::string AuthData::nextRxNonce() {
+    std::string nonce = rxnonce;
+    sodium_increment((unsigned char*)rxnonce.data(), rxnonce.size());
+    return nonce;
+}
+
+Buffer::UniquePtr AuthData::encryptTx(Buffer::UniquePtr buffer) {
+    encrypt(buffer.get(), nextTxNonce());
+    return buffer;
+}
+
+Buffer::UniquePtr AuthData::decryptRx(const uint8_t* data, size_t size) {
+    return decrypt(data, size, nextRxNonce());
+}
+
+void AuthData::encrypt(Buffer* buffer, const std::string& nonce) const {
+    uint8_t* data = buffer->readData();
+    size_t size = buffer->readSize();
+    uint8_t* tag = buffer->appendTrailer(TAG_BYTES);
+    if (cipher == CIPHER_AES256_GCM) {
+        crypto_aead_aes256gcm_encrypt_detached(data, tag, NULL, data, size,
+            NULL, 0, NULL,
+            (const unsigned char*)nonce.data(), (const unsigned char*)txkey.data());
+    } else {
+        crypto_aead_chacha20poly1305_ietf_encrypt_detached(data, tag, NULL, data, size,
+            NULL, 0, NULL,
+            (const unsigned char*)nonce.data(), (const unsigned char*)txkey.data());
+    }
+}
+
+Buffer::UniquePtr AuthData::decrypt(const uint8_t* data, size_t size, const std::string& nonce) const {
+    if (size < TAG_BYTES) {
+        return Buffer::UniquePtr();
+    }
+    size_t mlen = size - TAG_BYTES;
+    Buffer::UniquePtr decrypted(Buffer::create(mlen));
+    bool forged;
+    if (cipher == CIPHER_AES256_GCM) {
+        forged = crypto_aead_aes256gcm_decrypt_detached(decrypted->writeData(), NULL,
+            data, mlen, data + mlen, NULL, 0,
+            (const unsigned char*)nonce.data(), (const unsigned char*)rxkey.data()) != 0;
+    } else {
+        forged = crypto_aead_chacha20poly1305_ietf_decrypt_detached(decrypted->writeData(), NULL,
+            data, mlen, data + mlen, NULL, 0,
+            (const unsigned char*)nonce.data(), (const unsigned char*)rxkey.data()) != 0;
+    }
+    if (forged) {
+        return Buffer::UniquePtr();
+    }
+    decrypted->adjustWritePos(mlen);
+    return decrypted;
+}
@@ -1,44 +1,62 @@
-#pragma once
-
-#include <string>
-#include <functional>
-#include "lib/Buffer.h"
-#include "Logger.h"
-
-class SocketThread;
-
-struct Contact {
-    std::string pubkey;
-};
-
-namespace std {
-
-template<> struct hash<Contact> {
-    typedef Contact argument_type;
-    typedef std::size_t result_type;
-    result_type operator()(const argument_type& c) const noexcept {
-        return std::hash<std::string>()(c.pubkey);
-    }
-};
-
-}
-
-inline bool operator ==(const Contact& c1, const Contact& c2) {
-    return c1.pubkey == c2.pubkey;
-}
-
-class SocketThreadApi {
-public:
-    void Init(Logger* logger, const std::string& myPubkey, const std::string& myPrivKey);
-    ~SocketThreadApi();
-    void setQueueEmptyCb(std::function<void(const Contact& c)> queueEmptyCb);
-    void setOnMessageCb(std::function<void(const Contact& c, Buffer::UniquePtr message)> onMessageCb);
-    void setOnConnectCb(std::function<void(const Contact& c, bool connected)> cb);
-    void setIsKnownContact(std::function<bool(const std::string& pubkey)> cb);
-    void Connect(const Contact& c, const std::string& hostname, uint16_t port);
-    void Disconnect(const Contact& c);
-    // Return true if should cork (this buffer is still enqueued)
-    bool SendBuffer(const Contact& c, Buffer* buffer);
-private:
-    SocketThread* d = nullptr;
-};
+#pragma once
+
+#include <string>
+#include <functional>
+#include "lib/Buffer.h"
+#include "Logger.h"
+
+class SocketThread;
+
+struct Contact {
+    std::string pubkey;
+};
+
+namespace std {
+
+template<> struct hash<Contact> {
+    typedef Contact argument_type;
+    typedef std::size_t result_type;
+    result_type operator()(const argument_type& c) const noexcept {
+        return std::hash<std::string>()(c.pubkey);
+    }
+};
+
+}
+
+inline bool operator ==(const Contact& c1, const Contact& c2) {
+    return c1.pubkey == c2.pubkey;
+}
+
+class SocketThreadApi {
+public:
+    void Init(Logger* logger, const std::string& myPubkey, const std::string& myPrivKey);
+    ~SocketThreadApi();
+    void setQueueEmptyCb(std::function<void(const Contact& c)> queueEmptyCb);
+    void setOnMessageCb(std::function<void(const Contact& c, Buffer::UniquePtr message)> onMessageCb);
+    void setOnConnectCb(std::function<void(const Contact& c, bool connected)> cb);
+    void setIsKnownContact(std::function<bool(const std::string& pubkey)> cb);
+    void Connect(const Contact& c, const std::string& hostname, uint16_t port);
+    void Disconnect(const Contact& c);
+    // Doesn't block. Must only be called from one thread (the disk thread).
+    // Return true if should cork (this buffer is still enqueued) until queueEmptyCb is called
+    bool SendBuffer(const Contact& c, Buffer* buffer);
+    // Largest buffer SendBuffer accepts for the contact, as negotiated when connecting
+    size_t GetMaxBufferSize(const Contact& c);
+    // Memory held by the contact's send queue
+    size_t GetQueuedBytes(const Contact& c);
+    // Features advertised to peers when connecting. Must be called before connecting.
+    void setFeatures(uint32_t features);
+    // Features both we and the contact support, 0 until connected
+    uint32_t GetFeatures(const Contact& c);
+    // Must be called, from any thread, when done with each message passed to the message
+    // callback, with its size then. Reading from a contact pauses while too much is pending, and
+    // resumes once less than 8 MiB is: messages held back waiting for others must stay below that.
+    void MessageHandled(const Contact& c, size_t size);
+    // Must be called from the thread that sends, once it has handled the contact disconnecting,
+    // exactly once for each disconnect the connect callback reports. What it sent to the contact
+    // until then is dropped, it was meant for the closed connection. Until the call, what it sends
+    // next is dropped too; a call without a disconnect is a bug.
+    void DisconnectHandled(const Contact& c);
+private:
+    SocketThread* d = nullptr;
+};
@@ -0,0 +1,132 @@
+#include "TreeWalker.h"
+#include "lib/win/raii.h"
+#include <windows.h>
+
+TreeWalker::TreeWalker(Logger* logger)
+    : log(*logger)
+{
+    for (unsigned i = 0; i < WALK_THREADS; i++) {
+        threads_.emplace_back([this] { WorkerLoop(); });
+    }
+}
+
+TreeWalker::~TreeWalker() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    cv_.notify_all();
+    for (std::thread& t : threads_) {
+        t.join();
+    }
+}
+
+void TreeWalker::Walk(const std::wstring& root, const std::vector<std::wstring>& names, Callback cb) {
+    if (names.empty()) {
+        cb({}, true);
+        return;
+    }
+    auto walk = std::make_shared<WalkState>();
+    walk->root = root;
+    walk->cb = std::move(cb);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        walk->pending = names.size();
+        for (const std::wstring& name : names) {
+            queue_.push_back(WorkItem{walk, name, false});
+        }
+    }
+    cv_.notify_all();
+}
+
+void TreeWalker::WorkerLoop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        cv_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+        if (stop_) {
+            return;
+        }
+        WorkItem item = std::move(queue_.front());
+        queue_.pop_front();
+        lock.unlock();
+
+        std::vector<Entry> files;
+        std::vector<std::wstring> dirs;
+        Visit(*item.walk, item.name, item.isDir, files, dirs);
+
+        lock.lock();
+        for (std::wstring& dir : dirs) {
+            queue_.push_back(WorkItem{item.walk, std::move(dir), true});
+        }
+        if (!dirs.empty()) {
+            cv_.notify_all();
+        }
+        item.walk->pending += dirs.size();
+        item.walk->pending--;
+        AddFiles(*item.walk, files, item.walk->pending == 0);
+    }
+}
+
+void TreeWalker::Visit(WalkState& walk, const std::wstring& name, bool isDir, std::vector<Entry>& files,
+    std::vector<std::wstring>& dirs) {
+    std::wstring path = name.empty() ? walk.root : walk.root + L"\\" + name;
+    if (!isDir) {
+        WIN32_FILE_ATTRIBUTE_DATA attr;
+        if (!GetFileAttributesEx(path.c_str(), GetFileExInfoStandard, &attr)) {
+            log.e(L"Can't get file attributes: {}", path);
+            return;
+        }
+        if (!(attr.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+            files.push_back(Entry{name, ((uint64_t)attr.nFileSizeHigh << 32) | attr.nFileSizeLow});
+            return;
+        }
+    }
+
+    WIN32_FIND_DATA ffd;
+    HANDLE hFind = FindFirstFile((path + L"\\*").c_str(), &ffd);
+    if (hFind == INVALID_HANDLE_VALUE) {
+        log.e(L"Error listing directory: {}", path);
+        return;
+    }
+    SCOPE_EXIT {
+        FindClose(hFind);
+    };
+    std::wstring prefix = name.empty() ? L"" : name + L"\\";
+    do {
+        if (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+            if (ffd.cFileName[0] == L'.' &&
+                (ffd.cFileName[1] == L'\0' || (ffd.cFileName[1] == L'.' && ffd.cFileName[2] == L'\0'))) {
+                continue;
+            }
+            dirs.push_back(prefix + ffd.cFileName);
+        } else {
+            files.push_back(Entry{prefix + ffd.cFileName, ((uint64_t)ffd.nFileSizeHigh << 32) | ffd.nFileSizeLow});
+            if (files.size() >= BATCH_FILES) {
+                // A huge directory doesn't hold everything back until it's listed. The walk
+                // isn't over, this name is still pending.
+                std::lock_guard<std::mutex> lock(mutex_);
+                AddFiles(walk, files, false);
+            }
+        }
+    } while (FindNextFile(hFind, &ffd) != 0);
+}
+
+void TreeWalker::AddFiles(WalkState& walk, std::vector<Entry>& files, bool last) {
+    if (walk.batch.empty()) {
+        walk.batch.swap(files);
+    } else {
+        walk.batch.insert(walk.batch.end(), std::make_move_iterator(files.begin()), std::make_move_iterator(files.end()));
+    }
+    files.clear();
+    if (!last && walk.batch.size() < (walk.delivered ? BATCH_FILES : 1)) {
+        return;
+    }
+    walk.delivered = true;
+    std::vector<Entry> batch;
+    batch.swap(walk.batch);
+    walk.cb(std::move(batch), last);
+    if (last) {
+        // The work items share the state, drop what the callback holds now
+        walk.cb = nullptr;
+    }
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "Logger.h"
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+
+// Lists the files under directories on several threads, and hands them over in batches as they
+// are found, with their sizes from the listing, so that sending starts before the walk ends.
+class TreeWalker {
+public:
+    struct Entry {
+        std::wstring name;      // relative to the root of the walk
+        uint64_t size;
+    };
+    // Called from the walker threads, one call at a time per walk and under the walker's lock, so
+    // it should only hand the files over. The last call has last set, and maybe no files.
+    using Callback = std::function<void(std::vector<Entry> files, bool last)>;
+
+    explicit TreeWalker(Logger* logger);
+    ~TreeWalker();
+
+    // Walks names, files or directories relative to root, "" for root itself. Entries that can't
+    // be read are logged and skipped.
+    void Walk(const std::wstring& root, const std::vector<std::wstring>& names, Callback cb);
+
+private:
+    enum { WALK_THREADS = 4 };
+    // Files handed over at once, except the first batch of a walk which goes as soon as it has
+    // any, so that sending starts right away
+    enum { BATCH_FILES = 1024 };
+    struct WalkState {
+        std::wstring root;
+        Callback cb;
+        // Names queued or being listed
+        size_t pending = 0;
+        std::vector<Entry> batch;
+        bool delivered = false;
+    };
+    struct WorkItem {
+        std::shared_ptr<WalkState> walk;
+        std::wstring name;
+        // Found in a listing, otherwise it may be a file
+        bool isDir;
+    };
+
+    void WorkerLoop();
+    // Adds the files of a directory or single file, and the subdirectories to dirs
+    void Visit(WalkState& walk, const std::wstring& name, bool isDir, std::vector<Entry>& files,
+        std::vector<std::wstring>& dirs);
+    // Takes files into the walk's batch and hands it over if it's big enough, or if last. Called
+    // with mutex_ held.
+    void AddFiles(WalkState& walk, std::vector<Entry>& files, bool last);
+
+    Logger& log;
+    std::vector<std::thread> threads_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<WorkItem> queue_;
+    bool stop_ = false;
+};
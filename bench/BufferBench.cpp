@@ -0,0 +1,118 @@
+// Compares Buffer::create and destroy from BufferPool with new and delete, as they were, for the
+// sizes the threads pass around: chunks read from disk and messages of the largest size. Each
+// buffer has a byte written in each page, as filling it would. Buffers are freed on the thread
+// that made them, and on another one, as SocketThread frees those DiskThread reads.
+//
+// Build and run on Linux, from the repository root:
+//   g++ -std=c++17 -O2 -Ilib -pthread -o BufferBench bench/BufferBench.cpp
+//   ./BufferBench [buffers count]
+//
+// glibc keeps large freed blocks for reuse too. The Windows heap hands blocks over 512 KB to
+// VirtualAlloc every time instead, to see what that costs here run it with
+// MALLOC_MMAP_THRESHOLD_=524288.
+
+#include "Buffer.h"
+#include "SpscQueue.h"
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <thread>
+
+namespace {
+
+enum { PAGE_SIZE = 4096 };
+// Buffers in flight between the threads, as DiskThread's reads ahead
+enum { DEPTH = 16 };
+const size_t SIZES[] = { 64 * 1024, 1024 * 1024 + 64 };
+
+struct HeapAlloc {
+    static void* create(size_t size) {
+        return new uint8_t[size];
+    }
+    static void destroy(void* p) {
+        delete[] (uint8_t*)p;
+    }
+};
+
+struct PoolAlloc {
+    static void* create(size_t size) {
+        return Buffer::create(size);
+    }
+    static void destroy(void* p) {
+        ((Buffer*)p)->destroy();
+    }
+};
+
+void Touch(void* p, size_t size) {
+    // Past the Buffer object, which create wrote already
+    for (size_t offset = PAGE_SIZE; offset < size; offset += PAGE_SIZE) {
+        ((volatile uint8_t*)p)[offset] = 1;
+    }
+}
+
+template <class Alloc>
+double SameThread(size_t size, size_t count) {
+    auto start = std::chrono::steady_clock::now();
+    void* held[DEPTH] = {};
+    for (size_t i = 0; i < count; i++) {
+        if (held[i % DEPTH] != nullptr) {
+            Alloc::destroy(held[i % DEPTH]);
+        }
+        held[i % DEPTH] = Alloc::create(size);
+        Touch(held[i % DEPTH], size);
+    }
+    for (void* p : held) {
+        if (p != nullptr) {
+            Alloc::destroy(p);
+        }
+    }
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+template <class Alloc>
+double CrossThread(size_t size, size_t count) {
+    SpscQueue<void*> queue(DEPTH);
+    auto start = std::chrono::steady_clock::now();
+    std::thread consumer([&queue, count] {
+        for (size_t i = 0; i < count; i++) {
+            void* p;
+            while (!queue.pop(p)) {
+                std::this_thread::yield();
+            }
+            Alloc::destroy(p);
+        }
+    });
+    for (size_t i = 0; i < count; i++) {
+        void* p = Alloc::create(size);
+        Touch(p, size);
+        while (!queue.push(p)) {
+            std::this_thread::yield();
+        }
+    }
+    consumer.join();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void Report(const char* name, size_t size, size_t count, double seconds) {
+    printf("%-26s %8zu KB %8.2f us/buffer %8.0f MB/s\n", name, size / 1024, seconds * 1e6 / count,
+        size * count / seconds / 1e6);
+}
+
+}
+
+int main(int argc, char** argv) {
+    size_t count = argc > 1 ? strtoull(argv[1], nullptr, 10) : 20000;
+
+    for (size_t size : SIZES) {
+        Report("new, same thread", size, count, SameThread<HeapAlloc>(size, count));
+        Report("pool, same thread", size, count, SameThread<PoolAlloc>(size, count));
+        Report("new, other thread frees", size, count, CrossThread<HeapAlloc>(size, count));
+        Report("pool, other thread frees", size, count, CrossThread<PoolAlloc>(size, count));
+    }
+
+    BufferPool::Stats stats = BufferPool::stats();
+    printf("pool: %llu allocated, %.1f%% reused, %llu freed by another thread, %.1f MB cached\n",
+        (unsigned long long)stats.allocations, stats.allocations == 0 ? 0.0 : 100.0 * stats.reused / stats.allocations,
+        (unsigned long long)stats.remoteFrees, stats.cachedBytes / 1e6);
+    return 0;
+}
@@ -0,0 +1,313 @@
+// Compares the FileIo backends on what the disk thread does: large files read and written in
+// chunks with several requests in flight, and many small files read and written whole. Then
+// receives files as the receive thread did and does: several at once, written in pieces the size
+// of a message, or gathered into large writes to preallocated files. Point it at a spinning disk
+// for that one, it's where interleaved small writes and fragmented files cost. Last, receives a
+// tree of tiny files with the steps the receive thread takes for each file sent on its own, and
+// for those sent together in a bundle.
+//
+// Build and run on Linux, from the repository root:
+//   g++ -std=c++17 -O2 -Ilib -DFMT_HEADER_ONLY -o FileIoBench bench/FileIoBench.cpp lib/posix/FileIo.cpp
+//   ./FileIoBench [dir] [large file MB] [small files count] [tree files count]
+//
+// Reads are mostly served from the page cache once the files have been written, drop it between
+// runs (echo 3 > /proc/sys/vm/drop_caches) to measure the disk. Received files are synced,
+// the time it takes is counted.
+
+#include "FileIo.h"
+#include "win/encoding.h"
+#include <algorithm>
+#include <chrono>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+enum { CHUNK = 1024 * 1024 };
+enum { SMALL_FILE_SIZE = 16 * 1024 };
+enum { DEPTH = 8 };
+enum { RECEIVE_STREAMS = 4 };
+enum { MESSAGE_SIZE = 64 * 1024 };
+enum { COALESCED_SIZE = 4 * 1024 * 1024 };
+enum { TREE_FILE_SIZE = 4 * 1024 };
+enum { TREE_DIRS = 100 };
+// Files of TREE_FILE_SIZE in a 1 MB message
+enum { BUNDLE_FILES = 240 };
+
+struct Result {
+    double seconds;
+    uint64_t bytes;
+    size_t errors;
+};
+
+// Buffers for DEPTH requests, in one block so that it can be registered at once
+struct Buffers {
+    Buffers(FileIo& io, bool registered)
+        : data(DEPTH * (size_t)CHUNK, 'x')
+    {
+        if (registered) {
+            io.registerMemory(&data[0], data.size());
+        }
+    }
+    char* get(size_t i) {
+        return &data[i * CHUNK];
+    }
+    std::string data;
+};
+
+// One file, DEPTH chunks in flight, each finished one starts the next
+Result LargeFile(FileIo& io, Buffers& buffers, const std::wstring& filename, uint64_t size, bool write) {
+    Result result = { 0, 0, 0 };
+    auto start = std::chrono::steady_clock::now();
+    FileIo::File file = io.open(filename, write ? FileIo::CREATE_WRITE : FileIo::OPEN_READ);
+    if (file == FileIo::INVALID_FILE) {
+        result.errors++;
+        return result;
+    }
+    uint64_t offset = 0;
+    std::function<void(size_t)> next = [&](size_t slot) {
+        if (offset >= size) {
+            return;
+        }
+        auto cb = [&, slot](int error, uint32_t count) {
+            if (error != 0 || count == 0) {
+                result.errors++;
+                return;
+            }
+            result.bytes += count;
+            next(slot);
+        };
+        if (write) {
+            io.write(file, offset, buffers.get(slot), CHUNK, cb);
+        } else {
+            io.read(file, offset, buffers.get(slot), CHUNK, cb);
+        }
+        offset += CHUNK;
+    };
+    for (size_t i = 0; i < DEPTH; i++) {
+        next(i);
+    }
+    while (io.inFlight() > 0) {
+        io.poll(true);
+    }
+    io.close(file);
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return result;
+}
+
+// DEPTH files in flight, each opened, read or written whole and closed
+Result SmallFiles(FileIo& io, Buffers& buffers, const std::wstring& dir, size_t files, bool write) {
+    Result result = { 0, 0, 0 };
+    auto start = std::chrono::steady_clock::now();
+    size_t started = 0;
+    std::function<void(size_t)> next = [&](size_t slot) {
+        if (started == files) {
+            return;
+        }
+        std::wstring filename = dir + L"/" + std::to_wstring(started++);
+        FileIo::File file = io.open(filename, write ? FileIo::CREATE_WRITE : FileIo::OPEN_READ);
+        if (file == FileIo::INVALID_FILE) {
+            result.errors++;
+            next(slot);
+            return;
+        }
+        auto cb = [&, slot, file](int error, uint32_t count) {
+            io.close(file);
+            if (error != 0 || count != SMALL_FILE_SIZE) {
+                result.errors++;
+            }
+            result.bytes += count;
+            next(slot);
+        };
+        if (write) {
+            io.write(file, 0, buffers.get(slot), SMALL_FILE_SIZE, cb);
+        } else {
+            io.read(file, 0, buffers.get(slot), SMALL_FILE_SIZE, cb);
+        }
+    };
+    for (size_t i = 0; i < DEPTH; i++) {
+        next(i);
+    }
+    while (io.inFlight() > 0) {
+        io.poll(true);
+    }
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return result;
+}
+
+// RECEIVE_STREAMS files of size each written at once, writeSize at a time from each in turn,
+// up to DEPTH writes in flight
+Result Receive(FileIo& io, const std::wstring& dir, uint64_t size, uint32_t writeSize, bool reserve) {
+    Result result = { 0, 0, 0 };
+    std::string data(writeSize, 'x');
+    auto start = std::chrono::steady_clock::now();
+    std::vector<FileIo::File> files;
+    for (size_t i = 0; i < RECEIVE_STREAMS; i++) {
+        FileIo::File file = io.open(dir + L"/" + std::to_wstring(i), FileIo::CREATE_WRITE);
+        if (file == FileIo::INVALID_FILE) {
+            result.errors++;
+            continue;
+        }
+        if (reserve) {
+            io.reserve(file, size);
+        }
+        files.push_back(file);
+    }
+    auto cb = [&](int error, uint32_t count) {
+        if (error != 0 || count != writeSize) {
+            result.errors++;
+        }
+        result.bytes += count;
+    };
+    for (uint64_t offset = 0; offset < size; offset += writeSize) {
+        for (FileIo::File file : files) {
+            while (io.inFlight() >= DEPTH) {
+                io.poll(true);
+            }
+            io.write(file, offset, &data[0], writeSize, cb);
+        }
+    }
+    while (io.inFlight() > 0) {
+        io.poll(true);
+    }
+    for (FileIo::File file : files) {
+        io.close(file);
+    }
+    if (system("sync") != 0) {
+        result.errors++;
+    }
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return result;
+}
+
+// The files written by Receive, read back one after the other
+Result ReadReceived(FileIo& io, Buffers& buffers, const std::wstring& dir, uint64_t size) {
+    Result result = { 0, 0, 0 };
+    for (size_t i = 0; i < RECEIVE_STREAMS; i++) {
+        Result r = LargeFile(io, buffers, dir + L"/" + std::to_wstring(i), size, false);
+        result.seconds += r.seconds;
+        result.bytes += r.bytes;
+        result.errors += r.errors;
+    }
+    return result;
+}
+
+// A tree of files of TREE_FILE_SIZE in TREE_DIRS directories. On their own: the directory made
+// for each file, a placeholder taking the final name, the data written to a .part file renamed
+// once done, up to DEPTH writes in flight. Bundled: directories made once, each file made under
+// its final name, the writes of BUNDLE_FILES submitted together.
+Result ReceiveTree(FileIo& io, const std::wstring& dir, size_t files, bool bundled) {
+    Result result = { 0, 0, 0 };
+    std::string data(TREE_FILE_SIZE, 'x');
+    std::vector<bool> madeDirs(TREE_DIRS);
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < files; i++) {
+        std::string subdir = Utf16ToUtf8(dir) + "/d" + std::to_string(i % TREE_DIRS);
+        std::string name = subdir + "/f" + std::to_string(i);
+        if (!bundled || !madeDirs[i % TREE_DIRS]) {
+            if (mkdir(subdir.c_str(), 0755) != 0 && errno != EEXIST) {
+                result.errors++;
+                continue;
+            }
+            madeDirs[i % TREE_DIRS] = true;
+        }
+        int placeholder = -1;
+        std::string target = name;
+        if (!bundled) {
+            placeholder = ::open(name.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+            if (placeholder < 0) {
+                result.errors++;
+                continue;
+            }
+            target += ".part";
+        }
+        FileIo::File file = io.open(Utf8ToUtf16(target), FileIo::CREATE_WRITE);
+        if (file == FileIo::INVALID_FILE) {
+            result.errors++;
+            continue;
+        }
+        io.write(file, 0, &data[0], TREE_FILE_SIZE, [&, file, name, target, placeholder](int error, uint32_t count) {
+            io.close(file);
+            if (error != 0 || count != TREE_FILE_SIZE) {
+                result.errors++;
+            }
+            result.bytes += count;
+            if (placeholder >= 0) {
+                // The placeholder is deleted on close on Windows, then the .part file is moved
+                ::close(placeholder);
+                if (unlink(name.c_str()) != 0 || rename(target.c_str(), name.c_str()) != 0) {
+                    result.errors++;
+                }
+            }
+        });
+        if (bundled ? (i + 1) % BUNDLE_FILES == 0 : io.inFlight() >= DEPTH) {
+            do {
+                io.poll(true);
+            } while (bundled && io.inFlight() > 0);
+        }
+    }
+    while (io.inFlight() > 0) {
+        io.poll(true);
+    }
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return result;
+}
+
+void Print(const char* backend, const char* test, const Result& r, size_t files) {
+    printf("%-22s %-12s %8.1f MB/s", backend, test, r.bytes / r.seconds / 1e6);
+    if (files > 0) {
+        printf(" %9.0f files/s", files / r.seconds);
+    }
+    printf(r.errors > 0 ? "  %zu errors\n" : "\n", r.errors);
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    std::string dir = argc > 1 ? argv[1] : ".";
+    uint64_t largeSize = (argc > 2 ? atoll(argv[2]) : 1024) * CHUNK;
+    size_t smallCount = argc > 3 ? atol(argv[3]) : 10000;
+    size_t treeCount = argc > 4 ? atol(argv[4]) : 100000;
+
+    struct Config {
+        FileIo::Backend backend;
+        bool registered;
+    };
+    const Config configs[] = { { FileIo::BLOCKING, false }, { FileIo::NATIVE, false }, { FileIo::NATIVE, true } };
+    int run = 0;
+    for (const Config& config : configs) {
+        std::unique_ptr<FileIo> io = FileIo::create(config.backend);
+        Buffers buffers(*io, config.registered);
+        std::string backend = std::string(io->name()) + (config.registered ? " registered" : "");
+
+        // Each run writes its own files, so that the written ones aren't overwritten
+        std::wstring runDir = Utf8ToUtf16(dir + "/FileIoBench" + std::to_string(run++));
+        std::string mkdir = "mkdir -p '" + Utf16ToUtf8(runDir) + "/small' '" + Utf16ToUtf8(runDir) + "/recv64K' '" +
+            Utf16ToUtf8(runDir) + "/recv4M' '" + Utf16ToUtf8(runDir) + "/tree' '" + Utf16ToUtf8(runDir) + "/bundled'";
+        if (system(mkdir.c_str()) != 0) {
+            return 1;
+        }
+        std::wstring large = runDir + L"/large";
+        Print(backend.c_str(), "large write", LargeFile(*io, buffers, large, largeSize, true), 0);
+        Print(backend.c_str(), "large read", LargeFile(*io, buffers, large, largeSize, false), 0);
+        Print(backend.c_str(), "small write", SmallFiles(*io, buffers, runDir + L"/small", smallCount, true), smallCount);
+        Print(backend.c_str(), "small read", SmallFiles(*io, buffers, runDir + L"/small", smallCount, false), smallCount);
+        // Each file a quarter of the large one, in whole coalesced writes
+        uint64_t receiveSize = std::max<uint64_t>(largeSize / RECEIVE_STREAMS / COALESCED_SIZE, 1) * COALESCED_SIZE;
+        Print(backend.c_str(), "recv 64K", Receive(*io, runDir + L"/recv64K", receiveSize, MESSAGE_SIZE, false), 0);
+        Print(backend.c_str(), "recv 64K read", ReadReceived(*io, buffers, runDir + L"/recv64K", receiveSize), 0);
+        Print(backend.c_str(), "recv 4M", Receive(*io, runDir + L"/recv4M", receiveSize, COALESCED_SIZE, true), 0);
+        Print(backend.c_str(), "recv 4M read", ReadReceived(*io, buffers, runDir + L"/recv4M", receiveSize), 0);
+        Print(backend.c_str(), "recv tree", ReceiveTree(*io, runDir + L"/tree", treeCount, false), treeCount);
+        Print(backend.c_str(), "recv bundled", ReceiveTree(*io, runDir + L"/bundled", treeCount, true), treeCount);
+        std::string rm = "rm -rf '" + Utf16ToUtf8(runDir) + "'";
+        (void)system(rm.c_str());
+    }
+    return 0;
+}
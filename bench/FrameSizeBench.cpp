@@ -0,0 +1,171 @@
+// Measures how fast data goes over loopback between two SocketThreads, for chunk sizes up to what
+// the negotiated message size allows: 64 KB within the legacy limit of 100000 bytes, up to 1 MB
+// with the size we offer. Each chunk is posted with SendBuffer as DiskThread does, then encrypted,
+// framed and sent by one socket thread, and read and decrypted by the other before its message
+// callback.
+//
+// Build and run on Linux, from the repository root:
+//   g++ -std=c++17 -O2 -I. -Ilib -DFMT_HEADER_ONLY -pthread -o FrameSizeBench bench/FrameSizeBench.cpp
+//       SocketThread.cpp lib/posix/EventLoop.cpp -lsodium
+//   ./FrameSizeBench [MB per run]
+//
+// The receiving side listens on port 8890, which must be free. The sending side can't listen
+// there too and logs it. Nothing reads from disk, so only the per-message costs differ between
+// the sizes.
+
+#include "SocketThread.h"
+#include "crypto.h"
+#include <arpa/inet.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+
+namespace {
+
+enum { PORT = 8890 };
+const size_t CHUNKS[] = { 16 * 1024, 64 * 1024, 256 * 1024, 1024 * 1024 };
+
+class StderrLogger : public Logger {
+protected:
+    bool shouldLog(LogLevel level) override {
+        return level <= W;
+    }
+    void logString(LogLevel level, const std::wstring& s) override {
+        fprintf(stderr, "%ls\n", s.c_str());
+    }
+};
+
+struct Peer {
+    std::string pubkey = std::string(crypto_sign_PUBLICKEYBYTES, '\0');
+    std::string privkey = std::string(crypto_sign_SECRETKEYBYTES, '\0');
+    SocketThreadApi socketThread;
+
+    Peer(Logger* logger) {
+        crypto_sign_keypair((unsigned char*)&pubkey[0], (unsigned char*)&privkey[0]);
+        socketThread.Init(logger, pubkey, privkey);
+        socketThread.setIsKnownContact([](const std::string&) { return true; });
+    }
+};
+
+// Until the receiving socket thread listens, so that the sending one doesn't get the port
+void WaitForListener() {
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(PORT);
+    for (int i = 0; i < 500; i++) {
+        int s = socket(AF_INET, SOCK_STREAM, 0);
+        bool listening = connect(s, (sockaddr*)&addr, sizeof(addr)) == 0;
+        close(s);
+        if (listening) {
+            return;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    fprintf(stderr, "Nothing listens on port %d\n", PORT);
+    exit(1);
+}
+
+// What the callbacks of both socket threads tell the main thread
+struct State {
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool connected = false;
+    bool uncorked = false;
+    size_t chunk = 0;
+    size_t received = 0;
+};
+
+template <class Pred>
+void Wait(State& state, Pred pred) {
+    std::unique_lock<std::mutex> lock(state.mutex);
+    if (!state.cv.wait_for(lock, std::chrono::seconds(60), pred)) {
+        fprintf(stderr, "Timed out\n");
+        exit(1);
+    }
+}
+
+double Run(State& state, Peer& sender, const Contact& receiver, size_t chunk, size_t total) {
+    size_t count = (total + chunk - 1) / chunk;
+    {
+        std::lock_guard<std::mutex> lock(state.mutex);
+        state.chunk = chunk;
+        state.received = 0;
+        state.uncorked = false;
+    }
+    auto start = std::chrono::steady_clock::now();
+    // Sends as DiskThread does, waiting for queueEmptyCb when corked
+    for (size_t i = 0; i < count; i++) {
+        Buffer* buffer = Buffer::create(chunk);
+        memset(buffer->writeData(), (int)(i & 0xff), chunk);
+        buffer->adjustWritePos(chunk);
+        if (sender.socketThread.SendBuffer(receiver, buffer)) {
+            Wait(state, [&] { return state.uncorked; });
+            std::lock_guard<std::mutex> lock(state.mutex);
+            state.uncorked = false;
+        }
+    }
+    Wait(state, [&] { return state.received == count; });
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return chunk * count / seconds / 1e6;
+}
+
+}
+
+int main(int argc, char** argv) {
+    size_t total = (argc > 1 ? strtoull(argv[1], nullptr, 10) : 512) * 1024 * 1024;
+    if (sodium_init() < 0) {
+        return 1;
+    }
+    StderrLogger logger;
+    State state;
+
+    Peer receiver(&logger);
+    receiver.socketThread.setOnMessageCb([&state, &receiver](const Contact& c, Buffer::UniquePtr message) {
+        std::lock_guard<std::mutex> lock(state.mutex);
+        uint8_t expected = (uint8_t)state.received;
+        if (message->readSize() != state.chunk || message->readData()[0] != expected ||
+            message->readData()[state.chunk - 1] != expected) {
+            fprintf(stderr, "Bad message %zu\n", state.received);
+            exit(1);
+        }
+        receiver.socketThread.MessageHandled(c, message->readSize());
+        state.received++;
+        state.cv.notify_all();
+    });
+    WaitForListener();
+
+    Peer sender(&logger);
+    sender.socketThread.setOnConnectCb([&state](const Contact&, bool connected) {
+        std::lock_guard<std::mutex> lock(state.mutex);
+        state.connected = connected;
+        state.cv.notify_all();
+    });
+    sender.socketThread.setQueueEmptyCb([&state](const Contact&) {
+        std::lock_guard<std::mutex> lock(state.mutex);
+        state.uncorked = true;
+        state.cv.notify_all();
+    });
+    Contact c{ receiver.pubkey };
+    sender.socketThread.Connect(c, "127.0.0.1", PORT);
+    Wait(state, [&] { return state.connected; });
+
+    size_t maxChunk = sender.socketThread.GetMaxBufferSize(c);
+    printf("Negotiated up to %zu bytes per chunk\n", maxChunk);
+    for (size_t chunk : CHUNKS) {
+        if (chunk > maxChunk) {
+            break;
+        }
+        printf("%5zu KB chunks: %7.0f MB/s\n", chunk / 1024, Run(state, sender, c, chunk, total));
+        fflush(stdout);
+    }
+    // The socket threads aren't made to stop
+    _exit(0);
+}
@@ -0,0 +1,210 @@
+// Measures reconnects per second between two SocketThreads over loopback, with a full handshake
+// and resumed from a ticket. Each one is timed from Connect() until the client's connect
+// callback, the handshake going through the sockets, the serialization and the crypto as it does
+// between peers.
+//
+// A client keeps the ticket of its last session with the server, so all its reconnects after the
+// first are resumed. A full handshake needs a client without one: each is made by a new process
+// with a new SocketThread, forked before the timing starts.
+//
+// Build and run on Linux, from the repository root:
+//   g++ -std=c++17 -O2 -I. -Ilib -DFMT_HEADER_ONLY -pthread -o HandshakeBench bench/HandshakeBench.cpp
+//       SocketThread.cpp lib/posix/EventLoop.cpp -lsodium
+//   ./HandshakeBench [reconnects count]
+//
+// The server listens on port 8890, which must be free.
+
+#include "SocketThread.h"
+#include "crypto.h"
+#include <arpa/inet.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+
+namespace {
+
+enum { PORT = 8890 };
+
+class StderrLogger : public Logger {
+public:
+    StderrLogger(LogLevel maxLevel)
+        : maxLevel_(maxLevel)
+    {}
+protected:
+    bool shouldLog(LogLevel level) override {
+        return level <= maxLevel_;
+    }
+    void logString(LogLevel level, const std::wstring& s) override {
+        fprintf(stderr, "%ls\n", s.c_str());
+    }
+private:
+    LogLevel maxLevel_;
+};
+
+struct Peer {
+    std::string pubkey = std::string(crypto_sign_PUBLICKEYBYTES, '\0');
+    std::string privkey = std::string(crypto_sign_SECRETKEYBYTES, '\0');
+    SocketThreadApi socketThread;
+
+    Peer(Logger* logger) {
+        crypto_sign_keypair((unsigned char*)&pubkey[0], (unsigned char*)&privkey[0]);
+        socketThread.Init(logger, pubkey, privkey);
+        socketThread.setIsKnownContact([](const std::string&) { return true; });
+    }
+};
+
+// Until the server listens, so that clients don't get the port
+void WaitForListener() {
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(PORT);
+    for (int i = 0; i < 500; i++) {
+        int s = socket(AF_INET, SOCK_STREAM, 0);
+        bool listening = connect(s, (sockaddr*)&addr, sizeof(addr)) == 0;
+        close(s);
+        if (listening) {
+            return;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    fprintf(stderr, "Nothing listens on port %d\n", PORT);
+    exit(1);
+}
+
+// Connections of one side, counted by its connect callback
+struct Connections {
+    std::mutex mutex;
+    std::condition_variable cv;
+    int connected = 0;
+    int disconnected = 0;
+
+    void Watch(SocketThreadApi& socketThread) {
+        socketThread.setOnConnectCb([this, &socketThread](const Contact& c, bool connected) {
+            if (!connected) {
+                // Nothing else sends to the contact, so the socket thread may answer it itself
+                socketThread.DisconnectHandled(c);
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            (connected ? this->connected : disconnected)++;
+            cv.notify_all();
+        });
+    }
+
+    template <class Pred>
+    void Wait(Pred pred) {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!cv.wait_for(lock, std::chrono::seconds(10), pred)) {
+            fprintf(stderr, "Timed out\n");
+            exit(1);
+        }
+    }
+};
+
+using Clock = std::chrono::steady_clock;
+
+// Connects, and returns how long until the handshake was done
+double TimeConnect(SocketThreadApi& client, Connections& connections, const Contact& server) {
+    int before;
+    {
+        std::lock_guard<std::mutex> lock(connections.mutex);
+        before = connections.connected;
+    }
+    auto start = Clock::now();
+    client.Connect(server, "127.0.0.1", PORT);
+    connections.Wait([&] { return connections.connected > before; });
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Seconds taken by count full handshakes, each by a new client in a new process
+double FullHandshakes(Connections& serverConnections, const Contact& server, int count) {
+    double total = 0;
+    for (int i = 0; i < count; i++) {
+        int fds[2];
+        if (pipe(fds) != 0) {
+            perror("pipe");
+            exit(1);
+        }
+        pid_t pid = fork();
+        if (pid == 0) {
+            // Quiet, as each would log that it can't listen on the server's port
+            StderrLogger logger(Logger::F);
+            Peer client(&logger);
+            Connections connections;
+            connections.Watch(client.socketThread);
+            double seconds = TimeConnect(client.socketThread, connections, server);
+            _exit(write(fds[1], &seconds, sizeof(seconds)) == sizeof(seconds) ? 0 : 1);
+        }
+        double seconds;
+        if (pid < 0 || read(fds[0], &seconds, sizeof(seconds)) != sizeof(seconds)) {
+            fprintf(stderr, "Client %d failed\n", i);
+            exit(1);
+        }
+        close(fds[0]);
+        close(fds[1]);
+        waitpid(pid, nullptr, 0);
+        total += seconds;
+        // The server is done with the connection before the next one comes
+        serverConnections.Wait([&] { return serverConnections.disconnected > i; });
+    }
+    return total;
+}
+
+// Same for count resumed ones, all by the same client
+double ResumedHandshakes(Connections& serverConnections, Peer& client, Connections& connections, const Contact& server,
+    int count) {
+    int serverDisconnected;
+    {
+        std::lock_guard<std::mutex> lock(serverConnections.mutex);
+        serverDisconnected = serverConnections.disconnected;
+    }
+    double total = 0;
+    // The first one gets the ticket
+    for (int i = 0; i <= count; i++) {
+        double seconds = TimeConnect(client.socketThread, connections, server);
+        if (i > 0) {
+            total += seconds;
+        }
+        client.socketThread.Disconnect(server);
+        connections.Wait([&] { return connections.disconnected > i; });
+        serverConnections.Wait([&] { return serverConnections.disconnected > serverDisconnected + i; });
+    }
+    return total;
+}
+
+}
+
+int main(int argc, char** argv) {
+    int count = argc > 1 ? atoi(argv[1]) : 500;
+    if (sodium_init() < 0) {
+        return 1;
+    }
+    StderrLogger logger(Logger::W);
+    Peer server(&logger);
+    Connections serverConnections;
+    serverConnections.Watch(server.socketThread);
+    WaitForListener();
+    Contact c{ server.pubkey };
+
+    double full = FullHandshakes(serverConnections, c, count);
+    printf("Full handshake:  %6.0f reconnects/s, %5.0f us each\n", count / full, full / count * 1e6);
+    fflush(stdout);
+
+    StderrLogger clientLogger(Logger::F);
+    Peer client(&clientLogger);
+    Connections clientConnections;
+    clientConnections.Watch(client.socketThread);
+    double resumed = ResumedHandshakes(serverConnections, client, clientConnections, c, count);
+    printf("Resumed session: %6.0f reconnects/s, %5.0f us each\n", count / resumed, resumed / count * 1e6);
+    fflush(stdout);
+    // The socket threads aren't made to stop
+    _exit(0);
+}
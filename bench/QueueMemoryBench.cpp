@@ -0,0 +1,116 @@
+// Measures the memory a send queue of many files takes per file: as DiskThread used to queue
+// them, an item each with the full and relative names and the hash state, and as it does now,
+// the names of each list in a PathTable and a small entry per file. Counts the heap bytes in use
+// after queueing, with the containers' own overhead.
+//
+// Build and run on Linux, from the repository root:
+//   g++ -std=c++17 -O2 -Ilib -o QueueMemoryBench bench/QueueMemoryBench.cpp
+//   ./QueueMemoryBench [files count]
+//
+// wchar_t takes 4 bytes here and 2 on Windows, so the names cost about twice what they do there.
+
+#include "PathTable.h"
+#include "sodium.h"
+#include <deque>
+#include <malloc.h>
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+namespace {
+
+size_t heapBytes = 0;
+
+// Names like those of a photo collection: years, albums, then files
+const wchar_t ROOT[] = L"C:\\Users\\someone\\Pictures";
+enum { FILES_PER_ALBUM = 200 };
+enum { ALBUMS_PER_YEAR = 50 };
+
+std::wstring RelativeName(size_t i) {
+    size_t album = i / FILES_PER_ALBUM;
+    return std::to_wstring(2000 + album / ALBUMS_PER_YEAR) + L"\\Album " + std::to_wstring(album % ALBUMS_PER_YEAR) +
+        L"\\IMG_" + std::to_wstring(20000000 + i) + L".jpg";
+}
+
+// What a queued file took before
+struct OldItem {
+    std::string contact;
+    std::wstring filename;
+    std::wstring relativeFilename;
+    bool dontUpdateSizes;
+    uint64_t size;
+    bool sizeKnown;
+    crypto_generichash_state hash;
+};
+
+// And now
+struct QueuedFile {
+    uint64_t size;
+    PathTable::Id name;
+    bool sizeKnown;
+};
+
+void Report(const char* name, size_t files, size_t before) {
+    size_t bytes = heapBytes - before;
+    printf("%-20s %8.1f MB %8.1f bytes/file\n", name, bytes / 1e6, (double)bytes / files);
+}
+
+}
+
+void* operator new(size_t size) {
+    void* p = malloc(size);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    heapBytes += malloc_usable_size(p);
+    return p;
+}
+
+void* operator new(size_t size, std::align_val_t align) {
+    void* p = aligned_alloc((size_t)align, (size + (size_t)align - 1) / (size_t)align * (size_t)align);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    heapBytes += malloc_usable_size(p);
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    if (p != nullptr) {
+        heapBytes -= malloc_usable_size(p);
+        free(p);
+    }
+}
+
+void operator delete(void* p, std::align_val_t) noexcept {
+    operator delete(p);
+}
+
+int main(int argc, char** argv) {
+    size_t files = argc > 1 ? strtoull(argv[1], nullptr, 10) : 1000000;
+    printf("%zu files, sample name %ls\\%ls\n", files, ROOT, RelativeName(files - 1).c_str());
+
+    {
+        size_t before = heapBytes;
+        std::deque<OldItem> queue;
+        for (size_t i = 0; i < files; i++) {
+            std::wstring relativeFilename = RelativeName(i);
+            queue.push_back(OldItem{ std::string(32, 'k'), std::wstring(ROOT) + L"\\" + relativeFilename,
+                relativeFilename, true, 4096, true });
+        }
+        Report("item per file", files, before);
+    }
+    {
+        size_t before = heapBytes;
+        PathTable names;
+        std::vector<QueuedFile> queue;
+        queue.reserve(files);
+        for (size_t i = 0; i < files; i++) {
+            queue.push_back(QueuedFile{ 4096, names.add(RelativeName(i)), true });
+        }
+        Report("path table", files, before);
+    }
+    return 0;
+}
@@ -0,0 +1,220 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+// Memory for Buffers in size classes, so that the chunks and messages made and dropped all the
+// time are reused instead of going back and forth to the heap. Each thread keeps the blocks it
+// allocated in its own cache, without locking. A block freed by another thread, as when
+// DiskThread reads a chunk and SocketThread sends it, goes back to the thread that allocated it
+// through a lock-free list, which that thread takes on its next allocation of the class.
+class BufferPool {
+public:
+    struct Stats {
+        uint64_t allocations = 0;
+        uint64_t reused = 0;        // served from a cache rather than the heap
+        uint64_t remoteFrees = 0;   // freed by another thread than the one that allocated
+        uint64_t cachedBytes = 0;   // held by the caches for reuse
+    };
+
+    // Aligned as new would. Sizes over the largest class come from the heap.
+    static void* allocate(size_t size) {
+        uint32_t sizeClass = classOf(size);
+        Cache* cache = threadCache();
+        if (cache != nullptr) {
+            cache->allocations.fetch_add(1, std::memory_order_relaxed);
+        }
+        if (sizeClass == NO_CLASS || cache == nullptr) {
+            return newBlock(size, nullptr, NO_CLASS) + 1;
+        }
+        std::vector<Block*>& list = cache->free[sizeClass];
+        if (list.empty()) {
+            TakeRemote(*cache, sizeClass);
+        }
+        if (list.empty()) {
+            return newBlock(classSize(sizeClass), cache, sizeClass) + 1;
+        }
+        Block* block = list.back();
+        list.pop_back();
+        cache->reused.fetch_add(1, std::memory_order_relaxed);
+        cache->cachedBytes.fetch_sub(classSize(sizeClass), std::memory_order_relaxed);
+        return block + 1;
+    }
+
+    static void release(void* p) {
+        Block* block = (Block*)p - 1;
+        if (block->sizeClass == NO_CLASS) {
+            delete[] (uint8_t*)block;
+            return;
+        }
+        Cache* cache = threadCache();
+        if (cache == block->owner) {
+            Keep(*cache, block);
+            return;
+        }
+        if (cache != nullptr) {
+            cache->remoteFrees.fetch_add(1, std::memory_order_relaxed);
+        }
+        std::atomic<Block*>& remote = block->owner->remote[block->sizeClass];
+        Block* head = remote.load(std::memory_order_relaxed);
+        do {
+            block->next = head;
+        } while (!remote.compare_exchange_weak(head, block, std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    // Of all threads together
+    static Stats stats() {
+        Stats stats;
+        Registry& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        for (Cache* cache : r.all) {
+            stats.allocations += cache->allocations.load(std::memory_order_relaxed);
+            stats.reused += cache->reused.load(std::memory_order_relaxed);
+            stats.remoteFrees += cache->remoteFrees.load(std::memory_order_relaxed);
+            stats.cachedBytes += cache->cachedBytes.load(std::memory_order_relaxed);
+        }
+        return stats;
+    }
+
+    // Classes are CLASSES_PER_DOUBLING steps between powers of two, plus SLACK so that a Buffer
+    // of a round capacity, with its header and trailer room, fits its class
+    enum { MIN_SIZE_LOG = 9, MAX_SIZE_LOG = 22 };
+    enum { CLASSES_PER_DOUBLING = 4 };
+    enum { SLACK = 128 };
+
+private:
+    enum { NUM_CLASSES = (MAX_SIZE_LOG - MIN_SIZE_LOG) * CLASSES_PER_DOUBLING + 1 };
+    enum : uint32_t { NO_CLASS = NUM_CLASSES };
+    // What a thread keeps of each class, at least MIN_CACHED_BLOCKS
+    enum { CACHE_BYTES_PER_CLASS = 32 * 1024 * 1024 };
+    enum { MIN_CACHED_BLOCKS = 4 };
+
+    struct Cache;
+    // Before the memory handed out
+    struct alignas(16) Block {
+        Cache* owner;
+        Block* next;
+        uint32_t sizeClass;
+    };
+    struct Cache {
+        std::vector<Block*> free[NUM_CLASSES];
+        // Freed by other threads
+        std::atomic<Block*> remote[NUM_CLASSES] = {};
+        std::atomic<uint64_t> allocations{0};
+        std::atomic<uint64_t> reused{0};
+        std::atomic<uint64_t> remoteFrees{0};
+        std::atomic<uint64_t> cachedBytes{0};
+    };
+    // Caches are never deleted, blocks out there point to them. That of a thread that ended goes
+    // to the next new thread, with the blocks freed to it meanwhile.
+    struct Registry {
+        std::mutex mutex;
+        std::vector<Cache*> all;
+        std::vector<Cache*> spare;
+    };
+    struct CacheHolder {
+        CacheHolder() {
+            Registry& r = registry();
+            std::lock_guard<std::mutex> lock(r.mutex);
+            if (r.spare.empty()) {
+                cache = new Cache;
+                r.all.push_back(cache);
+            } else {
+                cache = r.spare.back();
+                r.spare.pop_back();
+            }
+            tlsCache() = cache;
+        }
+        ~CacheHolder() {
+            // Buffers freed later by this thread go to the heap, or to their owner
+            tlsCache() = nullptr;
+            tlsEnded() = true;
+            for (uint32_t sizeClass = 0; sizeClass < NUM_CLASSES; sizeClass++) {
+                TakeRemote(*cache, sizeClass);
+                for (Block* block : cache->free[sizeClass]) {
+                    delete[] (uint8_t*)block;
+                }
+                cache->free[sizeClass] = std::vector<Block*>();
+            }
+            cache->cachedBytes.store(0, std::memory_order_relaxed);
+            Registry& r = registry();
+            std::lock_guard<std::mutex> lock(r.mutex);
+            r.spare.push_back(cache);
+        }
+        Cache* cache;
+    };
+
+    static Registry& registry() {
+        static Registry* r = new Registry;
+        return *r;
+    }
+    static Cache*& tlsCache() {
+        static thread_local Cache* cache = nullptr;
+        return cache;
+    }
+    static bool& tlsEnded() {
+        static thread_local bool ended = false;
+        return ended;
+    }
+    // Null once the thread's thread_local objects are being destroyed
+    static Cache* threadCache() {
+        Cache* cache = tlsCache();
+        if (cache == nullptr && !tlsEnded()) {
+            static thread_local CacheHolder holder;
+            cache = holder.cache;
+        }
+        return cache;
+    }
+
+    static uint32_t classOf(size_t size) {
+        if (size <= ((size_t)1 << MIN_SIZE_LOG) + SLACK) {
+            return 0;
+        }
+        size_t m = size - SLACK - 1;
+        uint32_t log = MIN_SIZE_LOG;
+        while ((m >> (log + 1)) != 0) {
+            log++;
+        }
+        if (log >= MAX_SIZE_LOG) {
+            return NO_CLASS;
+        }
+        size_t step = (size_t)1 << (log - 2);
+        size_t steps = (size - SLACK - ((size_t)1 << log) + step - 1) / step;
+        return (log - MIN_SIZE_LOG) * CLASSES_PER_DOUBLING + (uint32_t)steps;
+    }
+    static size_t classSize(uint32_t sizeClass) {
+        uint32_t log = MIN_SIZE_LOG + sizeClass / CLASSES_PER_DOUBLING;
+        return ((size_t)1 << log) + (sizeClass % CLASSES_PER_DOUBLING) * ((size_t)1 << (log - 2)) + SLACK;
+    }
+
+    static Block* newBlock(size_t size, Cache* owner, uint32_t sizeClass) {
+        Block* block = (Block*)new uint8_t[sizeof(Block) + size];
+        block->owner = owner;
+        block->next = nullptr;
+        block->sizeClass = sizeClass;
+        return block;
+    }
+
+    static void Keep(Cache& cache, Block* block) {
+        std::vector<Block*>& list = cache.free[block->sizeClass];
+        size_t size = classSize(block->sizeClass);
+        if (list.size() >= MIN_CACHED_BLOCKS && (list.size() + 1) * size > CACHE_BYTES_PER_CLASS) {
+            delete[] (uint8_t*)block;
+            return;
+        }
+        list.push_back(block);
+        cache.cachedBytes.fetch_add(size, std::memory_order_relaxed);
+    }
+
+    static void TakeRemote(Cache& cache, uint32_t sizeClass) {
+        Block* block = cache.remote[sizeClass].exchange(nullptr, std::memory_order_acquire);
+        while (block != nullptr) {
+            Block* next = block->next;
+            Keep(cache, block);
+            block = next;
+        }
+    }
+};
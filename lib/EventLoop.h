@@ -0,0 +1,50 @@
+#pragma once
+
+#include "socket.h"
+#include <functional>
+#include <memory>
+#include <stdint.h>
+
+// A thread running an event loop that dispatches socket readiness, timers and
+// tasks posted from other threads. On Windows it is built on WSAAsyncSelect and
+// a message-only window (see MessageThread), elsewhere on epoll.
+//
+// Socket notifications follow WSAAsyncSelect semantics on all platforms:
+// EV_READ is level-triggered, EV_WRITE is reported once when the socket becomes
+// writable and must be re-armed with RequestWriteEvent() after a send() returns
+// a would-block error. A socket passed to WatchSocket() is made non-blocking.
+class EventLoop {
+public:
+    enum Event {
+        EV_READ = 1,
+        EV_WRITE = 2,
+        EV_ACCEPT = 4,
+        EV_CONNECT = 8,
+        EV_CLOSE = 16,
+    };
+
+    EventLoop();
+    virtual ~EventLoop();
+    void Start();
+    void RunInThread(std::function<void(void)> func);
+    // Runs func in the loop thread and waits for its result. Runs func directly
+    // if called from the loop thread.
+    intptr_t RunInThreadWithResult(std::function<intptr_t(void)> func);
+
+    // The following are only to be called from the loop thread
+    void WatchSocket(SOCKET s, int events);
+    void UnwatchSocket(SOCKET s);
+    void RequestWriteEvent(SOCKET s);
+    // Periodic timer, calls OnTimer(id) every ms milliseconds until killed
+    void SetTimer(uintptr_t id, uint32_t ms);
+    void KillTimer(uintptr_t id);
+
+protected:
+    virtual void InitInThread() {}
+    virtual void OnSocketEvent(SOCKET s, int event, int error) {}
+    virtual void OnTimer(uintptr_t id) {}
+
+private:
+    class Impl;
+    std::unique_ptr<Impl> impl_;
+};
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <stdint.h>
+
+// Reads and writes at explicit offsets that complete later, so that a thread can keep several
+// in flight and go on with other work. The same interface has several backends: blocking calls
+// on all platforms, overlapped I/O on Windows and io_uring on Linux.
+//
+// read() and write() only queue a request, submit() hands all the queued ones to the system at
+// once. Callbacks run in the thread that made the requests: on Windows while it waits alertably,
+// as MessageThread does, elsewhere from poll(). Buffers must stay valid until then, and the
+// instance must not be destroyed before.
+class FileIo {
+public:
+    // Index in the instance's table of open files
+    typedef int File;
+    enum { INVALID_FILE = -1 };
+    enum Mode {
+        OPEN_READ,      // An existing file, others may read and write it meanwhile
+        CREATE_WRITE,   // A new file, fails if it exists
+        OPEN_READ_WRITE,    // An existing file, to write more of and read back
+    };
+    enum Backend {
+        BLOCKING,       // Requests are done one by one in submit()
+        NATIVE,         // The system's asynchronous I/O, or BLOCKING without it
+    };
+    // error is 0 or a system error, see errstr(). Reading at the end of the file isn't an error,
+    // it completes with a count of 0.
+    using Callback = std::function<void(int error, uint32_t count)>;
+
+    static std::unique_ptr<FileIo> create(Backend backend);
+
+    virtual ~FileIo() {}
+    virtual const char* name() const = 0;
+
+    // INVALID_FILE on error, the system error is left in GetLastError() or errno
+    virtual File open(const std::wstring& filename, Mode mode) = 0;
+    virtual uint64_t size(File file) = 0;
+    // Allocates disk space for the file to grow to size, in one piece if possible, without
+    // changing its size. Only a hint, returns false if it couldn't be done.
+    virtual bool reserve(File file, uint64_t size) = 0;
+    // Submits the queued requests first, those on the file still complete, maybe with an error
+    virtual void close(File file) = 0;
+
+    virtual void read(File file, uint64_t offset, void* data, uint32_t size, Callback cb) = 0;
+    virtual void write(File file, uint64_t offset, const void* data, uint32_t size, Callback cb) = 0;
+    virtual void submit() = 0;
+    // Submits the queued requests, then runs the callbacks of the completed ones. If wait is set
+    // and some are in flight, waits for one first.
+    virtual void poll(bool wait) = 0;
+    // Requests whose callback hasn't run yet
+    virtual size_t inFlight() const = 0;
+
+    // Memory that requests will use again and again, so that backends which can pin it do it
+    // once instead of on every request. The memory must outlive the instance.
+    virtual void registerMemory(void* data, size_t size) {}
+};
@@ -0,0 +1,94 @@
+#pragma once
+
+#include "sodium.h"
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Hash of a file as a binary Merkle tree over its blocks of BLOCK_SIZE. Blocks are hashed on
+// their own, so in any order and on any thread, then paired level by level up to the root, a
+// node left alone at the end of a level going up as is. Two copies with different roots can be
+// told which of their blocks differ from the block hashes alone.
+class MerkleHash {
+public:
+    enum { BLOCK_SIZE = 1024 * 1024 };
+    enum { HASH_BYTES = crypto_generichash_BYTES };
+
+    // Hash of one block, for when its data comes in pieces
+    class Block {
+    public:
+        Block() {
+            reset();
+        }
+        void reset() {
+            crypto_generichash_init(&state_, NULL, 0, HASH_BYTES);
+            const unsigned char prefix = LEAF_PREFIX;
+            crypto_generichash_update(&state_, &prefix, 1);
+            size_ = 0;
+        }
+        void update(const unsigned char* data, size_t size) {
+            crypto_generichash_update(&state_, data, size);
+            size_ += size;
+        }
+        // Bytes hashed since the last reset
+        size_t size() const {
+            return size_;
+        }
+        // Resets for the next block
+        std::string result() {
+            std::string s(HASH_BYTES, '\0');
+            crypto_generichash_final(&state_, (unsigned char*)&s[0], HASH_BYTES);
+            reset();
+            return s;
+        }
+    private:
+        crypto_generichash_state state_;
+        size_t size_;
+    };
+
+    static uint64_t blockCount(uint64_t fileSize) {
+        return (fileSize + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    }
+
+    static std::string hashBlock(const unsigned char* data, size_t size) {
+        Block block;
+        block.update(data, size);
+        return block.result();
+    }
+
+    // Root of the tree over the hashes of all blocks of a file, in order
+    static std::string root(std::vector<std::string> level) {
+        if (level.empty()) {
+            // Empty file, a single empty block
+            return Block().result();
+        }
+        while (level.size() > 1) {
+            std::vector<std::string> next;
+            next.reserve((level.size() + 1) / 2);
+            for (size_t i = 0; i + 1 < level.size(); i += 2) {
+                next.push_back(hashNodes(level[i], level[i + 1]));
+            }
+            if (level.size() % 2 != 0) {
+                next.push_back(std::move(level.back()));
+            }
+            level.swap(next);
+        }
+        return level[0];
+    }
+
+private:
+    // Leaves and inner nodes are hashed differently, so that one can't pass for the other
+    enum { LEAF_PREFIX = 0, NODE_PREFIX = 1 };
+
+    static std::string hashNodes(const std::string& left, const std::string& right) {
+        crypto_generichash_state state;
+        crypto_generichash_init(&state, NULL, 0, HASH_BYTES);
+        const unsigned char prefix = NODE_PREFIX;
+        crypto_generichash_update(&state, &prefix, 1);
+        crypto_generichash_update(&state, (const unsigned char*)left.data(), left.size());
+        crypto_generichash_update(&state, (const unsigned char*)right.data(), right.size());
+        std::string s(HASH_BYTES, '\0');
+        crypto_generichash_final(&state, (unsigned char*)&s[0], HASH_BYTES);
+        return s;
+    }
+};
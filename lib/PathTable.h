@@ -0,0 +1,83 @@
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+
+// Relative paths stored as a tree of their components, so that a directory's name is kept once
+// for all the paths under it rather than in each. Names are back to back in one string, a path
+// costs a node and its last component. For lists of millions of files.
+class PathTable {
+public:
+    typedef uint32_t Id;
+
+    // Components are separated by '\\'
+    Id add(const std::wstring& path) {
+        size_t slash = path.rfind(L'\\');
+        if (slash == std::wstring::npos) {
+            return addNode(NO_PARENT, path.data(), path.size());
+        }
+        Id parent = addDir(path, slash);
+        return addNode(parent, path.data() + slash + 1, path.size() - slash - 1);
+    }
+
+    std::wstring get(Id id) const {
+        size_t size = 0;
+        for (Id i = id; i != NO_PARENT; i = nodes_[i].parent) {
+            size += nodes_[i].nameSize + 1;
+        }
+        std::wstring path(size - 1, L'\\');
+        for (Id i = id; i != NO_PARENT; i = nodes_[i].parent) {
+            size -= nodes_[i].nameSize + 1;
+            path.replace(size, nodes_[i].nameSize, names_, nodes_[i].nameOffset, nodes_[i].nameSize);
+        }
+        return path;
+    }
+
+private:
+    enum : Id { NO_PARENT = ~0u };
+    struct Node {
+        Id parent;
+        uint32_t nameOffset;
+        uint32_t nameSize;
+    };
+
+    Id addNode(Id parent, const wchar_t* name, size_t size) {
+        nodes_.push_back(Node{ parent, (uint32_t)names_.size(), (uint32_t)size });
+        names_.append(name, size);
+        return (Id)(nodes_.size() - 1);
+    }
+
+    // The directory made of the first size characters of path. Paths mostly come grouped by
+    // directory, the last one is looked up without building its string.
+    Id addDir(const std::wstring& path, size_t size) {
+        if (lastDirId_ != NO_PARENT && size == lastDir_.size() && path.compare(0, size, lastDir_) == 0) {
+            return lastDirId_;
+        }
+        std::wstring dir = path.substr(0, size);
+        Id id;
+        auto it = dirs_.find(dir);
+        if (it != dirs_.end()) {
+            id = it->second;
+        } else {
+            size_t slash = dir.rfind(L'\\');
+            if (slash == std::wstring::npos) {
+                id = addNode(NO_PARENT, dir.data(), dir.size());
+            } else {
+                Id parent = addDir(dir, slash);
+                id = addNode(parent, dir.data() + slash + 1, dir.size() - slash - 1);
+            }
+            dirs_.emplace(dir, id);
+        }
+        lastDir_ = std::move(dir);
+        lastDirId_ = id;
+        return id;
+    }
+
+    std::vector<Node> nodes_;
+    std::wstring names_;
+    std::unordered_map<std::wstring, Id> dirs_;
+    std::wstring lastDir_;
+    Id lastDirId_ = NO_PARENT;
+};
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <stddef.h>
+
+// Bounded lock-free queue for exactly one producer thread and one consumer thread
+template <class T>
+class SpscQueue {
+public:
+    explicit SpscQueue(size_t capacity)
+        : size_(capacity + 1)
+        , items_(new T[capacity + 1])
+    {}
+
+    // Producer only. Returns false if the queue is full.
+    bool push(T item) {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        size_t next = tail + 1 == size_ ? 0 : tail + 1;
+        if (next == head_.load(std::memory_order_acquire)) {
+            return false;
+        }
+        items_[tail] = std::move(item);
+        tail_.store(next, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer only. Returns false if the queue is empty.
+    bool pop(T& item) {
+        size_t head = head_.load(std::memory_order_relaxed);
+        if (head == tail_.load(std::memory_order_acquire)) {
+            return false;
+        }
+        item = std::move(items_[head]);
+        head_.store(head + 1 == size_ ? 0 : head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Exact if the other side is idle, otherwise a snapshot that may be already stale
+    size_t size() const {
+        size_t head = head_.load(std::memory_order_acquire);
+        size_t tail = tail_.load(std::memory_order_acquire);
+        return tail >= head ? tail - head : tail + size_ - head;
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+private:
+    const size_t size_;
+    std::unique_ptr<T[]> items_;
+    alignas(64) std::atomic<size_t> head_{0};
+    alignas(64) std::atomic<size_t> tail_{0};
+};
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <stdint.h>
+
+// Limits a byte rate. Tokens accumulate at the rate up to the burst size, each byte sent
+// takes one. A send may take more tokens than there are, the next one waits for the debt
+// to be repaid, so the long term rate is exact whatever the send sizes and timer precision.
+class TokenBucket {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // 0 for no limit. The burst is what can be sent at once after being idle, it must be
+    // at least what can be sent between two wakeups for the rate to be reachable.
+    void setRate(uint64_t bytesPerSecond, uint64_t burst) {
+        rate_ = bytesPerSecond;
+        burst_ = burst;
+        tokens_ = std::min(tokens_, (double)burst_);
+        last_ = Clock::now();
+    }
+
+    uint64_t rate() const {
+        return rate_;
+    }
+
+    bool isLimited() const {
+        return rate_ != 0;
+    }
+
+    // Zero if sending is allowed now, otherwise how long to wait until it is
+    Clock::duration delay(Clock::time_point now) {
+        if (!isLimited()) {
+            return Clock::duration::zero();
+        }
+        refill(now);
+        if (tokens_ >= 0) {
+            return Clock::duration::zero();
+        }
+        return std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(-tokens_ / rate_)) + Clock::duration(1);
+    }
+
+    void consume(uint64_t bytes, Clock::time_point now) {
+        if (!isLimited()) {
+            return;
+        }
+        refill(now);
+        tokens_ -= bytes;
+    }
+
+private:
+    void refill(Clock::time_point now) {
+        if (now > last_) {
+            tokens_ = std::min(tokens_ + std::chrono::duration<double>(now - last_).count() * rate_, (double)burst_);
+            last_ = now;
+        }
+    }
+
+    uint64_t rate_ = 0;
+    uint64_t burst_ = 0;
+    double tokens_ = 0;
+    Clock::time_point last_;
+};
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <stddef.h>
+
+// Fixed set of threads that run the iterations of a loop in parallel, together
+// with the calling thread. parallelFor must only be called from one thread at a time.
+class WorkerPool {
+public:
+    // numThreads doesn't include the calling thread, 0 runs everything in the caller
+    explicit WorkerPool(unsigned numThreads) {
+        for (unsigned i = 0; i < numThreads; i++) {
+            threads_.emplace_back([this] { WorkerLoop(); });
+        }
+    }
+
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        for (std::thread& t : threads_) {
+            t.join();
+        }
+    }
+
+    size_t size() const {
+        return threads_.size() + 1;
+    }
+
+    // Calls func(i) for each i in [0, count), returns when all calls have returned
+    void parallelFor(size_t count, const std::function<void(size_t)>& func) {
+        if (count <= 1 || threads_.empty()) {
+            for (size_t i = 0; i < count; i++) {
+                func(i);
+            }
+            return;
+        }
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            // A worker that woke up late for the previous loop may still be looking at it
+            doneCv_.wait(lock, [this] { return active_ == 0; });
+            func_ = &func;
+            count_ = count;
+            next_ = 0;
+            generation_++;
+        }
+        cv_.notify_all();
+        RunItems();
+        std::unique_lock<std::mutex> lock(mutex_);
+        doneCv_.wait(lock, [this] { return active_ == 0; });
+    }
+
+private:
+    void WorkerLoop() {
+        uint64_t seen = 0;
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            cv_.wait(lock, [&] { return stop_ || generation_ != seen; });
+            if (stop_) {
+                return;
+            }
+            seen = generation_;
+            active_++;
+            lock.unlock();
+            RunItems();
+            lock.lock();
+            if (--active_ == 0) {
+                doneCv_.notify_all();
+            }
+        }
+    }
+
+    // func_ and count_ only change while no worker is active
+    void RunItems() {
+        size_t i;
+        while ((i = next_.fetch_add(1)) < count_) {
+            (*func_)(i);
+        }
+    }
+
+    std::vector<std::thread> threads_;
+    std::mutex mutex_;
+    std::condition_variable cv_, doneCv_;
+    bool stop_ = false;
+    uint64_t generation_ = 0;
+    int active_ = 0;
+    const std::function<void(size_t)>* func_ = nullptr;
+    size_t count_ = 0;
+    std::atomic<size_t> next_{0};
+};
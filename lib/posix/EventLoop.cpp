@@ -0,0 +1,321 @@
+#include "../EventLoop.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <chrono>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+class EventLoop::Impl {
+public:
+    using clock = std::chrono::steady_clock;
+
+    struct SocketState {
+        int events = 0;
+        bool connecting = false;
+        bool writeArmed = false;
+    };
+    struct Timer {
+        uint32_t ms;
+        clock::time_point deadline;
+    };
+
+    Impl(EventLoop* loop)
+        : loop_(loop)
+    {}
+
+    ~Impl() {
+        if (thread_.joinable()) {
+            Post([this] {
+                quit_ = true;
+            });
+            thread_.join();
+        }
+        if (wakefd_ >= 0) {
+            close(wakefd_);
+        }
+        if (epfd_ >= 0) {
+            close(epfd_);
+        }
+    }
+
+    void Start() {
+        epfd_ = epoll_create1(EPOLL_CLOEXEC);
+        wakefd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        epoll_event ev = { 0 };
+        ev.events = EPOLLIN;
+        ev.data.fd = wakefd_;
+        epoll_ctl(epfd_, EPOLL_CTL_ADD, wakefd_, &ev);
+
+        std::promise<void> ready;
+        thread_ = std::thread([this, &ready] {
+            threadId_ = std::this_thread::get_id();
+            loop_->InitInThread();
+            ready.set_value();
+            Loop();
+        });
+        ready.get_future().wait();
+    }
+
+    void Post(std::function<void(void)> func) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            tasks_.push_back(std::move(func));
+        }
+        uint64_t one = 1;
+        ssize_t res = write(wakefd_, &one, sizeof(one));
+        (void)res;
+    }
+
+    bool IsLoopThread() const {
+        return std::this_thread::get_id() == threadId_;
+    }
+
+    void Watch(SOCKET s, int events) {
+        fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+        bool existing = sockets_.find(s) != sockets_.end();
+        SocketState& st = sockets_[s];
+        st.events = events;
+        st.connecting = (events & EV_CONNECT) != 0;
+        // Like FD_WRITE, the first write notification comes without being requested.
+        // For a connecting socket it is sent right after the connect notification.
+        st.writeArmed = !st.connecting && (events & EV_WRITE) != 0;
+        UpdateMask(s, st, existing ? EPOLL_CTL_MOD : EPOLL_CTL_ADD);
+    }
+
+    void Unwatch(SOCKET s) {
+        if (sockets_.erase(s) != 0) {
+            epoll_ctl(epfd_, EPOLL_CTL_DEL, s, NULL);
+        }
+    }
+
+    void RequestWrite(SOCKET s) {
+        auto it = sockets_.find(s);
+        if (it == sockets_.end() || it->second.writeArmed) {
+            return;
+        }
+        it->second.writeArmed = true;
+        UpdateMask(s, it->second, EPOLL_CTL_MOD);
+    }
+
+    void SetTimer(uintptr_t id, uint32_t ms) {
+        timers_[id] = Timer{ ms, clock::now() + std::chrono::milliseconds(ms) };
+    }
+
+    void KillTimer(uintptr_t id) {
+        timers_.erase(id);
+    }
+
+private:
+    void UpdateMask(SOCKET s, const SocketState& st, int op) {
+        epoll_event ev = { 0 };
+        if (st.events & (EV_READ | EV_ACCEPT)) {
+            ev.events |= EPOLLIN;
+        }
+        // Alone, EV_CLOSE reports the hangup without the unread data waking the loop
+        if (st.events & (EV_READ | EV_ACCEPT | EV_CLOSE)) {
+            ev.events |= EPOLLRDHUP;
+        }
+        if (st.connecting || st.writeArmed) {
+            ev.events |= EPOLLOUT;
+        }
+        ev.data.fd = s;
+        epoll_ctl(epfd_, op, s, &ev);
+    }
+
+    int Timeout() const {
+        if (timers_.empty()) {
+            return -1;
+        }
+        clock::time_point first = clock::time_point::max();
+        for (const auto& t : timers_) {
+            first = std::min(first, t.second.deadline);
+        }
+        auto now = clock::now();
+        if (first <= now) {
+            return 0;
+        }
+        // Round up so that we don't wake up just before the deadline
+        return (int)std::chrono::ceil<std::chrono::milliseconds>(first - now).count();
+    }
+
+    void RunTasks() {
+        uint64_t value;
+        ssize_t res = read(wakefd_, &value, sizeof(value));
+        (void)res;
+        std::deque<std::function<void(void)>> tasks;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            tasks.swap(tasks_);
+        }
+        for (auto& task : tasks) {
+            task();
+        }
+    }
+
+    void RunTimers() {
+        auto now = clock::now();
+        std::vector<uintptr_t> expired;
+        for (const auto& t : timers_) {
+            if (t.second.deadline <= now) {
+                expired.push_back(t.first);
+            }
+        }
+        for (uintptr_t id : expired) {
+            // A previous timer callback may have killed this one
+            auto it = timers_.find(id);
+            if (it == timers_.end()) {
+                continue;
+            }
+            it->second.deadline = now + std::chrono::milliseconds(it->second.ms);
+            loop_->OnTimer(id);
+        }
+    }
+
+    static int SocketErrorOf(SOCKET s) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        getsockopt(s, SOL_SOCKET, SO_ERROR, &error, &len);
+        return error;
+    }
+
+    void DispatchSocket(SOCKET s, uint32_t revents) {
+        auto it = sockets_.find(s);
+        if (it == sockets_.end()) {
+            // Unwatched by an earlier callback in this batch
+            return;
+        }
+        // Callbacks can add or remove sockets, so don't hold on to the iterator
+        int events = it->second.events;
+
+        if (events & EV_ACCEPT) {
+            if (revents & EPOLLIN) {
+                loop_->OnSocketEvent(s, EV_ACCEPT, 0);
+            }
+            return;
+        }
+
+        if (it->second.connecting) {
+            if (!(revents & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+                return;
+            }
+            it->second.connecting = false;
+            UpdateMask(s, it->second, EPOLL_CTL_MOD);
+            int error = SocketErrorOf(s);
+            if (events & EV_CONNECT) {
+                loop_->OnSocketEvent(s, EV_CONNECT, error);
+            }
+            if (error == 0 && (events & EV_WRITE) && sockets_.find(s) != sockets_.end()) {
+                loop_->OnSocketEvent(s, EV_WRITE, 0);
+            }
+            return;
+        }
+
+        if (revents & EPOLLERR) {
+            loop_->OnSocketEvent(s, EV_CLOSE, SocketErrorOf(s));
+            return;
+        }
+
+        if ((revents & EPOLLOUT) && it->second.writeArmed) {
+            it->second.writeArmed = false;
+            UpdateMask(s, it->second, EPOLL_CTL_MOD);
+            loop_->OnSocketEvent(s, EV_WRITE, 0);
+            if (sockets_.find(s) == sockets_.end()) {
+                return;
+            }
+        }
+
+        if (revents & EPOLLIN) {
+            if (events & EV_READ) {
+                loop_->OnSocketEvent(s, EV_READ, 0);
+            }
+        } else if (revents & (EPOLLHUP | EPOLLRDHUP)) {
+            if (events & EV_CLOSE) {
+                loop_->OnSocketEvent(s, EV_CLOSE, 0);
+            } else {
+                // Nobody is interested, stop the hangup from being reported over and over
+                Unwatch(s);
+            }
+        }
+    }
+
+    void Loop() {
+        enum { MAX_EVENTS = 64 };
+        epoll_event events[MAX_EVENTS];
+        while (!quit_) {
+            int n = epoll_wait(epfd_, events, MAX_EVENTS, Timeout());
+            if (n < 0 && errno != EINTR) {
+                break;
+            }
+            for (int i = 0; i < n; i++) {
+                if (events[i].data.fd == wakefd_) {
+                    RunTasks();
+                } else {
+                    DispatchSocket(events[i].data.fd, events[i].events);
+                }
+            }
+            RunTimers();
+        }
+    }
+
+    EventLoop* loop_;
+    std::thread thread_;
+    std::thread::id threadId_;
+    int epfd_ = -1;
+    int wakefd_ = -1;
+    bool quit_ = false;
+    std::mutex mutex_;
+    std::deque<std::function<void(void)>> tasks_;
+    std::unordered_map<SOCKET, SocketState> sockets_;
+    std::unordered_map<uintptr_t, Timer> timers_;
+};
+
+EventLoop::EventLoop()
+    : impl_(new Impl(this))
+{}
+
+EventLoop::~EventLoop() {
+}
+
+void EventLoop::Start() {
+    impl_->Start();
+}
+
+void EventLoop::RunInThread(std::function<void(void)> func) {
+    impl_->Post(std::move(func));
+}
+
+intptr_t EventLoop::RunInThreadWithResult(std::function<intptr_t(void)> func) {
+    if (impl_->IsLoopThread()) {
+        return func();
+    }
+    std::promise<intptr_t> result;
+    impl_->Post([&func, &result] {
+        result.set_value(func());
+    });
+    return result.get_future().get();
+}
+
+void EventLoop::WatchSocket(SOCKET s, int events) {
+    impl_->Watch(s, events);
+}
+
+void EventLoop::UnwatchSocket(SOCKET s) {
+    impl_->Unwatch(s);
+}
+
+void EventLoop::RequestWriteEvent(SOCKET s) {
+    impl_->RequestWrite(s);
+}
+
+void EventLoop::SetTimer(uintptr_t id, uint32_t ms) {
+    impl_->SetTimer(id, ms);
+}
+
+void EventLoop::KillTimer(uintptr_t id) {
+    impl_->KillTimer(id);
+}
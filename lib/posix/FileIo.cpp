@@ -0,0 +1,415 @@
+#include "../FileIo.h"
+#include "../win/encoding.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+#include <algorithm>
+#include <utility>
+#include <vector>
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
+namespace {
+
+class PosixFileIo : public FileIo {
+public:
+    ~PosixFileIo() {
+        for (int fd : fds_) {
+            if (fd >= 0) {
+                ::close(fd);
+            }
+        }
+    }
+
+    File open(const std::wstring& filename, Mode mode) override {
+        std::string name = Utf16ToUtf8(filename);
+        int fd = mode == OPEN_READ ? ::open(name.c_str(), O_RDONLY | O_CLOEXEC)
+            : mode == OPEN_READ_WRITE ? ::open(name.c_str(), O_RDWR | O_CLOEXEC)
+            : ::open(name.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            return INVALID_FILE;
+        }
+#ifdef POSIX_FADV_SEQUENTIAL
+        if (mode == OPEN_READ) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        }
+#endif
+        File file = (File)fds_.size();
+        for (size_t i = 0; i < fds_.size(); i++) {
+            if (fds_[i] < 0) {
+                file = (File)i;
+                break;
+            }
+        }
+        if (file == (File)fds_.size()) {
+            fds_.push_back(-1);
+        }
+        fds_[file] = fd;
+        OnOpen(file, fd);
+        return file;
+    }
+
+    uint64_t size(File file) override {
+        struct stat st;
+        return fstat(fds_[file], &st) == 0 ? st.st_size : 0;
+    }
+
+    bool reserve(File file, uint64_t size) override {
+#ifdef __linux__
+        return fallocate(fds_[file], FALLOC_FL_KEEP_SIZE, 0, size) == 0;
+#else
+        return false;
+#endif
+    }
+
+    void close(File file) override {
+        submit();
+        OnClose(file);
+        ::close(fds_[file]);
+        fds_[file] = -1;
+    }
+
+protected:
+    virtual void OnOpen(File file, int fd) {}
+    virtual void OnClose(File file) {}
+
+    int fd(File file) const {
+        return fds_[file];
+    }
+
+private:
+    // Indexed by File, -1 for free slots
+    std::vector<int> fds_;
+};
+
+// Each request is done by submit(), one after the other
+class BlockingFileIo : public PosixFileIo {
+public:
+    const char* name() const override {
+        return "blocking";
+    }
+
+    void read(File file, uint64_t offset, void* data, uint32_t size, Callback cb) override {
+        queued_.push_back({ false, file, offset, data, size, std::move(cb) });
+    }
+
+    void write(File file, uint64_t offset, const void* data, uint32_t size, Callback cb) override {
+        queued_.push_back({ true, file, offset, (void*)data, size, std::move(cb) });
+    }
+
+    void submit() override {
+        for (Request& r : queued_) {
+            ssize_t res = r.write ? pwrite(fd(r.file), r.data, r.size, r.offset) : pread(fd(r.file), r.data, r.size, r.offset);
+            done_.emplace_back(std::move(r.cb), res < 0 ? -errno : (int)res);
+        }
+        queued_.clear();
+    }
+
+    void poll(bool wait) override {
+        submit();
+        // Callbacks may queue more requests
+        std::vector<std::pair<Callback, int>> done;
+        done.swap(done_);
+        for (auto& d : done) {
+            d.first(d.second < 0 ? -d.second : 0, d.second < 0 ? 0 : d.second);
+        }
+    }
+
+    size_t inFlight() const override {
+        return queued_.size() + done_.size();
+    }
+
+private:
+    struct Request {
+        bool write;
+        File file;
+        uint64_t offset;
+        void* data;
+        uint32_t size;
+        Callback cb;
+    };
+    std::vector<Request> queued_;
+    // Callbacks with the result, a negative errno on error
+    std::vector<std::pair<Callback, int>> done_;
+};
+
+#ifdef __linux__
+// io_uring through its system calls, liburing isn't needed for the little used here. Files are
+// put in the ring's fixed file table and registered memory is read and written with the _FIXED
+// operations, which saves the kernel looking up the file and pinning the pages on each request.
+class UringFileIo : public PosixFileIo {
+public:
+    enum { QUEUE_DEPTH = 256 };
+    // Slots of the fixed file table, files opened beyond are used as plain descriptors
+    enum { FIXED_FILES = 256 };
+
+    // nullptr if the kernel can't do it, 5.6 and later can
+    static std::unique_ptr<UringFileIo> create() {
+        std::unique_ptr<UringFileIo> io(new UringFileIo());
+        return io->init() ? std::move(io) : nullptr;
+    }
+
+    ~UringFileIo() {
+        // Requests in flight still reference the memory, which is the caller's to avoid
+        if (sqes_ != MAP_FAILED) {
+            munmap(sqes_, sqesSize_);
+        }
+        if (ring_ != MAP_FAILED) {
+            munmap(ring_, ringSize_);
+        }
+        if (ringFd_ >= 0) {
+            ::close(ringFd_);
+        }
+    }
+
+    const char* name() const override {
+        return "io_uring";
+    }
+
+    void read(File file, uint64_t offset, void* data, uint32_t size, Callback cb) override {
+        Queue(IORING_OP_READ, IORING_OP_READ_FIXED, file, offset, data, size, std::move(cb));
+    }
+
+    void write(File file, uint64_t offset, const void* data, uint32_t size, Callback cb) override {
+        Queue(IORING_OP_WRITE, IORING_OP_WRITE_FIXED, file, offset, (void*)data, size, std::move(cb));
+    }
+
+    void submit() override {
+        Enter(0, 0);
+    }
+
+    void poll(bool wait) override {
+        bool empty = __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE) == *cqHead_ && completed_.empty();
+        Enter(wait && inFlight_ > queued_ && empty ? 1 : 0, IORING_ENTER_GETEVENTS);
+        // Copied out first, callbacks may queue and submit more requests
+        Reap();
+        std::vector<std::pair<uint64_t, int32_t>> done;
+        done.swap(completed_);
+        for (auto& d : done) {
+            Callback cb = std::move(callbacks_[d.first]);
+            freeCallbacks_.push_back((uint32_t)d.first);
+            inFlight_--;
+            cb(d.second < 0 ? -d.second : 0, d.second < 0 ? 0 : d.second);
+        }
+    }
+
+    size_t inFlight() const override {
+        return inFlight_;
+    }
+
+    void registerMemory(void* data, size_t size) override {
+        // The table is replaced as a whole, requests in flight keep the old one alive
+        iovec v;
+        v.iov_base = data;
+        v.iov_len = size;
+        memory_.push_back(v);
+        Register(IORING_UNREGISTER_BUFFERS, NULL, 0);
+        if (Register(IORING_REGISTER_BUFFERS, memory_.data(), (unsigned)memory_.size()) != 0) {
+            // Over RLIMIT_MEMLOCK most likely, requests still work without it. What was
+            // registered before stays so.
+            memory_.pop_back();
+            if (memory_.empty() || Register(IORING_REGISTER_BUFFERS, memory_.data(), (unsigned)memory_.size()) != 0) {
+                memory_.clear();
+            }
+        }
+    }
+
+protected:
+    void OnOpen(File file, int fd) override {
+        if (file < FIXED_FILES) {
+            fileStates_[file] = FILE_OPENED;
+        }
+    }
+
+    void OnClose(File file) override {
+        if (file < FIXED_FILES && fileStates_[file] == FILE_FIXED) {
+            UpdateFixedFile(file, -1);
+        }
+    }
+
+private:
+    UringFileIo() = default;
+
+    bool init() {
+        io_uring_params params = {};
+        ringFd_ = (int)syscall(__NR_io_uring_setup, QUEUE_DEPTH, &params);
+        if (ringFd_ < 0) {
+            return false;
+        }
+        // NODROP so that completions beyond the queue's size aren't lost, and RW_CUR_POS for
+        // the kernels having IORING_OP_READ and IORING_OP_WRITE
+        const unsigned required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_RW_CUR_POS;
+        if ((params.features & required) != required) {
+            return false;
+        }
+        ringSize_ = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+            params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+        ring_ = (uint8_t*)mmap(NULL, ringSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_SQ_RING);
+        sqesSize_ = params.sq_entries * sizeof(io_uring_sqe);
+        sqes_ = (io_uring_sqe*)mmap(NULL, sqesSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_SQES);
+        if (ring_ == MAP_FAILED || sqes_ == MAP_FAILED) {
+            return false;
+        }
+        sqHead_ = (unsigned*)(ring_ + params.sq_off.head);
+        sqTail_ = (unsigned*)(ring_ + params.sq_off.tail);
+        sqMask_ = (unsigned*)(ring_ + params.sq_off.ring_mask);
+        sqArray_ = (unsigned*)(ring_ + params.sq_off.array);
+        sqEntries_ = params.sq_entries;
+        cqHead_ = (unsigned*)(ring_ + params.cq_off.head);
+        cqTail_ = (unsigned*)(ring_ + params.cq_off.tail);
+        cqMask_ = (unsigned*)(ring_ + params.cq_off.ring_mask);
+        cqes_ = (io_uring_cqe*)(ring_ + params.cq_off.cqes);
+
+        std::vector<int> fds(FIXED_FILES, -1);
+        fixedFiles_ = Register(IORING_REGISTER_FILES, fds.data(), FIXED_FILES) == 0;
+        return true;
+    }
+
+    int Register(unsigned opcode, void* arg, unsigned count) {
+        return (int)syscall(__NR_io_uring_register, ringFd_, opcode, arg, count);
+    }
+
+    bool UpdateFixedFile(File file, int fd) {
+        io_uring_files_update update = {};
+        update.offset = (uint32_t)file;
+        update.fds = (uint64_t)(uintptr_t)&fd;
+        return Register(IORING_REGISTER_FILES_UPDATE, &update, 1) == 1;
+    }
+
+    // Updating the table takes a system call on open and another on close, which only pays off
+    // for files with several requests
+    bool UseFixedFile(File file) {
+        if (fileStates_[file] == FILE_OPENED) {
+            fileStates_[file] = FILE_USED;
+        } else if (fileStates_[file] == FILE_USED) {
+            fileStates_[file] = UpdateFixedFile(file, fd(file)) ? FILE_FIXED : FILE_NOT_FIXED;
+        }
+        return fileStates_[file] == FILE_FIXED;
+    }
+
+    // Moves the completions out of the ring, their callbacks run on the next poll
+    void Reap() {
+        unsigned head = *cqHead_;
+        unsigned tail = __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            io_uring_cqe& cqe = cqes_[head & *cqMask_];
+            completed_.emplace_back(cqe.user_data, cqe.res);
+        }
+        __atomic_store_n(cqHead_, head, __ATOMIC_RELEASE);
+    }
+
+    void Queue(uint8_t opcode, uint8_t fixedOpcode, File file, uint64_t offset, void* data, uint32_t size, Callback cb) {
+        unsigned tail = *sqTail_;
+        while (tail - __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE) == sqEntries_) {
+            submit();
+            if (tail - __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE) == sqEntries_) {
+                // The kernel refused them, with EBUSY while its completions overflow or EAGAIN.
+                // Waits for one and makes room for more.
+                Enter(inFlight_ > queued_ ? 1 : 0, IORING_ENTER_GETEVENTS);
+                Reap();
+            }
+        }
+        uint32_t index;
+        if (freeCallbacks_.empty()) {
+            index = (uint32_t)callbacks_.size();
+            callbacks_.push_back(std::move(cb));
+        } else {
+            index = freeCallbacks_.back();
+            freeCallbacks_.pop_back();
+            callbacks_[index] = std::move(cb);
+        }
+
+        io_uring_sqe& sqe = sqes_[tail & *sqMask_];
+        sqe = {};
+        sqe.opcode = opcode;
+        if (fixedFiles_ && file < FIXED_FILES && UseFixedFile(file)) {
+            sqe.fd = file;
+            sqe.flags = IOSQE_FIXED_FILE;
+        } else {
+            sqe.fd = fd(file);
+        }
+        sqe.off = offset;
+        sqe.addr = (uint64_t)(uintptr_t)data;
+        sqe.len = size;
+        sqe.user_data = index;
+        for (size_t i = 0; i < memory_.size(); i++) {
+            uint8_t* base = (uint8_t*)memory_[i].iov_base;
+            if ((uint8_t*)data >= base && (uint8_t*)data + size <= base + memory_[i].iov_len) {
+                sqe.opcode = fixedOpcode;
+                sqe.buf_index = (uint16_t)i;
+                break;
+            }
+        }
+        sqArray_[tail & *sqMask_] = tail & *sqMask_;
+        __atomic_store_n(sqTail_, tail + 1, __ATOMIC_RELEASE);
+        queued_++;
+        inFlight_++;
+    }
+
+    void Enter(unsigned minComplete, unsigned flags) {
+        while (queued_ > 0 || minComplete > 0) {
+            int res = (int)syscall(__NR_io_uring_enter, ringFd_, queued_, minComplete, flags, NULL, 0);
+            if (res < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                // EAGAIN or EBUSY, the queued requests go with the next call
+                return;
+            }
+            if (res == 0 && minComplete == 0) {
+                return;
+            }
+            queued_ -= res;
+            minComplete = 0;
+        }
+    }
+
+    int ringFd_ = -1;
+    uint8_t* ring_ = (uint8_t*)MAP_FAILED;
+    size_t ringSize_ = 0;
+    io_uring_sqe* sqes_ = (io_uring_sqe*)MAP_FAILED;
+    size_t sqesSize_ = 0;
+    unsigned* sqHead_;
+    unsigned* sqTail_;
+    unsigned* sqMask_;
+    unsigned* sqArray_;
+    unsigned sqEntries_;
+    unsigned* cqHead_;
+    unsigned* cqTail_;
+    unsigned* cqMask_;
+    io_uring_cqe* cqes_;
+    bool fixedFiles_ = false;
+    enum FileState : uint8_t { FILE_OPENED, FILE_USED, FILE_FIXED, FILE_NOT_FIXED };
+    FileState fileStates_[FIXED_FILES] = {};
+    std::vector<iovec> memory_;
+    // Indexed by user_data
+    std::vector<Callback> callbacks_;
+    std::vector<uint32_t> freeCallbacks_;
+    // Taken from the completion queue, waiting for poll to run their callbacks
+    std::vector<std::pair<uint64_t, int32_t>> completed_;
+    // Queued but not submitted yet
+    unsigned queued_ = 0;
+    size_t inFlight_ = 0;
+};
+#endif
+
+}
+
+// DiskThread and ReceiveThread only run on Windows for now, so until they run elsewhere
+// UringFileIo is only used by bench/FileIoBench.cpp
+std::unique_ptr<FileIo> FileIo::create(Backend backend) {
+#ifdef __linux__
+    if (backend == NATIVE) {
+        std::unique_ptr<FileIo> io = UringFileIo::create();
+        if (io) {
+            return io;
+        }
+    }
+#endif
+    return std::make_unique<BlockingFileIo>();
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+// Minimal portability layer over BSD sockets and Winsock, so that code using
+// sockets can be written once for both.
+
+#ifdef _WIN32
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <mstcpip.h>
+#include <stdint.h>
+
+// Winsock never raises SIGPIPE
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+inline int socketError() {
+    return WSAGetLastError();
+}
+
+inline bool isWouldBlock(int err) {
+    return err == WSAEWOULDBLOCK;
+}
+
+typedef WSABUF IoVec;
+
+inline void setIoVec(IoVec& v, const void* data, size_t size) {
+    v.buf = (CHAR*)data;
+    v.len = (ULONG)size;
+}
+
+// Gather-send, returns the number of bytes sent or -1 on error
+inline int sendv(SOCKET s, IoVec* vecs, int count) {
+    DWORD sent;
+    if (WSASend(s, vecs, count, &sent, 0, NULL, NULL) != 0) {
+        return -1;
+    }
+    return (int)sent;
+}
+
+// Smoothed round trip time of a connected TCP socket in microseconds, 0 if unknown
+inline uint32_t socketRttUs(SOCKET s) {
+#ifdef SIO_TCP_INFO
+    // Windows 10 1703 and later
+    DWORD version = 0;
+    TCP_INFO_v0 info;
+    DWORD bytes;
+    if (WSAIoctl(s, SIO_TCP_INFO, &version, sizeof(version), &info, sizeof(info), &bytes, NULL, NULL) == 0) {
+        return (uint32_t)info.RttUs;
+    }
+#endif
+    return 0;
+}
+
+#else
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+
+typedef int SOCKET;
+enum { INVALID_SOCKET = -1 };
+
+inline int closesocket(SOCKET s) {
+    return close(s);
+}
+
+inline int socketError() {
+    return errno;
+}
+
+inline bool isWouldBlock(int err) {
+    // Non-blocking connect() returns EINPROGRESS where Winsock returns WSAEWOULDBLOCK
+    return err == EAGAIN || err == EWOULDBLOCK || err == EINPROGRESS;
+}
+
+typedef iovec IoVec;
+
+inline void setIoVec(IoVec& v, const void* data, size_t size) {
+    v.iov_base = (void*)data;
+    v.iov_len = size;
+}
+
+// Gather-send, returns the number of bytes sent or -1 on error
+inline int sendv(SOCKET s, IoVec* vecs, int count) {
+    msghdr msg = { 0 };
+    msg.msg_iov = vecs;
+    msg.msg_iovlen = count;
+    return (int)sendmsg(s, &msg, MSG_NOSIGNAL);
+}
+
+// Smoothed round trip time of a connected TCP socket in microseconds, 0 if unknown
+inline uint32_t socketRttUs(SOCKET s) {
+    tcp_info info;
+    socklen_t len = sizeof(info);
+    if (getsockopt(s, IPPROTO_TCP, TCP_INFO, &info, &len) != 0) {
+        return 0;
+    }
+    return info.tcpi_rtt;
+}
+
+#endif
@@ -0,0 +1,100 @@
+#include "../EventLoop.h"
+#include "MessageThread.h"
+
+class EventLoop::Impl : public MessageThread {
+public:
+    enum {
+        WM_SOCKET = WM_APP,
+    };
+
+    Impl(EventLoop* loop)
+        : loop_(loop)
+    {}
+
+    static long ToWinEvents(int events) {
+        long res = 0;
+        if (events & EV_READ) res |= FD_READ;
+        if (events & EV_WRITE) res |= FD_WRITE;
+        if (events & EV_ACCEPT) res |= FD_ACCEPT;
+        if (events & EV_CONNECT) res |= FD_CONNECT;
+        if (events & EV_CLOSE) res |= FD_CLOSE;
+        return res;
+    }
+
+    static int FromWinEvent(int event) {
+        switch (event) {
+        case FD_READ: return EV_READ;
+        case FD_WRITE: return EV_WRITE;
+        case FD_ACCEPT: return EV_ACCEPT;
+        case FD_CONNECT: return EV_CONNECT;
+        case FD_CLOSE: return EV_CLOSE;
+        }
+        return 0;
+    }
+
+protected:
+    std::optional<LRESULT> HandleMessage(UINT uMsg, WPARAM wParam, LPARAM lParam) override {
+        if (uMsg == WM_SOCKET) {
+            SOCKET sock = (SOCKET)wParam;
+            int error = WSAGETSELECTERROR(lParam);
+            int event = FromWinEvent(WSAGETSELECTEVENT(lParam));
+            if (event != 0) {
+                loop_->OnSocketEvent(sock, event, error);
+            }
+            return (LRESULT)0;
+        } else if (uMsg == WM_TIMER) {
+            loop_->OnTimer((uintptr_t)wParam);
+            return (LRESULT)0;
+        }
+        return std::nullopt;
+    }
+
+    void InitInThread() override {
+        loop_->InitInThread();
+    }
+
+private:
+    EventLoop* loop_;
+};
+
+EventLoop::EventLoop()
+    : impl_(new Impl(this))
+{}
+
+EventLoop::~EventLoop() {
+}
+
+void EventLoop::Start() {
+    impl_->Start();
+}
+
+void EventLoop::RunInThread(std::function<void(void)> func) {
+    impl_->RunInThread(std::move(func));
+}
+
+intptr_t EventLoop::RunInThreadWithResult(std::function<intptr_t(void)> func) {
+    return impl_->RunInThreadWithResult([&func] {
+        return (LRESULT)func();
+    });
+}
+
+void EventLoop::WatchSocket(SOCKET s, int events) {
+    // WSAAsyncSelect also makes the socket non-blocking
+    WSAAsyncSelect(s, impl_->GetHWND(), Impl::WM_SOCKET, Impl::ToWinEvents(events));
+}
+
+void EventLoop::UnwatchSocket(SOCKET s) {
+    WSAAsyncSelect(s, impl_->GetHWND(), 0, 0);
+}
+
+void EventLoop::RequestWriteEvent(SOCKET s) {
+    // Winsock re-enables FD_WRITE by itself after send() fails with WSAEWOULDBLOCK
+}
+
+void EventLoop::SetTimer(uintptr_t id, uint32_t ms) {
+    ::SetTimer(impl_->GetHWND(), id, ms, NULL);
+}
+
+void EventLoop::KillTimer(uintptr_t id) {
+    ::KillTimer(impl_->GetHWND(), id);
+}
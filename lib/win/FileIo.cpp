@@ -0,0 +1,225 @@
+#include "../FileIo.h"
+#include "vista.h"
+#include <windows.h>
+#include <vector>
+
+namespace {
+
+// Open files, in slots reused once closed
+class HandleTable {
+public:
+    FileIo::File add(HANDLE h) {
+        for (size_t i = 0; i < handles_.size(); i++) {
+            if (handles_[i] == INVALID_HANDLE_VALUE) {
+                handles_[i] = h;
+                return (FileIo::File)i;
+            }
+        }
+        handles_.push_back(h);
+        return (FileIo::File)(handles_.size() - 1);
+    }
+
+    HANDLE get(FileIo::File file) const {
+        return handles_[file];
+    }
+
+    void remove(FileIo::File file) {
+        CloseHandle(handles_[file]);
+        handles_[file] = INVALID_HANDLE_VALUE;
+    }
+
+    ~HandleTable() {
+        for (HANDLE h : handles_) {
+            if (h != INVALID_HANDLE_VALUE) {
+                CloseHandle(h);
+            }
+        }
+    }
+
+private:
+    std::vector<HANDLE> handles_;
+};
+
+HANDLE OpenHandle(const std::wstring& filename, FileIo::Mode mode, DWORD flags) {
+    if (mode == FileIo::OPEN_READ) {
+        return CreateFile(filename.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+            NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN | flags, NULL);
+    }
+    if (mode == FileIo::OPEN_READ_WRITE) {
+        return CreateFile(filename.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+            NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | flags, NULL);
+    }
+    return CreateFile(filename.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+        NULL, CREATE_NEW, FILE_ATTRIBUTE_NORMAL | flags, NULL);
+}
+
+struct Request {
+    OVERLAPPED ov = {};
+    bool write;
+    FileIo::File file;
+    uint64_t offset;
+    void* data;
+    uint32_t size;
+    FileIo::Callback cb;
+    DWORD error = 0;
+    DWORD count = 0;
+    size_t* inFlight;
+};
+
+// Reading at the end of a file is an error for Windows only
+void Complete(Request* request) {
+    std::unique_ptr<Request> r(request);
+    (*r->inFlight)--;
+    if (r->error == ERROR_HANDLE_EOF) {
+        r->error = 0;
+        r->count = 0;
+    }
+    r->cb(r->error, r->count);
+}
+
+VOID CALLBACK OnApc(ULONG_PTR param) {
+    Complete((Request*)param);
+}
+
+class WinFileIo : public FileIo {
+public:
+    WinFileIo(DWORD openFlags)
+        : openFlags_(openFlags)
+    {}
+
+    File open(const std::wstring& filename, Mode mode) override {
+        HANDLE h = OpenHandle(filename, mode, openFlags_);
+        return h == INVALID_HANDLE_VALUE ? INVALID_FILE : files_.add(h);
+    }
+
+    uint64_t size(File file) override {
+        LARGE_INTEGER size;
+        return GetFileSizeEx(files_.get(file), &size) ? size.QuadPart : 0;
+    }
+
+    bool reserve(File file, uint64_t size) override {
+        return VistaSetFileAllocationSize(files_.get(file), size);
+    }
+
+    void close(File file) override {
+        submit();
+        files_.remove(file);
+    }
+
+    void read(File file, uint64_t offset, void* data, uint32_t size, Callback cb) override {
+        Queue(false, file, offset, data, size, std::move(cb));
+    }
+
+    void write(File file, uint64_t offset, const void* data, uint32_t size, Callback cb) override {
+        Queue(true, file, offset, (void*)data, size, std::move(cb));
+    }
+
+    void submit() override {
+        for (std::unique_ptr<Request>& r : queued_) {
+            r->ov.Offset = (DWORD)r->offset;
+            r->ov.OffsetHigh = (DWORD)(r->offset >> 32);
+            if (!Start(files_.get(r->file), *r)) {
+                // Done already, reported like a completion, never from inside submit()
+                QueueUserAPC(OnApc, GetCurrentThread(), (ULONG_PTR)r.get());
+            }
+            r.release();
+        }
+        queued_.clear();
+    }
+
+    void poll(bool wait) override {
+        submit();
+        SleepEx(wait && inFlight_ > 0 ? INFINITE : 0, TRUE);
+    }
+
+    size_t inFlight() const override {
+        return inFlight_;
+    }
+
+protected:
+    // Returns true if the request completes later, otherwise sets its result
+    virtual bool Start(HANDLE h, Request& r) = 0;
+
+private:
+    void Queue(bool write, File file, uint64_t offset, void* data, uint32_t size, Callback cb) {
+        std::unique_ptr<Request> r = std::make_unique<Request>();
+        r->write = write;
+        r->file = file;
+        r->offset = offset;
+        r->data = data;
+        r->size = size;
+        r->cb = std::move(cb);
+        r->inFlight = &inFlight_;
+        inFlight_++;
+        queued_.push_back(std::move(r));
+    }
+
+    DWORD openFlags_;
+    HandleTable files_;
+    std::vector<std::unique_ptr<Request>> queued_;
+    size_t inFlight_ = 0;
+};
+
+// Each request is done by submit(), one after the other
+class BlockingFileIo : public WinFileIo {
+public:
+    BlockingFileIo()
+        : WinFileIo(0)
+    {}
+
+    const char* name() const override {
+        return "blocking";
+    }
+
+protected:
+    bool Start(HANDLE h, Request& r) override {
+        // The OVERLAPPED of a synchronous handle only gives the offset
+        BOOL ok = r.write
+            ? WriteFile(h, r.data, r.size, &r.count, &r.ov)
+            : ReadFile(h, r.data, r.size, &r.count, &r.ov);
+        if (!ok) {
+            r.error = GetLastError();
+        }
+        return false;
+    }
+};
+
+// ReadFileEx and WriteFileEx, the callbacks run from their completion routines
+class OverlappedFileIo : public WinFileIo {
+public:
+    OverlappedFileIo()
+        : WinFileIo(FILE_FLAG_OVERLAPPED)
+    {}
+
+    const char* name() const override {
+        return "overlapped";
+    }
+
+protected:
+    bool Start(HANDLE h, Request& r) override {
+        BOOL ok = r.write
+            ? WriteFileEx(h, r.data, r.size, &r.ov, OnComplete)
+            : ReadFileEx(h, r.data, r.size, &r.ov, OnComplete);
+        if (!ok) {
+            r.error = GetLastError();
+        }
+        return ok;
+    }
+
+private:
+    static VOID CALLBACK OnComplete(DWORD error, DWORD count, LPOVERLAPPED ov) {
+        Request* r = CONTAINING_RECORD(ov, Request, ov);
+        r->error = error;
+        r->count = count;
+        Complete(r);
+    }
+};
+
+}
+
+std::unique_ptr<FileIo> FileIo::create(Backend backend) {
+    if (backend == NATIVE) {
+        return std::make_unique<OverlappedFileIo>();
+    }
+    return std::make_unique<BlockingFileIo>();
+}
@@ -1,8 +1,13 @@
-#pragma once
-
-#include <string>
-#include <Windows.h>
-
-// Returns false if method not available (e.g. on XP). Returns true on Vista+.
-// When true, path is empty if the user cancelled the dialog box, or a folder path on success.
-bool VistaSelectFolder(HWND hwnd, std::wstring& path);
\ No newline at end of file
+#pragma once
+
+#include <string>
+#include <Windows.h>
+#include <stdint.h>
+
+// Returns false if method not available (e.g. on XP). Returns true on Vista+.
+// When true, path is empty if the user cancelled the dialog box, or a folder path on success.
+bool VistaSelectFolder(HWND hwnd, std::wstring& path);
+
+// Reserves disk space for the file to grow to size, without changing its size.
+// Returns false if not available (e.g. on XP) or if it failed.
+bool VistaSetFileAllocationSize(HANDLE h, uint64_t size);
\ No newline at end of file
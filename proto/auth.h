@@ -1,52 +1,78 @@
-#pragma once
-
-#include "Serializer.h"
-
-struct ClientHelloMessage {
-    std::string random;
-    std::string kexKeyShare;
-    std::string nonce;
-
-    template <class X>
-    void visit(X& x) {
-        x(1, random);
-        x(2, kexKeyShare);
-        x(3, nonce);
-    }
-};
-
-struct SignatureMessage {
-    std::string pubkey;
-    std::string signature;
-
-    template <class X>
-    void visit(X& x) {
-        x(1, pubkey);
-        x(2, signature);
-    }
-};
-
-struct ServerHelloFinishedMessage {
-    std::string random;
-    std::string kexKeyShare;
-    std::string nonce;
-    std::string encryptedSignatureMessage;
-
-    template <class X>
-    void visit(X& x) {
-        x(1, random);
-        x(2, kexKeyShare);
-        x(3, nonce);
-        x(4, encryptedSignatureMessage);
-    }
-};
-
-struct ClientFinishedMessage {
-    std::string encryptedSignatureMessage;
-
-    template <class X>
-    void visit(X& x) {
-        x(1, encryptedSignatureMessage);
-    }
-
-};
+#pragma once
+
+#include "Serializer.h"
+
+// Older peers don't negotiate and always use ChaCha20-Poly1305
+enum CipherId {
+    CIPHER_CHACHA20_POLY1305 = 1,
+    CIPHER_AES256_GCM = 2,
+};
+
+struct ClientHelloMessage {
+    std::string random;
+    std::string kexKeyShare;
+    std::string nonce;
+    uint32_t maxMessageSize = 0;    // 0 if not sent by an older peer
+    std::string ciphers;            // CipherId bytes, most preferred first
+    std::string ticket;             // Session to resume, empty for a full handshake
+    std::string binder;             // Proves knowledge of the ticket's secret
+    uint32_t features = 0;          // Application protocol features, see proto/file.h
+
+    template <class X>
+    void visit(X& x) {
+        x(1, random);
+        x(2, kexKeyShare);
+        x(3, nonce);
+        x(4, maxMessageSize);
+        x(5, ciphers);
+        x(6, ticket);
+        x(7, binder);
+        x(8, features);
+    }
+};
+
+struct SignatureMessage {
+    std::string pubkey;
+    std::string signature;
+
+    template <class X>
+    void visit(X& x) {
+        x(1, pubkey);
+        x(2, signature);
+    }
+};
+
+struct ServerHelloFinishedMessage {
+    std::string random;
+    std::string kexKeyShare;
+    std::string nonce;
+    std::string encryptedSignatureMessage;
+    uint32_t maxMessageSize = 0;    // 0 if not sent by an older peer
+    uint8_t cipher = 0;             // CipherId chosen from ClientHelloMessage::ciphers, 0 if none were offered
+    // If set, the ticket was accepted: there's no kexKeyShare and encryptedSignatureMessage
+    // holds the transcript hash instead of a SignatureMessage. The handshake ends here.
+    uint8_t resumed = 0;
+    uint32_t features = 0;          // Application protocol features, see proto/file.h
+
+    template <class X>
+    void visit(X& x) {
+        x(1, random);
+        x(2, kexKeyShare);
+        x(3, nonce);
+        x(4, encryptedSignatureMessage);
+        x(5, maxMessageSize);
+        x(6, cipher);
+        x(7, resumed);
+        x(8, features);
+    }
+};
+
+struct ClientFinishedMessage {
+    std::string encryptedSignatureMessage;
+
+    template <class X>
+    void visit(X& x) {
+        x(1, encryptedSignatureMessage);
+    }
+
+};
@@ -1,46 +1,148 @@
-#pragma once
-
-#include "Serializer.h"
-
-enum MessageType {
-    SENDFILE_HEADER = 1,
-    SENDFILE_DATA = 2,
-    SENDFILE_TRAILER = 3,
-    SENDFILE_LIST = 4,
-};
-
-struct Header {
-    uint16_t streamId;
-    uint16_t type;
-};
-
-struct SendFileListHeader {
-    uint32_t count;
-    uint64_t size;
-
-    template <class X>
-    void visit(X& x) {
-        x(1, count);
-        x(2, size);
-    }
-};
-
-struct SendFileHeader {
-    std::string name;
-    uint64_t size;
-
-    template <class X>
-    void visit(X& x) {
-        x(1, name);
-        x(2, size);
-    }
-};
-
-struct SendFileTrailer {
-    std::string checksum;
-
-    template <class X>
-    void visit(X& x) {
-        x(1, checksum);
-    }
-};
+#pragma once
+
+#include "Serializer.h"
+
+enum MessageType {
+    SENDFILE_HEADER = 1,
+    SENDFILE_DATA = 2,
+    SENDFILE_TRAILER = 3,
+    SENDFILE_LIST = 4,
+    // From the receiver, the answer to a SENDFILE_HEADER with an identity
+    SENDFILE_RESUME = 5,
+    // Block hashes of a file, with FEATURE_MERKLE, sent before its trailer
+    SENDFILE_HASHES = 6,
+    // From the receiver, the blocks of a file that didn't match their hash
+    SENDFILE_RESEND = 7,
+    // The SENDFILE_DATA that follow go at another place in the file, when resending blocks
+    SENDFILE_SEEK = 8,
+    // Small files of a list sent whole, many per message, on CONTROL_STREAM_ID
+    SENDFILE_BUNDLE = 9,
+};
+
+// Optional features, exchanged when connecting
+enum Feature {
+    // Several files are sent at once, interleaved, each with its own Header::streamId
+    FEATURE_STREAMS = 1,
+    // Interrupted transfers of large files continue where they stopped, see SendFileResume
+    FEATURE_RESUME = 2,
+    // Files are hashed as a Merkle tree of blocks rather than as a whole, see SendFileTrailer.
+    // Blocks that arrived corrupt are sent again.
+    FEATURE_MERKLE = 4,
+    // Small files are sent in SENDFILE_BUNDLE rather than each with its header, data and trailer
+    FEATURE_BUNDLES = 8,
+    // A list is sent in parts as its files are found, see SendFileListHeader::listId
+    FEATURE_LIST_PARTS = 16,
+};
+
+enum {
+    // Used for messages not tied to a single file, like SENDFILE_LIST, with FEATURE_STREAMS
+    CONTROL_STREAM_ID = 0,
+    // Used for everything when talking to peers without FEATURE_STREAMS
+    LEGACY_STREAM_ID = 5555,
+};
+
+struct Header {
+    uint16_t streamId;
+    uint16_t type;
+};
+
+struct SendFileListHeader {
+    uint32_t count;
+    uint64_t size;
+    // Set on each part of a list with FEATURE_LIST_PARTS, the files of all parts go in the same
+    // directory. more is set on all parts but the last, which may have no files.
+    uint32_t listId = 0;
+    uint8_t more = 0;
+
+    template <class X>
+    void visit(X& x) {
+        x(1, count);
+        x(2, size);
+        x(3, listId);
+        x(4, more);
+    }
+};
+
+struct SendFileHeader {
+    std::string name;
+    uint64_t size;
+    // Tells this file apart from others of the same name and size, and changes when it's
+    // modified. Empty unless the sender waits for SENDFILE_RESUME before sending data.
+    std::string identity;
+
+    template <class X>
+    void visit(X& x) {
+        x(1, name);
+        x(2, size);
+        x(3, identity);
+    }
+};
+
+// Data of the file is sent from offset on, the receiver has what comes before from an earlier
+// transfer. The trailer's checksum still covers the whole file.
+struct SendFileResume {
+    uint64_t offset;
+
+    template <class X>
+    void visit(X& x) {
+        x(1, offset);
+    }
+};
+
+// Next hashes of the file's MerkleHash blocks, in order, each MerkleHash::HASH_BYTES long
+struct SendFileHashes {
+    std::string hashes;
+
+    template <class X>
+    void visit(X& x) {
+        x(1, hashes);
+    }
+};
+
+// Indexes of the blocks to send again, as packed uint64_t. They are sent each after a
+// SendFileSeek, then the trailer again.
+struct SendFileResend {
+    std::string blocks;
+
+    template <class X>
+    void visit(X& x) {
+        x(1, blocks);
+    }
+};
+
+struct SendFileSeek {
+    uint64_t offset;
+
+    template <class X>
+    void visit(X& x) {
+        x(1, offset);
+    }
+};
+
+// One file of a SENDFILE_BUNDLE, which holds as many as fit one after the other. It counts as a
+// file of the last SENDFILE_LIST, like one sent with a SENDFILE_HEADER. Its size is that of data,
+// checksum is its MerkleHash root, that of a single block.
+struct SendFileBundleEntry {
+    std::string name;
+    std::string data;
+    std::string checksum;
+
+    template <class X>
+    void visit(X& x) {
+        x(1, name);
+        x(2, data);
+        x(3, checksum);
+    }
+};
+
+// With FEATURE_MERKLE the checksum is empty and root is set, MerkleHash::root of the blocks
+struct SendFileTrailer {
+    std::string checksum;
+    std::string root;
+
+    template <class X>
+    void visit(X& x) {
+        x(1, checksum);
+        x(2, root);
+    }
+};
@@ -1,23 +1,26 @@
-//{{NO_DEPENDENCIES}}
-// Microsoft Visual C++ generated include file.
-// Used by HomeShare.rc
-//
-#define IDR_MENU1                       101
-#define IDD_CONTACT_PROPS               102
-#define IDC_CONTACTVIEW                 1001
-#define IDC_LOGVIEW                     1002
-#define IDC_NAME_EDIT                   1003
-#define IDC_KEY_EDIT                    1004
-#define ID_FILE_DISCOVER                40001
-#define ID_HELP_ABOUT                   40002
-
-// Next default values for new objects
-// 
-#ifdef APSTUDIO_INVOKED
-#ifndef APSTUDIO_READONLY_SYMBOLS
-#define _APS_NEXT_RESOURCE_VALUE        103
-#define _APS_NEXT_COMMAND_VALUE         40003
-#define _APS_NEXT_CONTROL_VALUE         1005
-#define _APS_NEXT_SYMED_VALUE           103
-#endif
-#endif
+//{{NO_DEPENDENCIES}}
+// Microsoft Visual C++ generated include file.
+// Used by HomeShare.rc
+//
+#define IDR_MENU1                       101
+#define IDD_CONTACT_PROPS               102
+#define IDD_UPLOAD_LIMIT                103
+#define IDC_CONTACTVIEW                 1001
+#define IDC_LOGVIEW                     1002
+#define IDC_NAME_EDIT                   1003
+#define IDC_KEY_EDIT                    1004
+#define IDC_UPLOAD_LIMIT_EDIT           1005
+#define ID_FILE_DISCOVER                40001
+#define ID_HELP_ABOUT                   40002
+#define ID_FILE_UPLOAD_LIMIT            40003
+
+// Next default values for new objects
+// 
+#ifdef APSTUDIO_INVOKED
+#ifndef APSTUDIO_READONLY_SYMBOLS
+#define _APS_NEXT_RESOURCE_VALUE        104
+#define _APS_NEXT_COMMAND_VALUE         40004
+#define _APS_NEXT_CONTROL_VALUE         1006
+#define _APS_NEXT_SYMED_VALUE           103
+#endif
+#endif
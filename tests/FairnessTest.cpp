@@ -0,0 +1,236 @@
+// Checks that a hub sending the same file to three peers at once shares its upload between them by
+// their weights, 1, 1 and 2, as DiskThread's deficit round robin should. The upload is capped by a
+// global rate limit well below what loopback and the disks allow, so that the hub's turn order is
+// what decides the shares, and the cap itself is checked too.
+//
+// Build and run from the repository root, in a Developer Command Prompt:
+//   cl /std:c++17 /EHsc /O2 /I. /Ilib /DUNICODE /D_UNICODE /DSTRICT /DWIN32_LEAN_AND_MEAN /DFMT_HEADER_ONLY
+//       /DSODIUM_STATIC tests\FairnessTest.cpp Database.cpp DiskThread.cpp ReceiveThread.cpp SocketThread.cpp
+//       TreeWalker.cpp lib\sqlite3.c lib\win\EventLoop.cpp lib\win\FileIo.cpp lib\win\MessageThread.cpp
+//       lib\win\vista.cpp lib\win\window.cpp libx64\libsodium-Release.lib ws2_32.lib user32.lib
+//   FairnessTest
+//
+// The hub listens on port 8890, which must be free. The peers can't listen there too and log it.
+// Files go to HomeShareFairnessTest in the temporary folder, and are left there until the next run. Exits with 1 if a check failed.
+
+#include "Database.h"
+#include "DiskThread.h"
+#include "ReceiveThread.h"
+#include "crypto.h"
+#include "socket.h"
+#include <windows.h>
+#include <chrono>
+#include <math.h>
+#include <memory>
+#include <mutex>
+#include <stdio.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+enum { PORT = 8890 };
+const uint64_t RATE_LIMIT = 12 * 1000 * 1000;
+// Large enough that no peer is done before the end, smaller than files that are resumed
+const uint64_t FILE_SIZE = 48 * 1024 * 1024;
+const uint32_t WEIGHTS[] = { 1, 1, 2 };
+const int PEERS = 3;
+
+class StderrLogger : public Logger {
+protected:
+    bool shouldLog(LogLevel level) override {
+        return level <= W;
+    }
+    void logString(LogLevel level, const std::wstring& s) override {
+        fprintf(stderr, "%ls\n", s.c_str());
+    }
+};
+
+// The bytes received from the hub, as of a progress update
+struct Sample {
+    std::chrono::steady_clock::time_point timestamp;
+    uint64_t bytes = 0;
+};
+
+// The threads of one HomeShare, as HomeShare.cpp sets them up
+struct Node {
+    std::string pubkey = std::string(crypto_sign_PUBLICKEYBYTES, '\0');
+    std::string privkey = std::string(crypto_sign_SECRETKEYBYTES, '\0');
+    SocketThreadApi socketThread;
+    std::unique_ptr<ProgressTracker> progress;
+    std::unique_ptr<DiskThread> diskThread;
+    std::unique_ptr<Database> db;
+    std::unique_ptr<ReceiveThread> receiveThread;
+
+    std::mutex mutex;
+    Sample last;
+    int connections = 0;
+
+    Node(Logger* logger, const std::wstring& dir, const std::wstring& name) {
+        crypto_sign_keypair((unsigned char*)&pubkey[0], (unsigned char*)&privkey[0]);
+        socketThread.Init(logger, pubkey, privkey);
+        socketThread.setIsKnownContact([](const std::string&) { return true; });
+        progress.reset(new ProgressTracker(&socketThread));
+        progress->setUpdateCb([this](const Contact&, const ProgressUpdate& up) {
+            std::lock_guard<std::mutex> lock(mutex);
+            last.timestamp = up.timestamp;
+            last.bytes = up.recv.doneBytes;
+        });
+        diskThread.reset(new DiskThread(logger, &socketThread, progress.get()));
+        diskThread->Start();
+        std::wstring receivePath = dir + L"\\" + name;
+        CreateDirectory(receivePath.c_str(), nullptr);
+        // Without a partial file left from the last run, which would be resumed
+        DeleteFile((receivePath + L"\\big").c_str());
+        DeleteFile((receivePath + L"\\big.part").c_str());
+        std::wstring dbPath = dir + L"\\" + name + L".db";
+        DeleteFile(dbPath.c_str());
+        db.reset(new Database(*logger));
+        if (!db->OpenOrCreate(dbPath)) {
+            fprintf(stderr, "Can't create %ls\n", dbPath.c_str());
+            std::_Exit(1);
+        }
+        receiveThread.reset(new ReceiveThread(logger, &socketThread, progress.get(), diskThread.get(), db.get(),
+            receivePath, FileIo::create(FileIo::NATIVE)));
+        receiveThread->Start();
+        socketThread.setOnConnectCb([this](const Contact& c, bool connected) {
+            if (!connected) {
+                diskThread->ContactDisconnected(c);
+                receiveThread->ContactDisconnected(c);
+            }
+            // Connections closed before their handshake, like WaitForListener's, have no contact
+            if (!c.pubkey.empty()) {
+                std::lock_guard<std::mutex> lock(mutex);
+                connections += connected ? 1 : -1;
+            }
+        });
+    }
+
+    int Connections() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return connections;
+    }
+
+    Sample LastSample() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return last;
+    }
+};
+
+// Until the hub listens, so that no peer gets the port
+bool WaitForListener() {
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(PORT);
+    for (int i = 0; i < 500; i++) {
+        SOCKET s = socket(AF_INET, SOCK_STREAM, 0);
+        bool listening = connect(s, (sockaddr*)&addr, sizeof(addr)) == 0;
+        closesocket(s);
+        if (listening) {
+            return true;
+        }
+        Sleep(10);
+    }
+    return false;
+}
+
+bool WriteSourceFile(const std::wstring& path) {
+    HANDLE h = CreateFile(path.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (h == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    std::vector<char> chunk(1024 * 1024);
+    bool ok = true;
+    for (uint64_t done = 0; ok && done < FILE_SIZE; done += chunk.size()) {
+        memset(chunk.data(), (int)(done >> 20), chunk.size());
+        DWORD written;
+        ok = WriteFile(h, chunk.data(), (DWORD)chunk.size(), &written, nullptr) && written == chunk.size();
+    }
+    CloseHandle(h);
+    return ok;
+}
+
+int failures = 0;
+
+void Check(bool ok, const char* what, double value) {
+    if (!ok) {
+        printf("FAILED: %s (%g)\n", what, value);
+        failures++;
+    }
+}
+
+}
+
+int main() {
+    if (sodium_init() < 0) {
+        return 1;
+    }
+    wchar_t temp[MAX_PATH];
+    GetTempPath(MAX_PATH, temp);
+    std::wstring dir = std::wstring(temp) + L"HomeShareFairnessTest";
+    CreateDirectory(dir.c_str(), nullptr);
+    std::wstring source = dir + L"\\big";
+    if (!WriteSourceFile(source)) {
+        fprintf(stderr, "Can't write %ls\n", source.c_str());
+        return 1;
+    }
+
+    StderrLogger logger;
+    Node hub(&logger, dir, L"hub");
+    if (!WaitForListener()) {
+        fprintf(stderr, "Nothing listens on port %d\n", PORT);
+        std::_Exit(1);
+    }
+    std::vector<std::unique_ptr<Node>> peers;
+    for (int i = 0; i < PEERS; i++) {
+        peers.emplace_back(new Node(&logger, dir, L"peer" + std::to_wstring(i)));
+    }
+    for (int i = 0; i < PEERS; i++) {
+        hub.diskThread->setWeight(Contact{ peers[i]->pubkey }, WEIGHTS[i]);
+        peers[i]->socketThread.Connect(Contact{ hub.pubkey }, "127.0.0.1", PORT);
+    }
+    for (int i = 0; i < 1000 && hub.Connections() != PEERS; i++) {
+        Sleep(10);
+    }
+    if (hub.Connections() != PEERS) {
+        fprintf(stderr, "%d of %d peers connected\n", hub.Connections(), PEERS);
+        std::_Exit(1);
+    }
+    hub.diskThread->setRateLimit(RATE_LIMIT);
+    for (int i = 0; i < PEERS; i++) {
+        hub.diskThread->Enqueue(Contact{ peers[i]->pubkey }, source);
+    }
+
+    // Progress is only reported every 500 ms, and the first rounds fill the socket buffers
+    Sleep(1500);
+    Sample begin[PEERS];
+    for (int i = 0; i < PEERS; i++) {
+        begin[i] = peers[i]->LastSample();
+    }
+    Sleep(4000);
+    double rates[PEERS];
+    double total = 0;
+    uint32_t totalWeight = 0;
+    for (int i = 0; i < PEERS; i++) {
+        Sample end = peers[i]->LastSample();
+        double seconds = std::chrono::duration<double>(end.timestamp - begin[i].timestamp).count();
+        rates[i] = seconds > 0 ? (end.bytes - begin[i].bytes) / seconds : 0;
+        total += rates[i];
+        totalWeight += WEIGHTS[i];
+    }
+    for (int i = 0; i < PEERS; i++) {
+        double share = total > 0 ? rates[i] / total : 0;
+        double expected = (double)WEIGHTS[i] / totalWeight;
+        printf("Peer %d, weight %u: %5.1f MB/s, %4.1f%% of the upload\n", i, WEIGHTS[i], rates[i] / 1e6,
+            share * 100);
+        // A quantum or two of the 1 MB ones either way over the time measured
+        Check(fabs(share - expected) < 0.03, "the share of the upload follows the weight", share * 100);
+    }
+    printf("Total: %.1f MB/s, limit %.1f MB/s\n", total / 1e6, RATE_LIMIT / 1e6);
+    Check(fabs(total / RATE_LIMIT - 1) < 0.1, "the upload is within 10% of the global limit", total / 1e6);
+    fflush(stdout);
+    // The threads aren't made to stop
+    std::_Exit(failures != 0 ? 1 : 0);
+}
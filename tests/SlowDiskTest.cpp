@@ -0,0 +1,294 @@
+// Checks that receiving goes on to the end when the receiver's disk is slower than the network,
+// with several files on their own streams at once. The socket thread then stops reading from the
+// sender until the receive thread has handled enough of what it was given, which it must do even
+// with the data of each stream gathered into large writes. Two files are sent at once, then three,
+// then four: whether what two streams hold can stop receiving depends on how their writes line up.
+//
+// Build and run from the repository root, in a Developer Command Prompt:
+//   cl /std:c++17 /EHsc /O2 /I. /Ilib /DUNICODE /D_UNICODE /DSTRICT /DWIN32_LEAN_AND_MEAN /DFMT_HEADER_ONLY
+//       /DSODIUM_STATIC tests\SlowDiskTest.cpp Database.cpp DiskThread.cpp ReceiveThread.cpp SocketThread.cpp
+//       TreeWalker.cpp lib\sqlite3.c lib\win\EventLoop.cpp lib\win\FileIo.cpp lib\win\MessageThread.cpp
+//       lib\win\vista.cpp lib\win\window.cpp libx64\libsodium-Release.lib ws2_32.lib user32.lib
+//   SlowDiskTest
+//
+// The receiver listens on port 8890, which must be free. The sender can't listen there too and
+// logs it. Files go to HomeShareSlowDiskTest in the temporary folder, and are left there until
+// the next run. Exits with 1 if receiving stopped before the end.
+
+#include "Database.h"
+#include "DiskThread.h"
+#include "ReceiveThread.h"
+#include "crypto.h"
+#include "socket.h"
+#include <windows.h>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+namespace {
+
+enum { PORT = 8890 };
+// Files sent at once, each on its stream, in each round
+const int ROUNDS[] = { 2, 3, 4 };
+// Smaller than files that are resumed, which wait for the receiver's answer before their data
+const uint64_t FILE_SIZE = 48 * 1024 * 1024;
+// About 25 MB/s, far slower than loopback
+const DWORD WRITE_MS_PER_MB = 40;
+// With no data received for this long, receiving has stopped for good
+const auto STALL_TIMEOUT = std::chrono::seconds(10);
+
+class StderrLogger : public Logger {
+protected:
+    bool shouldLog(LogLevel level) override {
+        return level <= W;
+    }
+    void logString(LogLevel level, const std::wstring& s) override {
+        fprintf(stderr, "%ls\n", s.c_str());
+    }
+};
+
+// Writes through another FileIo, after waiting as long as a slow disk would take. The receive
+// thread waits too, as it does for a blocking backend, and messages pile up meanwhile.
+class SlowFileIo : public FileIo {
+public:
+    SlowFileIo(std::unique_ptr<FileIo> io)
+        : io_(std::move(io))
+    {}
+
+    const char* name() const override { return io_->name(); }
+    File open(const std::wstring& filename, Mode mode) override { return io_->open(filename, mode); }
+    uint64_t size(File file) override { return io_->size(file); }
+    bool reserve(File file, uint64_t size) override { return io_->reserve(file, size); }
+    void close(File file) override { io_->close(file); }
+    void read(File file, uint64_t offset, void* data, uint32_t size, Callback cb) override {
+        io_->read(file, offset, data, size, std::move(cb));
+    }
+    void write(File file, uint64_t offset, const void* data, uint32_t size, Callback cb) override {
+        Sleep((DWORD)((uint64_t)size * WRITE_MS_PER_MB / (1024 * 1024)));
+        io_->write(file, offset, data, size, std::move(cb));
+    }
+    void submit() override { io_->submit(); }
+    void poll(bool wait) override { io_->poll(wait); }
+    size_t inFlight() const override { return io_->inFlight(); }
+    void registerMemory(void* data, size_t size) override { io_->registerMemory(data, size); }
+
+private:
+    std::unique_ptr<FileIo> io_;
+};
+
+// Those sent in each round, in dir
+std::vector<std::vector<std::wstring>> FileNamesByRound(const std::wstring& dir) {
+    std::vector<std::vector<std::wstring>> names;
+    for (int round = 0; round < (int)(sizeof(ROUNDS) / sizeof(ROUNDS[0])); round++) {
+        names.emplace_back();
+        for (int i = 0; i < ROUNDS[round]; i++) {
+            names.back().push_back(dir + L"\\file" + std::to_wstring(round) + L"-" + std::to_wstring(i));
+        }
+    }
+    return names;
+}
+
+std::vector<std::wstring> FileNames(const std::wstring& dir) {
+    std::vector<std::wstring> names;
+    for (const std::vector<std::wstring>& round : FileNamesByRound(dir)) {
+        names.insert(names.end(), round.begin(), round.end());
+    }
+    return names;
+}
+
+// The threads of one HomeShare, as HomeShare.cpp sets them up
+struct Node {
+    std::string pubkey = std::string(crypto_sign_PUBLICKEYBYTES, '\0');
+    std::string privkey = std::string(crypto_sign_SECRETKEYBYTES, '\0');
+    SocketThreadApi socketThread;
+    std::unique_ptr<ProgressTracker> progress;
+    std::unique_ptr<DiskThread> diskThread;
+    std::unique_ptr<Database> db;
+    std::unique_ptr<ReceiveThread> receiveThread;
+
+    std::mutex mutex;
+    uint64_t receivedBytes = 0;
+    int connections = 0;
+
+    Node(Logger* logger, const std::wstring& dir, const std::wstring& name, std::unique_ptr<FileIo> fileIo) {
+        crypto_sign_keypair((unsigned char*)&pubkey[0], (unsigned char*)&privkey[0]);
+        socketThread.Init(logger, pubkey, privkey);
+        socketThread.setIsKnownContact([](const std::string&) { return true; });
+        progress.reset(new ProgressTracker(&socketThread));
+        progress->setUpdateCb([this](const Contact&, const ProgressUpdate& up) {
+            std::lock_guard<std::mutex> lock(mutex);
+            receivedBytes = up.recv.doneBytes;
+        });
+        diskThread.reset(new DiskThread(logger, &socketThread, progress.get()));
+        diskThread->Start();
+        std::wstring receivePath = dir + L"\\" + name;
+        CreateDirectory(receivePath.c_str(), nullptr);
+        for (const std::wstring& filename : FileNames(receivePath)) {
+            DeleteFile(filename.c_str());
+            DeleteFile((filename + L".part").c_str());
+        }
+        std::wstring dbPath = dir + L"\\" + name + L".db";
+        DeleteFile(dbPath.c_str());
+        db.reset(new Database(*logger));
+        if (!db->OpenOrCreate(dbPath)) {
+            fprintf(stderr, "Can't create %ls\n", dbPath.c_str());
+            std::_Exit(1);
+        }
+        receiveThread.reset(new ReceiveThread(logger, &socketThread, progress.get(), diskThread.get(), db.get(),
+            receivePath, std::move(fileIo)));
+        receiveThread->Start();
+        socketThread.setOnConnectCb([this](const Contact& c, bool connected) {
+            if (!connected) {
+                diskThread->ContactDisconnected(c);
+                receiveThread->ContactDisconnected(c);
+            }
+            // Connections closed before their handshake, like WaitForListener's, have no contact
+            if (!c.pubkey.empty()) {
+                std::lock_guard<std::mutex> lock(mutex);
+                connections += connected ? 1 : -1;
+            }
+        });
+    }
+
+    int Connections() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return connections;
+    }
+
+    uint64_t ReceivedBytes() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return receivedBytes;
+    }
+};
+
+// Until the receiver listens, so that the sender doesn't get the port
+bool WaitForListener() {
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(PORT);
+    for (int i = 0; i < 500; i++) {
+        SOCKET s = socket(AF_INET, SOCK_STREAM, 0);
+        bool listening = connect(s, (sockaddr*)&addr, sizeof(addr)) == 0;
+        closesocket(s);
+        if (listening) {
+            return true;
+        }
+        Sleep(10);
+    }
+    return false;
+}
+
+bool WriteSourceFile(const std::wstring& path, int seed) {
+    HANDLE h = CreateFile(path.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (h == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    std::vector<char> chunk(1024 * 1024);
+    bool ok = true;
+    for (uint64_t done = 0; ok && done < FILE_SIZE; done += chunk.size()) {
+        memset(chunk.data(), (int)(done >> 20) + seed, chunk.size());
+        DWORD written;
+        ok = WriteFile(h, chunk.data(), (DWORD)chunk.size(), &written, nullptr) && written == chunk.size();
+    }
+    CloseHandle(h);
+    return ok;
+}
+
+// Once the receive thread is done with it, the file loses its .part and its hash matched
+bool Received(const std::wstring& path) {
+    HANDLE h = CreateFile(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL,
+        nullptr);
+    if (h == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    CloseHandle(h);
+    return true;
+}
+
+// Sends the files at once, and waits until all are received. False if receiving stopped.
+bool RunRound(Node& sender, Node& receiver, const std::vector<std::wstring>& sources,
+    const std::vector<std::wstring>& destinations) {
+    uint64_t startBytes = receiver.ReceivedBytes();
+    for (const std::wstring& source : sources) {
+        sender.diskThread->Enqueue(Contact{ receiver.pubkey }, source);
+    }
+    auto start = std::chrono::steady_clock::now();
+    auto lastProgress = start;
+    uint64_t lastBytes = startBytes;
+    for (;;) {
+        size_t received = 0;
+        for (const std::wstring& destination : destinations) {
+            received += Received(destination) ? 1 : 0;
+        }
+        if (received == destinations.size()) {
+            break;
+        }
+        auto now = std::chrono::steady_clock::now();
+        uint64_t bytes = receiver.ReceivedBytes();
+        if (bytes != lastBytes) {
+            lastBytes = bytes;
+            lastProgress = now;
+        } else if (now - lastProgress > STALL_TIMEOUT) {
+            printf("FAILED: receiving %zu files stopped after %llu of %llu bytes\n", sources.size(),
+                (unsigned long long)(bytes - startBytes), (unsigned long long)(sources.size() * FILE_SIZE));
+            return false;
+        }
+        Sleep(100);
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("Received %zu files of %llu MB at once in %.1f s\n", sources.size(),
+        (unsigned long long)(FILE_SIZE >> 20), seconds);
+    return true;
+}
+
+}
+
+int main() {
+    if (sodium_init() < 0) {
+        return 1;
+    }
+    wchar_t temp[MAX_PATH];
+    GetTempPath(MAX_PATH, temp);
+    std::wstring dir = std::wstring(temp) + L"HomeShareSlowDiskTest";
+    CreateDirectory(dir.c_str(), nullptr);
+    std::wstring sourceDir = dir + L"\\source";
+    CreateDirectory(sourceDir.c_str(), nullptr);
+    std::vector<std::wstring> sources = FileNames(sourceDir);
+    for (size_t i = 0; i < sources.size(); i++) {
+        if (!WriteSourceFile(sources[i], (int)i)) {
+            fprintf(stderr, "Can't write %ls\n", sources[i].c_str());
+            return 1;
+        }
+    }
+
+    StderrLogger logger;
+    Node receiver(&logger, dir, L"receiver",
+        std::unique_ptr<FileIo>(new SlowFileIo(FileIo::create(FileIo::NATIVE))));
+    if (!WaitForListener()) {
+        fprintf(stderr, "Nothing listens on port %d\n", PORT);
+        std::_Exit(1);
+    }
+    Node sender(&logger, dir, L"sender", FileIo::create(FileIo::NATIVE));
+    sender.socketThread.Connect(Contact{ receiver.pubkey }, "127.0.0.1", PORT);
+    for (int i = 0; i < 1000 && sender.Connections() != 1; i++) {
+        Sleep(10);
+    }
+    if (sender.Connections() != 1) {
+        fprintf(stderr, "Couldn't connect\n");
+        std::_Exit(1);
+    }
+
+    std::vector<std::vector<std::wstring>> sourceRounds = FileNamesByRound(sourceDir);
+    std::vector<std::vector<std::wstring>> destinationRounds = FileNamesByRound(dir + L"\\receiver");
+    bool ok = true;
+    for (size_t round = 0; ok && round < sourceRounds.size(); round++) {
+        ok = RunRound(sender, receiver, sourceRounds[round], destinationRounds[round]);
+    }
+    fflush(stdout);
+    // The threads aren't made to stop
+    std::_Exit(ok ? 0 : 1);
+}
@@ -0,0 +1,167 @@
+// Checks the pacing of TokenBucket as DiskThread uses it: a send is allowed when delay() is zero,
+// then consume() takes its size, possibly going into debt. The long term rate must be the limit
+// whatever the send sizes and how late the timer wakes up the sender, and no more than the burst
+// may go out at once after being idle. Most checks run on a simulated clock, the last one sleeps.
+//
+// Build and run, from the repository root:
+//   g++ -std=c++17 -O2 -Ilib -o TokenBucketTest tests/TokenBucketTest.cpp
+//   ./TokenBucketTest
+//
+// Prints each failed check and exits with 1 if any failed.
+
+#include "TokenBucket.h"
+#include <algorithm>
+#include <chrono>
+#include <math.h>
+#include <stdio.h>
+#include <thread>
+
+namespace {
+
+using Clock = TokenBucket::Clock;
+using std::chrono::milliseconds;
+
+int failures = 0;
+
+void Check(bool ok, const char* what, double value) {
+    if (!ok) {
+        printf("FAILED: %s (%g)\n", what, value);
+        failures++;
+    }
+}
+
+// Sends chunks for the given time, as fast as the bucket allows. The sender only wakes up on
+// multiples of tick, like a WM_TIMER. Returns the bytes per second that went out, or infinity
+// if the bucket lets more than maxBytes go out at once.
+double Pace(TokenBucket& bucket, Clock::time_point start, uint64_t chunk, Clock::duration tick,
+    Clock::duration duration, uint64_t maxBytes) {
+    Clock::time_point now = start;
+    uint64_t sent = 0;
+    while (now - start < duration) {
+        Clock::duration delay = bucket.delay(now);
+        if (delay == Clock::duration::zero()) {
+            bucket.consume(chunk, now);
+            sent += chunk;
+            if (sent > maxBytes) {
+                return INFINITY;
+            }
+            continue;
+        }
+        // Rounded up to the next tick, the way a coarse timer fires late
+        Clock::duration ticks = (delay + tick - Clock::duration(1)) / tick * tick;
+        now += ticks;
+    }
+    return sent / std::chrono::duration<double>(now - start).count();
+}
+
+void TestPacing() {
+    const uint64_t RATE = 10 * 1000 * 1000;
+    // As DiskThread::RateLimitBurst sets it, 200 ms worth. The ticks must be shorter, or the
+    // tokens of a tick overflow the bucket and the rate can't be reached.
+    const uint64_t BURST = std::max<uint64_t>(64 * 1024, RATE / 5);
+    const uint64_t CHUNKS[] = { 4 * 1024, 64 * 1024, 1024 * 1024 };
+    const Clock::duration TICKS[] = { milliseconds(1), std::chrono::microseconds(15625), milliseconds(100) };
+    for (uint64_t chunk : CHUNKS) {
+        for (Clock::duration tick : TICKS) {
+            TokenBucket bucket;
+            bucket.setRate(RATE, BURST);
+            // After setRate, which reads the clock
+            Clock::time_point start = Clock::now() + milliseconds(1);
+            double rate = Pace(bucket, start, chunk, tick, std::chrono::seconds(60), RATE * 120);
+            double error = fabs(rate / RATE - 1);
+            // Sends of up to one chunk past the end, and timer ticks, don't add up over a minute
+            Check(error < 0.01, "paced rate is within 1% of the limit", rate);
+        }
+    }
+}
+
+void TestBurstAfterIdle() {
+    const uint64_t RATE = 1000 * 1000;
+    const uint64_t BURST = 200 * 1000;
+    const uint64_t CHUNK = 10 * 1000;
+    TokenBucket bucket;
+    bucket.setRate(RATE, BURST);
+    Clock::time_point now = Clock::now() + std::chrono::seconds(10);
+    uint64_t sent = 0;
+    while (bucket.delay(now) == Clock::duration::zero() && sent <= 100 * BURST) {
+        bucket.consume(CHUNK, now);
+        sent += CHUNK;
+    }
+    // The tokens of 10 s idle are capped at the burst, and a send may go one chunk into debt
+    Check(sent >= BURST && sent <= BURST + CHUNK, "sent at once after idle is the burst", (double)sent);
+    // The debt is then repaid at the rate
+    Clock::duration delay = bucket.delay(now);
+    double expected = (sent - BURST) / (double)RATE;
+    Check(fabs(std::chrono::duration<double>(delay).count() - expected) < 1e-3,
+        "the next send waits for the debt", std::chrono::duration<double>(delay).count());
+}
+
+void TestDebt() {
+    const uint64_t RATE = 1000 * 1000;
+    TokenBucket bucket;
+    bucket.setRate(RATE, 64 * 1024);
+    Clock::time_point now = Clock::now() + milliseconds(1);
+    // Drain what accumulated since setRate, then one send far larger than the burst
+    bucket.consume(64 * 1024, now);
+    Clock::duration wait = bucket.delay(now);
+    now += wait;
+    bucket.consume(5 * RATE, now);
+    double seconds = std::chrono::duration<double>(bucket.delay(now)).count();
+    Check(fabs(seconds - 5) < 1e-3, "a 5 s send waits 5 s", seconds);
+    now += bucket.delay(now);
+    Check(bucket.delay(now) == Clock::duration::zero(), "sending is allowed once the debt is repaid", 0);
+}
+
+void TestUnlimited() {
+    TokenBucket bucket;
+    Clock::time_point now = Clock::now();
+    Check(!bucket.isLimited(), "a new bucket is not limited", 0);
+    for (int i = 0; i < 1000; i++) {
+        bucket.consume(1024 * 1024, now);
+    }
+    Check(bucket.delay(now) == Clock::duration::zero(), "no limit never waits", 0);
+
+    bucket.setRate(1000, 1000);
+    bucket.consume(1000 * 1000, now + milliseconds(1));
+    Check(bucket.delay(now + milliseconds(1)) > Clock::duration::zero(), "a limit applies once set", 0);
+    bucket.setRate(0, 0);
+    Check(bucket.delay(now + milliseconds(1)) == Clock::duration::zero(), "0 removes the limit", 0);
+}
+
+// On the real clock with real sleeps, as the disk thread waits for its timer
+void TestSleeping() {
+    const uint64_t RATE = 4 * 1000 * 1000;
+    const uint64_t CHUNK = 64 * 1024;
+    TokenBucket bucket;
+    bucket.setRate(RATE, CHUNK);
+    Clock::time_point start = Clock::now();
+    uint64_t sent = 0;
+    while (Clock::now() - start < std::chrono::seconds(2) && sent <= 100 * RATE) {
+        Clock::duration delay = bucket.delay(Clock::now());
+        if (delay > Clock::duration::zero()) {
+            std::this_thread::sleep_for(delay);
+            continue;
+        }
+        bucket.consume(CHUNK, Clock::now());
+        sent += CHUNK;
+    }
+    double rate = sent / std::chrono::duration<double>(Clock::now() - start).count();
+    // Late wakeups are made up for, up to the burst, but the scheduler may be slow here
+    Check(fabs(rate / RATE - 1) < 0.05, "sleeping sender gets within 5% of the limit", rate);
+}
+
+}
+
+int main() {
+    TestPacing();
+    TestBurstAfterIdle();
+    TestDebt();
+    TestUnlimited();
+    TestSleeping();
+    if (failures != 0) {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    printf("All checks passed\n");
+    return 0;
+}